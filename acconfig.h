@@ -42,6 +42,12 @@
 /* Define if we want to include rpc/types.h.  Crap BSDs put INADDR_LOOPBACK there. */
 #undef HAVEUSE_RPCTYPES_H
 
+/* Define if we want the sys/sdt.h static tracepoints (--enable-usdt).  */
+#undef HAVE_USDT
+
+/* Define if POSIX threads are available (-lpthread).  */
+#undef HAVE_PTHREAD
+
 @BOTTOM@
 
 /* Use the definitions: */
@@ -29,6 +29,7 @@
 
 int rcode;
 const char *config_text;
+struct revcache *revcache;
 
 static int used, avail;
 static char *buf;
@@ -78,6 +79,14 @@ void of_config(const struct optioninfo *oi, const char *arg, const char *arg2) {
   config_text= arg;
 }
 
+void of_cache(const struct optioninfo *oi, const char *arg, const char *arg2) {
+  int r;
+
+  if (revcache) usageerr("only one --cache may be given");
+  r= revcache_open(&revcache,arg);
+  if (r) sysfail("open cache",r);
+}
+
 void of_type(const struct optioninfo *oi, const char *arg, const char *arg2) {
   static const struct typename {
     adns_rrtype type;
@@ -243,6 +252,8 @@ int main(int argc, const char *const *argv) {
 
   for (;;) {
     for (;;) {
+      while (outstanding.head && outstanding.head->cached)
+	query_done(outstanding.head,outstanding.head->cached);
       qu= ov_asynch ? 0 : outstanding.head ? outstanding.head->qu : 0;
       r= adns_check(ads,&qu,&answer,&qun_v);
       if (r == EAGAIN) break;
@@ -270,5 +281,10 @@ int main(int argc, const char *const *argv) {
   }
 x_quit:
   if (fclose(stdout)) outerr();
+  if (revcache) {
+    r= revcache_close(revcache);
+    revcache= 0;
+    if (r) sysfail("update cache",r);
+  }
   quitnow(rcode);
 }
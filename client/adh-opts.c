@@ -63,6 +63,8 @@ static const struct optioninfo global_options[]= {
   { ot_desconly, "other global options:" },
   { ot_funcarg,          "Configuration to use instead of /etc/resolv.conf",
     0, "config",           0,0, of_config, "<config-text>" },
+  { ot_funcarg,          "Keep -i answers in <file> between runs",
+    0, "cache",            0,0, of_cache, "<file>" },
   { ot_func,             "Print version number",
     0, "version",          0,0, of_version },
   { ot_func,             "Print usage information",
@@ -77,6 +77,8 @@ static void prep_query(struct query_node **qun_r, int *quflags_r) {
   
   qun= malloc(sizeof(*qun));
   qun->pqfr= ov_pqfr;
+  qun->cached= 0;
+  qun->revaddr= ~0UL;
   if (ov_id) {
     qun->id= xstrsave(ov_id);
   } else {
@@ -116,6 +118,18 @@ void of_ptr(const struct optioninfo *oi, const char *arg, const char *arg2) {
   sockaddr_aton(arg,&a);
   prep_query(&qun,&quflags);
   qun->owner= xstrsave(arg);
+  if (revcache && a.addr.sa.sa_family == AF_INET &&
+      (ov_type == adns_r_none || ov_type == adns_r_ptr))
+    qun->revaddr= ntohl(a.addr.inet.sin_addr.s_addr);
+  if (qun->revaddr != ~0UL)
+    qun->cached= revcache_lookup(revcache,qun->revaddr,quflags);
+  if (qun->cached) {
+    qun->qu= 0;
+    LIST_LINK_TAIL(outstanding,qun);
+    /* Otherwise it's printed once the queries before it are done. */
+    if (ov_asynch) query_done(qun,qun->cached);
+    return;
+  }
   r= adns_submit_reverse(ads, &a.addr.sa,
 			 ov_type == adns_r_none ? adns_r_ptr : ov_type,
 			 quflags,
@@ -301,6 +315,8 @@ void query_done(struct query_node *qun, adns_answer *answer) {
     }
   }
   if (fflush(stdout)) outerr();
+  if (revcache && qun->revaddr != ~0UL && !qun->cached)
+    revcache_store(revcache,qun->revaddr,answer);
   free(answer);
   dequeue_query(qun);
 }
@@ -317,6 +333,7 @@ void of_cancel_id(const struct optioninfo *oi, const char *arg, const char *arg2
        qun && strcmp(qun->id,arg);
        qun= qun->next);
   if (!qun) return;
-  adns_cancel(qun->qu);
+  if (qun->qu) adns_cancel(qun->qu);
+  else free(qun->cached);
   dequeue_query(qun);
 }
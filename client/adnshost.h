@@ -47,6 +47,7 @@
 #include "adns.h"
 #include "dlist.h"
 #include "client.h"
+#include "revcache.h"
 
 #ifdef ADNS_REGRESS_TEST
 # include "hredirect.h"
@@ -85,7 +86,8 @@ extern int ov_tcp, ov_cname, ov_afflags, ov_v6map, ov_format;
 extern char *ov_id;
 extern struct perqueryflags_remember ov_pqfr;
 
-extern optfunc of_config, of_version, of_help, of_type, of_ptr, of_reverse;
+extern optfunc of_config, of_cache, of_version, of_help, of_type, of_ptr;
+extern optfunc of_reverse;
 extern optfunc of_asynch_id, of_cancel_id;
 
 const struct optioninfo *opt_findl(const char *opt);
@@ -99,6 +101,8 @@ struct query_node {
   struct perqueryflags_remember pqfr;
   char *id, *owner;
   adns_query qu;
+  adns_answer *cached; /* answer from revcache, if qu is 0 */
+  unsigned long revaddr; /* IPv4 address if the answer is cacheable, else ~0UL */
 };
 
 extern adns_state ads;
@@ -125,5 +129,6 @@ char *xstrsave(const char *str);
 
 extern int rcode;
 extern const char *config_text; /* 0 => use defaults */
+extern struct revcache *revcache; /* 0 => none */
 
 #endif
@@ -34,8 +34,13 @@
 
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -46,24 +51,38 @@
 #include "config.h"
 #include "adns.h"
 #include "client.h"
+#include "revcache.h"
 
 #ifdef ADNS_REGRESS_TEST
 # include "hredirect.h"
+#elif defined(HAVE_PTHREAD)
+# define USE_THREADS
+# include <pthread.h>
 #endif
 
 /* maximum number of concurrent DNS queries */
 #define MAXMAXPENDING 64000
 #define DEFMAXPENDING 2000
 
-/* maximum length of a line */
-#define MAXLINE 1024
+/* maximum size of the reorder window, in kilobytes */
+#define MAXWINDOW 1048576
+#define DEFWINDOW 16384
+
+/* maximum number of resolver threads */
+#define MAXTHREADS 64
+
+/* maximum number of remembered addresses */
+#define MAXMEMO 16777216
+#define DEFMEMO 65536
 
 /* option flags */
 #define OPT_DEBUG 1
 #define OPT_POLL 2
+#define OPT_TTL 4
 
 static const char *const progname= "adnslogres";
 static const char *config_text;
+static struct revcache *revcache;
 
 #define guard_null(str) ((str) ? (str) : "")
 
@@ -90,84 +109,414 @@ static void aargh(const char *cause) {
 /*
  * Parse the IP address and convert to a reverse domain name.
  */
-static char *ipaddr2domain(char *start, char **addr, char **rest) {
-  static char buf[30]; /* "123.123.123.123.in-addr.arpa.\0" */
-  char *ptrs[5];
-  int i;
+#define DOMAINBUF 30 /* "123.123.123.123.in-addr.arpa.\0" */
 
-  ptrs[0]= start;
+static char *ipaddr2domain(char *start, char *end, char **addr, char **rest,
+			   char buf[DOMAINBUF], unsigned long *binaddr) {
+  char *seg[4], *p, *q;
+  int i, j, len[4], octet;
+
+  p= start;
 retry:
-  while (!sensible_ctype(isdigit,*ptrs[0]))
-    if (!*ptrs[0]++) {
-      strcpy(buf, "invalid.");
-      *addr= *rest= NULL;
-      return buf;
-    }
-  for (i= 1; i < 5; i++) {
-    ptrs[i]= ptrs[i-1];
-    while (sensible_ctype(isdigit,*ptrs[i]++));
-    if ((i == 4 && !sensible_ctype(isspace,ptrs[i][-1])) ||
-	(i != 4 && ptrs[i][-1] != '.') ||
-	(ptrs[i]-ptrs[i-1] > 4)) {
-      ptrs[0]= ptrs[i]-1;
+  while (p < end && !sensible_ctype(isdigit,*p)) p++;
+  if (p == end) {
+    strcpy(buf, "invalid.");
+    *addr= *rest= NULL;
+    *binaddr= ~0UL;
+    return buf;
+  }
+  for (i= 0; i < 4; i++) {
+    seg[i]= p;
+    while (p < end && sensible_ctype(isdigit,*p)) p++;
+    len[i]= p - seg[i];
+    if (len[i] > 3 || p == end ||
+	(i == 3 && !sensible_ctype(isspace,*p)) ||
+	(i != 3 && *p != '.'))
       goto retry;
-    }
+    if (i != 3) p++;
+  }
+  for (i= 3, q= buf; i >= 0; i--) {
+    memcpy(q, seg[i], len[i]);
+    q+= len[i];
+    *q++= '.';
+  }
+  strcpy(q, "in-addr.arpa.");
+  *binaddr= 0;
+  for (i= 0; i < 4; i++) {
+    for (j= 0, octet= 0; j < len[i]; j++) octet= octet*10 + seg[i][j] - '0';
+    if (!len[i] || octet > 255) { *binaddr= ~0UL; break; }
+    *binaddr= (*binaddr << 8) | octet;
   }
-  sprintf(buf, "%.*s.%.*s.%.*s.%.*s.in-addr.arpa.",
-	  (int)(ptrs[4]-ptrs[3]-1), ptrs[3],
-	  (int)(ptrs[3]-ptrs[2]-1), ptrs[2],
-	  (int)(ptrs[2]-ptrs[1]-1), ptrs[1],
-	  (int)(ptrs[1]-ptrs[0]-1), ptrs[0]);
-  *addr= ptrs[0];
-  *rest= ptrs[4]-1;
+  *addr= seg[0];
+  *rest= p;
   return buf;
 }
 
-static void printline(FILE *outf, char *start, char *addr, char *rest, char *domain) {
-  if (domain)
-    fprintf(outf, "%.*s%s%s", (int)(addr - start), start, domain, rest);
-  else
-    fputs(start, outf);
-  if (ferror(outf)) aargh("write output");
-}
+/*
+ * The input is either mapped in its entirety, or read in large
+ * chunks.  Either way lines are referred to where they lie; a chunk
+ * is freed when no line refers to it any more.
+ */
+#define CHUNKSIZE 65536
+
+typedef struct inchunk {
+  int refs;
+  size_t size;
+  char data[1];
+} inchunk;
+
+typedef struct input {
+  int fd, eof;
+  char *p, *end; /* data not yet split into lines */
+  inchunk *chunk; /* which p points into, or NULL if mapped */
+  void *map;
+  size_t maplen;
+} input;
+
+typedef struct memo {
+  struct memo *hnext; /* hash chain */
+  struct memo *older, *newer; /* LRU list */
+  unsigned long addr;
+  int refs, intable;
+  adns_answer *answer; /* NULL while the lookup is outstanding */
+} memo;
 
 typedef struct logline {
-  struct logline *next;
-  char *start, *addr, *rest;
-  adns_query query;
+  struct logline *next, *wnext;
+  char *start, *addr, *rest, *end;
+  inchunk *chunk;
+  memo *memo; /* if set, the answer is memo->answer */
+  adns_answer *answer;
+  unsigned long binaddr; /* ~0UL if none */
+  char domain[DOMAINBUF];
 } logline;
 
-static logline *readline(FILE *inf, adns_state adns, int opts) {
-  static char buf[MAXLINE];
-  char *str;
+static void chunkunref(inchunk *chunk) {
+  if (chunk && !--chunk->refs) free(chunk);
+}
+
+static void openinput(input *in, int fd) {
+  struct stat stab;
+  off_t pos;
+
+  in->fd= fd;
+  in->eof= 0;
+  in->p= in->end= NULL;
+  in->chunk= NULL;
+  in->map= NULL;
+  in->maplen= 0;
+  if (fstat(fd, &stab) || !S_ISREG(stab.st_mode) || stab.st_size <= 0 ||
+      (off_t)(size_t)stab.st_size != stab.st_size)
+    return;
+  pos= lseek(fd, 0, SEEK_CUR);
+  if (pos < 0 || pos > stab.st_size) return;
+  in->map= mmap(NULL, stab.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (in->map == MAP_FAILED) { in->map= NULL; return; }
+#ifdef MADV_SEQUENTIAL
+  madvise(in->map, stab.st_size, MADV_SEQUENTIAL);
+#endif
+  in->maplen= stab.st_size;
+  in->p= (char*)in->map + pos;
+  in->end= (char*)in->map + in->maplen;
+  in->eof= 1;
+}
+
+static void closeinput(input *in) {
+  if (in->map) munmap(in->map, in->maplen);
+  chunkunref(in->chunk);
+}
+
+static int nextline(input *in, char **startr, char **endr) {
+  inchunk *chunk;
+  char *nl;
+  size_t have, size;
+  ssize_t r;
+
+  for (;;) {
+    nl= in->p ? memchr(in->p, '\n', in->end - in->p) : NULL;
+    if (nl || (in->eof && in->p < in->end)) {
+      *startr= in->p;
+      *endr= in->p= nl ? nl+1 : in->end;
+      return 1;
+    }
+    if (in->eof) return 0;
+    have= in->end - in->p;
+    if (!in->chunk || in->end == in->chunk->data + in->chunk->size) {
+      /* start a new chunk, taking the partial line with us */
+      size= CHUNKSIZE;
+      while (size < have*2) size*= 2;
+      chunk= malloc(sizeof(*chunk) + size);
+      if (!chunk) aargh("malloc");
+      chunk->refs= 1;
+      chunk->size= size;
+      if (have) memcpy(chunk->data, in->p, have);
+      chunkunref(in->chunk);
+      in->chunk= chunk;
+      in->p= chunk->data;
+      in->end= chunk->data + have;
+    }
+    r= read(in->fd, in->end, in->chunk->data + in->chunk->size - in->end);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      aargh("read input");
+    }
+    if (r == 0) in->eof= 1;
+    in->end+= r;
+  }
+}
+
+/*
+ * Line records are handed out from blocks and recycled, rather than
+ * being allocated one by one.
+ */
+#define LINESPERBLOCK 1024
+
+static logline *freelines;
+
+static logline *newline(void) {
+  logline *block, *line;
+  int i;
+
+  if (!freelines) {
+    block= malloc(sizeof(*block) * LINESPERBLOCK);
+    if (!block) aargh("malloc");
+    for (i= 0; i < LINESPERBLOCK; i++) {
+      block[i].next= freelines;
+      freelines= &block[i];
+    }
+  }
+  line= freelines;
+  freelines= line->next;
+  return line;
+}
+
+/*
+ * Answers are remembered by binary address, so that a repeated client
+ * only costs one lookup.  A line whose address is already known, or
+ * is being looked up, just takes a reference to the memo entry.  The
+ * table holds the most recently used entries, up to memomax; with -T
+ * an entry is forgotten once the answer's TTL has run out.  Temporary
+ * failures are not remembered beyond the lines already waiting.
+ */
+static memo **memotable, *memonewest, *memooldest;
+static unsigned long memomask;
+static int memomax, nmemo;
+
+static unsigned long memohash(unsigned long addr) {
+  addr= ((addr >> 16) ^ addr) * 0x45d9f3bUL;
+  return ((addr >> 16) ^ addr) & memomask;
+}
+
+static void memounref(memo *m) {
+  if (--m->refs) return;
+  free(m->answer);
+  free(m);
+}
+
+static void memoforget(memo *m) {
+  memo **mp;
+
+  for (mp= &memotable[memohash(m->addr)]; *mp != m; mp= &(*mp)->hnext);
+  *mp= m->hnext;
+  if (m->older) m->older->newer= m->newer;
+  else memooldest= m->newer;
+  if (m->newer) m->newer->older= m->older;
+  else memonewest= m->older;
+  m->intable= 0;
+  nmemo--;
+  memounref(m);
+}
+
+static memo *memolookup(unsigned long addr, int opts, int *isnew) {
+  /* Returns a referenced entry, or NULL if addr should not be
+   * remembered. */
+  struct timeval now;
+  unsigned long size;
+  memo *m;
+
+  if (!memomax || addr == ~0UL) return NULL;
+  if (!memotable) {
+    for (size= 1; size < (unsigned long)memomax; size<<= 1);
+    memotable= calloc(size, sizeof(*memotable));
+    if (!memotable) aargh("calloc");
+    memomask= size-1;
+  }
+  for (m= memotable[memohash(addr)]; m; m= m->hnext)
+    if (m->addr == addr) break;
+  if (m && m->answer && (opts & OPT_TTL)) {
+    gettimeofday(&now, 0);
+    if (m->answer->expires < now.tv_sec) { memoforget(m); m= NULL; }
+  }
+  if (m) {
+    if (m->newer) {
+      if (m->older) m->older->newer= m->newer;
+      else memooldest= m->newer;
+      m->newer->older= m->older;
+      m->older= memonewest; m->newer= NULL;
+      memonewest->newer= m; memonewest= m;
+    }
+    m->refs++;
+    *isnew= 0;
+    return m;
+  }
+  m= malloc(sizeof(*m));
+  if (!m) aargh("malloc");
+  m->addr= addr;
+  m->answer= NULL;
+  m->refs= 2;
+  m->intable= 1;
+  m->hnext= memotable[memohash(addr)];
+  memotable[memohash(addr)]= m;
+  m->older= memonewest; m->newer= NULL;
+  if (memonewest) memonewest->newer= m;
+  else memooldest= m;
+  memonewest= m;
+  if (++nmemo > memomax) memoforget(memooldest);
+  *isnew= 1;
+  return m;
+}
+
+static void setanswer(logline *line, adns_answer *answer) {
+  memo *m= line->memo;
+
+  if (revcache && line->binaddr != ~0UL)
+    revcache_store(revcache, line->binaddr, answer);
+  if (!m) { line->answer= answer; return; }
+  m->answer= answer;
+  if (m->intable && answer->status != adns_s_ok &&
+      answer->status <= adns_s_max_tempfail)
+    memoforget(m);
+}
+
+static adns_answer *lineanswer(logline *line) {
+  return line->memo ? line->memo->answer : line->answer;
+}
+
+static void freeline(logline *line) {
+  chunkunref(line->chunk);
+  if (line->memo) memounref(line->memo);
+  else free(line->answer);
+  line->next= freelines;
+  freelines= line;
+}
+
+/*
+ * Finished lines are gathered up and written with writev, several
+ * hundred at a time, and only then freed, since the iovecs refer to
+ * the input and to the answers.
+ */
+#if defined(IOV_MAX) && IOV_MAX < 1024
+# define MAXIOV IOV_MAX
+#else
+# define MAXIOV 1024
+#endif
+
+static struct iovec outiov[MAXIOV];
+static int noutiov;
+static logline *outlines;
+
+static void flushoutput(void) {
+  struct iovec *iov;
   logline *line;
+  ssize_t r;
+  int n;
+
+  iov= outiov; n= noutiov;
+  while (n) {
+    r= writev(1, iov, n);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      aargh("write output");
+    }
+    while (n && (size_t)r >= iov->iov_len) {
+      r-= iov->iov_len;
+      iov++; n--;
+    }
+    if (n) {
+      iov->iov_base= (char*)iov->iov_base + r;
+      iov->iov_len-= r;
+    }
+  }
+  noutiov= 0;
+  while ((line= outlines)) {
+    outlines= line->next;
+    freeline(line);
+  }
+}
+
+static void addoutput(void *p, size_t len) {
+  if (!len) return;
+  outiov[noutiov].iov_base= p;
+  outiov[noutiov].iov_len= len;
+  noutiov++;
+}
+
+static void printline(logline *line) {
+  adns_answer *answer= lineanswer(line);
+
+  if (noutiov > MAXIOV-3) flushoutput();
+  if (answer->status == adns_s_ok) {
+    addoutput(line->start, line->addr - line->start);
+    addoutput(*answer->rrs.str, strlen(*answer->rrs.str));
+    addoutput(line->rest, line->end - line->rest);
+  } else {
+    addoutput(line->start, line->end - line->start);
+  }
+  line->next= outlines;
+  outlines= line;
+}
+
+static logline *readline(input *in) {
+  char *start, *end;
+  logline *line;
+
+  if (!nextline(in, &start, &end)) return NULL;
+  line= newline();
+  line->next= NULL;
+  line->start= start;
+  line->end= end;
+  line->chunk= in->chunk;
+  if (line->chunk) line->chunk->refs++;
+  line->memo= NULL;
+  line->answer= NULL;
+  ipaddr2domain(start, end, &line->addr, &line->rest, line->domain,
+		&line->binaddr);
+  return line;
+}
+
+static int needlookup(logline *line, int opts) {
+  adns_answer *answer;
+  int isnew;
 
-  if (fgets(buf, MAXLINE, inf)) {
-    str= malloc(sizeof(*line) + strlen(buf) + 1);
-    if (!str) aargh("malloc");
-    line= (logline*)str;
-    line->next= NULL;
-    line->start= str+sizeof(logline);
-    strcpy(line->start, buf);
-    str= ipaddr2domain(line->start, &line->addr, &line->rest);
+  line->memo= memolookup(line->binaddr, opts, &isnew);
+  if (!line->memo || isnew) {
+    if (!revcache || line->binaddr == ~0UL) return 1;
+    answer= revcache_lookup(revcache, line->binaddr, 0);
+    if (!answer) return 1;
     if (opts & OPT_DEBUG)
-      msg("submitting %.*s -> %s", (int)(line->rest-line->addr), guard_null(line->addr), str);
-    if (adns_submit(adns, str, adns_r_ptr,
-		    adns_qf_quoteok_cname|adns_qf_cname_loose,
-		    NULL, &line->query))
-      aargh("adns_submit");
-    return line;
+      msg("cached %.*s", (int)(line->rest-line->addr), line->addr);
+    if (line->memo) line->memo->answer= answer;
+    else line->answer= answer;
+    return 0;
   }
-  if (!feof(inf))
-    aargh("fgets");
-  return NULL;
+  if (opts & OPT_DEBUG)
+    msg("remembered %.*s", (int)(line->rest-line->addr), line->addr);
+  return 0;
+}
+
+static void submitline(adns_state adns, logline *line, int opts) {
+  adns_query query;
+
+  if (opts & OPT_DEBUG)
+    msg("submitting %.*s -> %s", (int)(line->rest-line->addr), guard_null(line->addr), line->domain);
+  if (adns_submit(adns, line->domain, adns_r_ptr,
+		  adns_qf_quoteok_cname|adns_qf_cname_loose,
+		  line, &query))
+    aargh("adns_submit");
 }
-	
-static void proclog(FILE *inf, FILE *outf, int maxpending, int opts) {
-  int eof, err, len;
+
+static adns_state initadns(int opts) {
   adns_state adns;
-  adns_answer *answer;
-  logline *head, *tail, *line;
   adns_initflags initflags;
 
   initflags= (opts & OPT_DEBUG) ? adns_if_debug : 0;
@@ -177,51 +526,310 @@ static void proclog(FILE *inf, FILE *outf, int maxpending, int opts) {
     errno= adns_init(&adns, initflags, 0);
   }
   if (errno) aargh("adns_init");
-  head= tail= readline(inf, adns, opts);
-  len= 1; eof= 0;
-  while (head) {
-    while (head) {
+  return adns;
+}
+
+#define LINESIZE(line) (sizeof(logline) + ((line)->end - (line)->start))
+
+/*
+ * Queries are collected in whatever order they complete, and each
+ * answer is attached to its line.  Lines are written out, in input
+ * order, as soon as everything before them has been written, so one
+ * slow lookup only holds up the output behind it.  Reading and
+ * submitting carry on meanwhile until either maxpending queries are
+ * outstanding or the lines held in memory reach the window size.
+ */
+static void proclog(input *in, int maxpending, size_t window, int opts) {
+  int eof, err, outstanding;
+  size_t held;
+  adns_state adns;
+  adns_answer *answer;
+  adns_query query;
+  logline *head, *tail, *line;
+  void *context;
+
+  adns= initadns(opts);
+  head= tail= NULL;
+  outstanding= 0; held= 0; eof= 0;
+  for (;;) {
+    while (outstanding) {
       if (opts & OPT_DEBUG)
-	msg("%d in queue; checking %.*s", len,
-	    (int)(head->rest-head->addr), guard_null(head->addr));
-      if (eof || len >= maxpending) {
+	msg("%d outstanding, %lu bytes held; checking",
+	    outstanding, (unsigned long)held);
+      query= NULL;
+      if (eof || outstanding >= maxpending || held >= window) {
+	if (noutiov) flushoutput();
 	if (opts & OPT_POLL)
-	  err= adns_wait_poll(adns, &head->query, &answer, NULL);
+	  err= adns_wait_poll(adns, &query, &answer, &context);
 	else
-	  err= adns_wait(adns, &head->query, &answer, NULL);
+	  err= adns_wait(adns, &query, &answer, &context);
       } else {
-	err= adns_check(adns, &head->query, &answer, NULL);
+	err= adns_check(adns, &query, &answer, &context);
       }
       if (err == EAGAIN) break;
       if (err) {
 	fprintf(stderr, "%s: adns_wait/check: %s", progname, strerror(err));
 	exit(1);
       }
-      printline(outf, head->start, head->addr, head->rest,
-		answer->status == adns_s_ok ? *answer->rrs.str : NULL);
+      setanswer(context, answer);
+      outstanding--;
+      while (head && lineanswer(head)) {
+	line= head; head= head->next;
+	held-= LINESIZE(line);
+	printline(line);
+      }
+    }
+    while (head && lineanswer(head)) {
       line= head; head= head->next;
-      free(line);
-      free(answer);
-      len--;
+      held-= LINESIZE(line);
+      printline(line);
     }
-    if (!eof) {
-      line= readline(inf, adns, opts);
-      if (line) {
-        if (!head) head= line;
-        else tail->next= line;
-        tail= line; len++;
-      } else {
-	eof= 1;
+    if (eof) break;
+    line= readline(in);
+    if (line) {
+      if (needlookup(line, opts)) {
+	submitline(adns, line, opts);
+	outstanding++;
+      }
+      if (!head) head= line;
+      else tail->next= line;
+      tail= line;
+      held+= LINESIZE(line);
+    } else {
+      eof= 1;
+    }
+  }
+  flushoutput();
+  adns_finish(adns);
+}
+
+#ifdef USE_THREADS
+
+/*
+ * With -t, lines are shared out between worker threads, each with its
+ * own adns_state, by hashing the reverse name, so repeated addresses
+ * always go to the same worker.  The main thread does all the
+ * reading, the line, chunk and memo bookkeeping and the output;
+ * workers only submit queries and pass back the answers.  The main
+ * thread hands lines over in batches, and is woken when answers come
+ * back.
+ */
+#define HANDOVER 64
+
+typedef struct worker {
+  pthread_t thread;
+  int wakefd[2];
+  logline *queued, *queuedtail; /* handed over, protected by lock */
+  logline *batch, *batchtail; /* not yet handed over, main thread only */
+  int eof;
+  int opts;
+} worker;
+
+static pthread_mutex_t lock= PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t answered= PTHREAD_COND_INITIALIZER;
+static unsigned long nanswered;
+static logline *completed; /* chained by wnext, protected by lock */
+
+static unsigned hashdomain(const char *p) {
+  unsigned h= 2166136261U;
+
+  while (*p) { h^= (unsigned char)*p++; h*= 16777619U; }
+  return h;
+}
+
+static void *workermain(void *wv) {
+  worker *w= wv;
+  adns_state adns;
+  adns_answer *answer;
+  adns_query query;
+  logline *line, *got;
+  fd_set rfds, wfds, efds;
+  struct timeval tvbuf, *tv, now;
+  int outstanding, eof, maxfd, r, err, ndone;
+  char drain[64];
+  void *context;
+
+  adns= initadns(w->opts);
+  outstanding= 0;
+  for (;;) {
+    pthread_mutex_lock(&lock);
+    got= w->queued;
+    w->queued= w->queuedtail= NULL;
+    eof= w->eof;
+    pthread_mutex_unlock(&lock);
+    for (line= got; line; line= line->wnext) {
+      submitline(adns, line, w->opts);
+      outstanding++;
+    }
+    if (eof && !outstanding) break;
+
+    maxfd= w->wakefd[0]+1; tv= NULL;
+    FD_ZERO(&rfds); FD_ZERO(&wfds); FD_ZERO(&efds);
+    FD_SET(w->wakefd[0], &rfds);
+    if (outstanding)
+      adns_beforeselect(adns, &maxfd, &rfds, &wfds, &efds, &tv, &tvbuf, 0);
+    r= select(maxfd, &rfds, &wfds, &efds, tv);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      aargh("select");
+    }
+    if (FD_ISSET(w->wakefd[0], &rfds))
+      while (read(w->wakefd[0], drain, sizeof(drain)) > 0);
+    if (!outstanding) continue;
+    gettimeofday(&now, 0);
+    adns_afterselect(adns, maxfd, &rfds, &wfds, &efds, &now);
+
+    ndone= 0;
+    for (;;) {
+      query= NULL;
+      err= adns_check(adns, &query, &answer, &context);
+      if (err == EAGAIN || err == ESRCH) break;
+      if (err) {
+	fprintf(stderr, "%s: adns_check: %s", progname, strerror(err));
+	exit(1);
       }
+      line= context;
+      pthread_mutex_lock(&lock);
+      line->answer= answer;
+      line->wnext= completed;
+      completed= line;
+      pthread_mutex_unlock(&lock);
+      outstanding--; ndone++;
+    }
+    if (ndone) {
+      pthread_mutex_lock(&lock);
+      nanswered+= ndone;
+      pthread_cond_signal(&answered);
+      pthread_mutex_unlock(&lock);
     }
   }
   adns_finish(adns);
+  return NULL;
+}
+
+static void handover(worker *w, int eof) {
+  /* Call with lock held. */
+  int wake;
+
+  wake= !w->queued || eof;
+  if (w->batch) {
+    if (w->queued) w->queuedtail->wnext= w->batch;
+    else w->queued= w->batch;
+    w->queuedtail= w->batchtail;
+    w->batch= w->batchtail= NULL;
+  }
+  if (eof) w->eof= 1;
+  if (wake && write(w->wakefd[1], "", 1) < 0 && errno != EAGAIN)
+    aargh("write to worker");
+}
+
+static void proclogthreads(input *in, int maxpending, size_t window,
+			   int nthreads, int opts) {
+  worker *workers, *w;
+  adns_answer *answer;
+  logline *head, *tail, *line, *ready, **readytail;
+  unsigned long submitted, seen;
+  size_t held;
+  int eof, i, n;
+
+  workers= calloc(nthreads, sizeof(*workers));
+  if (!workers) aargh("calloc");
+  for (i= 0; i < nthreads; i++) {
+    w= &workers[i];
+    w->opts= opts;
+    if (pipe(w->wakefd)) aargh("pipe");
+    if (fcntl(w->wakefd[0], F_SETFL, O_NONBLOCK) ||
+	fcntl(w->wakefd[1], F_SETFL, O_NONBLOCK))
+      aargh("fcntl");
+    errno= pthread_create(&w->thread, NULL, workermain, w);
+    if (errno) aargh("pthread_create");
+  }
+
+  head= tail= NULL;
+  submitted= seen= 0; held= 0; eof= 0;
+  for (;;) {
+    for (n= 0;
+	 !eof && n < HANDOVER*nthreads &&
+	   submitted - seen < (unsigned long)maxpending && held < window;
+	 n++) {
+      line= readline(in);
+      if (!line) { eof= 1; break; }
+      if (needlookup(line, opts)) {
+	line->wnext= NULL;
+	w= &workers[hashdomain(line->domain) % nthreads];
+	if (w->batch) w->batchtail->wnext= line;
+	else w->batch= line;
+	w->batchtail= line;
+	submitted++;
+      }
+      if (!head) head= line;
+      else tail->next= line;
+      tail= line;
+      held+= LINESIZE(line);
+    }
+
+    pthread_mutex_lock(&lock);
+    for (i= 0; i < nthreads; i++)
+      if (workers[i].batch || (eof && !workers[i].eof))
+	handover(&workers[i], eof);
+    ready= NULL; readytail= &ready;
+    for (;;) {
+      seen= nanswered;
+      while ((line= completed)) {
+	completed= line->wnext;
+	answer= line->answer;
+	line->answer= NULL;
+	setanswer(line, answer);
+      }
+      while (head && lineanswer(head)) {
+	*readytail= head; readytail= &head->next;
+	head= head->next;
+      }
+      if (ready) break;
+      if (eof ? !head :
+	  submitted - seen < (unsigned long)maxpending && held < window)
+	break;
+      if (noutiov) {
+	pthread_mutex_unlock(&lock);
+	flushoutput();
+	pthread_mutex_lock(&lock);
+	continue;
+      }
+      pthread_cond_wait(&answered, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+    *readytail= NULL;
+
+    while ((line= ready)) {
+      ready= line->next;
+      held-= LINESIZE(line);
+      printline(line);
+    }
+    if (eof && !head) break;
+  }
+  flushoutput();
+
+  for (i= 0; i < nthreads; i++) {
+    w= &workers[i];
+    errno= pthread_join(w->thread, NULL);
+    if (errno) aargh("pthread_join");
+    close(w->wakefd[0]);
+    close(w->wakefd[1]);
+  }
+  free(workers);
 }
 
+#endif /* USE_THREADS */
+
 static void printhelp(FILE *file) {
   fputs("usage: adnslogres [<options>] [<logfile>]\n"
 	"       adnslogres --version|--help\n"
 	"options: -c <concurrency>  set max number of outstanding queries\n"
+	"         -w <kbytes>       set max size of the reorder window\n"
+	"         -t <threads>      share the lookups among several threads\n"
+	"         -m <entries>      remember at most this many addresses (0: none)\n"
+	"         -T                forget remembered names when their TTL expires\n"
+	"         -k <cachefile>    keep answers in this file between runs\n"
 	"         -p                use poll(2) instead of select(2)\n"
 	"         -d                turn on debugging\n"
 	"         -C <config>       use instead of contents of resolv.conf\n",
@@ -234,9 +842,10 @@ static void usage(void) {
 }
 
 int main(int argc, char *argv[]) {
-  int c, opts, maxpending;
+  int c, opts, maxpending, window, nthreads, infd;
+  const char *cachefile;
   extern char *optarg;
-  FILE *inf;
+  input in;
 
   if (argv[1] && !strncmp(argv[1],"--",2)) {
     if (!strcmp(argv[1],"--help")) {
@@ -251,8 +860,12 @@ int main(int argc, char *argv[]) {
   }
 
   maxpending= DEFMAXPENDING;
+  window= DEFWINDOW;
+  nthreads= 1;
+  memomax= DEFMEMO;
+  cachefile= NULL;
   opts= 0;
-  while ((c= getopt(argc, argv, "c:C:dp")) != -1)
+  while ((c= getopt(argc, argv, "c:w:t:m:k:C:dpT")) != -1)
     switch (c) {
     case 'c':
       maxpending= atoi(optarg);
@@ -261,6 +874,39 @@ int main(int argc, char *argv[]) {
        exit(1);
       }
       break;
+    case 'w':
+      window= atoi(optarg);
+      if (window < 1 || window > MAXWINDOW) {
+       fprintf(stderr, "%s: unfeasible window %d\n", progname, window);
+       exit(1);
+      }
+      break;
+    case 't':
+      nthreads= atoi(optarg);
+      if (nthreads < 1 || nthreads > MAXTHREADS) {
+       fprintf(stderr, "%s: unfeasible number of threads %d\n", progname, nthreads);
+       exit(1);
+      }
+#ifndef USE_THREADS
+      if (nthreads > 1) {
+       fprintf(stderr, "%s: threads not supported in this build\n", progname);
+       exit(1);
+      }
+#endif
+      break;
+    case 'm':
+      memomax= atoi(optarg);
+      if (memomax < 0 || memomax > MAXMEMO) {
+       fprintf(stderr, "%s: unfeasible number of entries %d\n", progname, memomax);
+       exit(1);
+      }
+      break;
+    case 'T':
+      opts|= OPT_TTL;
+      break;
+    case 'k':
+      cachefile= optarg;
+      break;
     case 'C':
       config_text= optarg;
       break;
@@ -277,23 +923,34 @@ int main(int argc, char *argv[]) {
   argc-= optind;
   argv+= optind;
 
-  inf= NULL;
   if (argc == 0)
-    inf= stdin;
+    infd= 0;
   else if (argc == 1)
-    inf= fopen(*argv, "r");
+    infd= open(*argv, O_RDONLY);
   else
     usage();
 
-  if (!inf)
+  if (infd < 0)
     aargh("couldn't open input");
+  if (cachefile) {
+    errno= revcache_open(&revcache, cachefile);
+    if (errno) aargh("couldn't open cache");
+  }
 
-  proclog(inf, stdout, maxpending, opts);
-
-  if (fclose(inf))
-    aargh("fclose input");
+  openinput(&in, infd);
+#ifdef USE_THREADS
+  if (nthreads > 1)
+    proclogthreads(&in, maxpending, (size_t)window*1024, nthreads, opts);
+  else
+#endif
+    proclog(&in, maxpending, (size_t)window*1024, opts);
+  closeinput(&in);
   if (fclose(stdout))
     aargh("fclose output");
+  if (revcache) {
+    errno= revcache_close(revcache);
+    if (errno) aargh("couldn't update cache");
+  }
 
   return 0;
 }
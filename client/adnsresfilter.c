@@ -28,58 +28,126 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <search.h>
 #include <assert.h>
 #include <ctype.h>
 
 #include <sys/types.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <arpa/inet.h>
 
 #include "config.h"
 #include "adns.h"
 #include "dlist.h"
 #include "tvarith.h"
 #include "client.h"
+#include "revcache.h"
 
 #ifdef ADNS_REGRESS_TEST
 # include "hredirect.h"
 #endif
 
-struct outqueuenode {
-  struct outqueuenode *next, *back;
-  char *buffer, *textp;
-  int textlen;
-  struct timeval printbefore;
-  struct treething *addr;
-};
-
-static int bracket, forever, address;
-static unsigned long timeout= 1000;
+static int bracket, forever, address, stats;
+static unsigned long timeout= 1000, maxthings= 65536;
 static adns_rrtype rrt= adns_r_ptr;
 static adns_initflags initflags= 0;
 static const char *config_text;
+static const char *cachefile;
+static struct revcache *revcache;
 
 static int outblocked, inputeof;
-static struct { struct outqueuenode *head, *tail; } outqueue;
-static int peroutqueuenode, outqueuelen;
 
 static struct sockaddr_in sa;
+static struct sockaddr_in6 sa6;
 static adns_state ads;
 
-static char addrtextbuf[18]; /* [ddd.ddd.ddd.ddd] + nul */
-static int cbyte, inbyte, inbuf;
-static unsigned char bytes[4];
+/*
+ * Input is read in large blocks and scanned for addresses.  Text
+ * which can't be part of one is queued for output a span at a time.
+ * Anything at the end of a block which might be the start of an
+ * address is kept back until the next block arrives.
+ */
+#define READSIZE 65536
+#define MAXADDRTEXT 64 /* longest run of address characters considered */
+
+#define CC_ALNUM 01 /* letter or digit */
+#define CC_ADDR  02 /* may appear in an address: hex digit, `.' or `:' */
+#define CC_START 04 /* may start an address: hex digit or `:' */
+
+static unsigned char charclass[256];
+static char inbuffer[MAXADDRTEXT + 1 + READSIZE];
+static int inkept, prevalnum;
 static struct timeval printbefore;
 
-struct treething {
-  unsigned char bytes[4];
+/*
+ * Output is kept, just as it was read, in a ring buffer which grows as
+ * needed; each address in it has a mark.  Once an address's answer is
+ * in, everything up to the next address still waiting is written with
+ * writev, the name coming straight from the answer.  So a mark keeps
+ * its reference to the addrthing until it has been written.
+ * Positions in the ring only ever increase, and are masked to index it.
+ */
+#define MINOUTRING 131072
+#define MINMARKS 256
+#define MAXOUTBYTES 1048576 /* stop reading while this much is pending */
+#define MAXOUTMARKS 1024 /* or this many addresses */
+
+#if defined(IOV_MAX) && IOV_MAX < 1024
+# define MAXIOV IOV_MAX
+#else
+# define MAXIOV 1024
+#endif
+
+struct outmark {
+  unsigned long start; /* where the address text is in outring */
+  int len;
+  struct timeval printbefore;
+  struct addrthing *addr; /* 0 once we have given up waiting for it */
+};
+
+static char *outring;
+static unsigned long outmask, outhead, outtail;
+static struct outmark *marks;
+static unsigned long markmask, markhead, marktail;
+static size_t markdone; /* how much of the first mark has been written */
+
+static const unsigned char v4mapped[12]= { 0,0,0,0, 0,0,0,0, 0,0,0xff,0xff };
+
+struct addrthing {
+  struct addrthing *next, *back; /* on the LRU list iff refs is 0 */
+  unsigned char bytes[16]; /* IPv4 addresses are kept v4-mapped */
   adns_query qu;
   adns_answer *ans;
+  int refs; /* output waiting for it, and the query if outstanding */
 };
 
-static struct treething *newthing;
-static void *treeroot;
+/*
+ * Addresses are kept in an open-addressed hash table, with linear
+ * probing, which is never allowed to get more than half full.
+ * Entries which no output is waiting for are on an LRU list, and once
+ * there are more than maxthings entries the least recently used are
+ * forgotten.  An answer whose TTL has run out is forgotten the next
+ * time its address turns up.
+ */
+#define THINGSPERBLOCK 1024
+#define MINTABLE 1024
+
+static struct addrthing **thingtable, *freethings;
+static struct { struct addrthing *head, *tail; } lru;
+static unsigned long tablemask, nthings;
+static unsigned long nhits, nmisses, nexpired, nevictions;
+
+static int thingisv4(const struct addrthing *thing) {
+  return !memcmp(thing->bytes,v4mapped,12);
+}
+
+static unsigned long thingaddr(const struct addrthing *thing) {
+  return ((unsigned long)thing->bytes[12] << 24) | (thing->bytes[13] << 16) |
+    (thing->bytes[14] << 8) | thing->bytes[15];
+}
 
 static int nonblock(int fd, int isnonblock) {
   int r;
@@ -120,10 +188,15 @@ static void usage(void) {
 	     "         -b|--brackets    (require [...] around IP addresses)\n"
 	     "         -a|--address     (always include [address] in output)\n"
 	     "         -u|--unchecked   (do not forward map for checking)\n"
+	     "         -m<entries>|--max-entries <entries>\n"
+	     "                          (remember at most this many addresses)\n"
+	     "         --stats          (report lookup statistics at the end)\n"
 	     "         --config <text>  (use this instead of resolv.conf)\n"
+	     "         --cache <file>   (keep answers in this file between runs)\n"
 	     "         --debug          (turn on adns resolver debugging)\n"
 	     "Timeout is the maximum amount to delay any particular bit of output for.\n"
-	     "Lookups will go on in the background.  Default timeout = 1000 (ms).\n")
+	     "Lookups will go on in the background.  Default timeout = 1000 (ms).\n"
+	     "Default maximum number of entries = 65536.\n")
       == EOF) outputerr();
   if (fflush(stdout)) sysfail("flush stdout");
 }
@@ -147,6 +220,12 @@ static void settimeout(const char *arg) {
   if (*ep) usageerr("invalid timeout");
 }
 
+static void setmaxthings(const char *arg) {
+  char *ep;
+  maxthings= strtoul(arg,&ep,0);
+  if (*ep) usageerr("invalid maximum number of entries");
+}
+
 static void parseargs(const char *const *argv) {
   const char *arg;
   int c;
@@ -166,9 +245,17 @@ static void parseargs(const char *const *argv) {
 	address= 1;
       } else if (!strcmp(arg,"--unchecked")) {
 	rrt= adns_r_ptr_raw;
+      } else if (!strcmp(arg,"--max-entries")) {
+	if (!(arg= *++argv)) usageerr("--max-entries needs a value");
+	setmaxthings(arg);
+      } else if (!strcmp(arg,"--stats")) {
+	stats= 1;
       } else if (!strcmp(arg,"--config")) {
 	if (!(arg= *++argv)) usageerr("--config needs a value");
 	config_text= arg;
+      } else if (!strcmp(arg,"--cache")) {
+	if (!(arg= *++argv)) usageerr("--cache needs a value");
+	cachefile= arg;
       } else if (!strcmp(arg,"--debug")) {
 	initflags |= adns_if_debug;
       } else if (!strcmp(arg,"--help")) {
@@ -200,6 +287,12 @@ static void parseargs(const char *const *argv) {
 	case 'u':
 	  rrt= adns_r_ptr_raw;
 	  break;
+	case 'm':
+	  if (*++arg) setmaxthings(arg);
+	  else if ((arg= *++argv)) setmaxthings(arg);
+	  else usageerr("-m needs a value");
+	  arg= "\0";
+	  break;
 	case 'h':
 	  usage();
 	  quitnow(0);
@@ -211,69 +304,275 @@ static void parseargs(const char *const *argv) {
   }
 }
 
-static void queueoutchar(int c) {
-  struct outqueuenode *entry;
-  
-  entry= outqueue.tail;
-  if (!entry || entry->addr ||
-      entry->textlen >= peroutqueuenode - (entry->textp - entry->buffer)) {
-    peroutqueuenode= !peroutqueuenode || !entry || entry->addr ? 128 : 
-      peroutqueuenode >= 1024 ? 4096 : peroutqueuenode<<2;
-    entry= xmalloc(sizeof(*entry));
-    entry->buffer= xmalloc(peroutqueuenode);
-    entry->textp= entry->buffer;
-    entry->textlen= 0;
-    entry->addr= 0;
-    LIST_LINK_TAIL(outqueue,entry);
-    outqueuelen++;
+static unsigned long thinghash(const unsigned char *bytes) {
+  unsigned long h= 2166136261UL;
+  int i;
+
+  for (i=0; i<16; i++) h= ((h ^ bytes[i]) * 16777619UL) & 0xffffffffUL;
+  return h & tablemask;
+}
+
+static struct addrthing **thingslot(const unsigned char *bytes) {
+  /* Returns the slot holding bytes, or the empty one it would go in. */
+  unsigned long i;
+
+  for (i= thinghash(bytes);
+       thingtable[i] && memcmp(thingtable[i]->bytes,bytes,16);
+       i= (i+1) & tablemask);
+  return &thingtable[i];
+}
+
+static void growtable(void) {
+  struct addrthing **oldtable;
+  unsigned long i, oldsize;
+
+  oldtable= thingtable;
+  oldsize= oldtable ? tablemask+1 : 0;
+  tablemask= oldsize ? oldsize*2-1 : MINTABLE-1;
+  thingtable= calloc(tablemask+1,sizeof(*thingtable));
+  if (!thingtable) sysfail("calloc");
+  for (i=0; i<oldsize; i++)
+    if (oldtable[i]) *thingslot(oldtable[i]->bytes)= oldtable[i];
+  free(oldtable);
+}
+
+static void forgetthing(struct addrthing *thing) {
+  /* thing must be on the LRU list.  Entries after it in its run are
+   * moved back as need be, so that no tombstones are needed. */
+  unsigned long i, j, k;
+
+  LIST_UNLINK(lru,thing);
+  i= thingslot(thing->bytes) - thingtable;
+  thingtable[i]= 0;
+  for (j= (i+1) & tablemask; thingtable[j]; j= (j+1) & tablemask) {
+    k= thinghash(thingtable[j]->bytes);
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+    thingtable[i]= thingtable[j];
+    thingtable[j]= 0;
+    i= j;
+  }
+  free(thing->ans);
+  thing->next= freethings;
+  freethings= thing;
+  nthings--;
+}
+
+static struct addrthing *getthing(const unsigned char *bytes) {
+  /* Returns the entry for bytes, with a reference for the caller. */
+  struct addrthing *thing, **slot;
+  struct timeval now;
+  int i;
+
+  thing= thingtable ? *thingslot(bytes) : 0;
+  if (thing && !thing->refs && thing->ans) {
+    if (gettimeofday(&now,0)) sysfail("gettimeofday");
+    if (thing->ans->expires < now.tv_sec) {
+      forgetthing(thing);
+      nexpired++;
+      thing= 0;
+    }
+  }
+  if (thing) {
+    if (!thing->refs++) LIST_UNLINK(lru,thing);
+    nhits++;
+    return thing;
+  }
+
+  nmisses++;
+  while (nthings >= maxthings && lru.head) {
+    forgetthing(lru.head);
+    nevictions++;
+  }
+  if (!thingtable || nthings >= (tablemask+1)/2) growtable();
+  slot= thingslot(bytes);
+  if (!freethings) {
+    freethings= xmalloc(sizeof(*freethings)*THINGSPERBLOCK);
+    for (i=0; i<THINGSPERBLOCK-1; i++) freethings[i].next= &freethings[i+1];
+    freethings[i].next= 0;
   }
-  entry->textp[entry->textlen++]= c;
+  thing= freethings;
+  freethings= thing->next;
+  memcpy(thing->bytes,bytes,16);
+  thing->qu= 0;
+  thing->ans= 0;
+  thing->refs= 1;
+  *slot= thing;
+  nthings++;
+  return thing;
 }
 
-static void queueoutstr(const char *str, int len) {
-  while (len-- > 0) queueoutchar(*str++);
+static void thingunref(struct addrthing *thing) {
+  if (!--thing->refs) LIST_LINK_TAIL(lru,thing);
 }
 
-static void writestdout(struct outqueuenode *entry) {
-  int r;
+static void ringcopy(char *ring, unsigned long mask, unsigned long pos,
+		     const char *p, unsigned long len) {
+  unsigned long first;
 
-  while (entry->textlen) {
-    r= write(1, entry->textp, entry->textlen);
-    if (r < 0) {
-      if (errno == EINTR) continue;
-      if (errno == EAGAIN) { outblocked= 1; break; }
-      sysfail("write stdout");
+  first= mask+1 - (pos & mask);
+  if (first > len) first= len;
+  memcpy(ring + (pos & mask), p, first);
+  memcpy(ring, p + first, len - first);
+}
+
+static int ringiov(struct iovec *iov, unsigned long pos, unsigned long len) {
+  /* Sets up iov for len bytes of outring at pos; returns how many
+   * entries were used. */
+  unsigned long first;
+
+  first= outmask+1 - (pos & outmask);
+  iov[0].iov_base= outring + (pos & outmask);
+  if (first >= len) {
+    iov[0].iov_len= len;
+    return 1;
+  }
+  iov[0].iov_len= first;
+  iov[1].iov_base= outring;
+  iov[1].iov_len= len - first;
+  return 2;
+}
+
+static void queueoutstr(const char *str, int len) {
+  struct iovec iov[2];
+  unsigned long newmask, pos;
+  char *newring;
+  int i, niov;
+
+  if (!outring || outtail-outhead + len > outmask+1) {
+    for (newmask= outring ? outmask*2+1 : MINOUTRING-1;
+	 outtail-outhead + len > newmask+1;
+	 newmask= newmask*2+1);
+    newring= xmalloc(newmask+1);
+    if (outring) {
+      niov= ringiov(iov,outhead,outtail-outhead);
+      for (i=0, pos=outhead; i<niov; pos+= iov[i].iov_len, i++)
+	ringcopy(newring,newmask,pos,iov[i].iov_base,iov[i].iov_len);
+      free(outring);
     }
-    assert(r <= entry->textlen);
-    entry->textp += r;
-    entry->textlen -= r;
+    outring= newring;
+    outmask= newmask;
   }
-  if (!entry->textlen) {
-    LIST_UNLINK(outqueue,entry);
-    free(entry->buffer);
-    free(entry);
-    outqueuelen--;
+  ringcopy(outring,outmask,outtail,str,len);
+  outtail+= len;
+}
+
+static void queueoutaddr(const char *text, int len, struct addrthing *thing) {
+  struct outmark *newmarks, *mark;
+  unsigned long newmask, m;
+
+  if (!marks || marktail-markhead > markmask) {
+    newmask= marks ? markmask*2+1 : MINMARKS-1;
+    newmarks= xmalloc((newmask+1) * sizeof(*newmarks));
+    if (marks) {
+      for (m= markhead; m != marktail; m++)
+	newmarks[m & newmask]= marks[m & markmask];
+      free(marks);
+    }
+    marks= newmarks;
+    markmask= newmask;
   }
+  mark= &marks[marktail++ & markmask];
+  mark->start= outtail;
+  mark->len= len;
+  mark->printbefore= printbefore;
+  mark->addr= thing;
+  queueoutstr(text,len);
 }
 
-static void replacetextwithname(struct outqueuenode *entry) {
-  char *name, *newbuf;
-  int namelen, newlen;
+static int outqueuefull(void) {
+  return outtail-outhead >= MAXOUTBYTES || marktail-markhead >= MAXOUTMARKS;
+}
 
-  name= entry->addr->ans->rrs.str[0];
-  namelen= strlen(name);
-  if (!address) {
-    free(entry->buffer);
-    entry->buffer= 0;
-    entry->textp= name;
-    entry->textlen= namelen;
-  } else {
-    newlen= entry->textlen + namelen + (bracket ? 0 : 2);
-    newbuf= xmalloc(newlen + 1);
-    sprintf(newbuf, bracket ? "%s%.*s" : "%s[%.*s]", name, entry->textlen, entry->textp);
-    free(entry->buffer);
-    entry->buffer= entry->textp= newbuf;
-    entry->textlen= newlen;
+static int markwaiting(const struct outmark *mark) {
+  return mark->addr && !mark->addr->ans;
+}
+
+static int markiov(struct iovec *iov, const struct outmark *mark) {
+  /* Sets up iov for what mark is to be written as, once it's no longer
+   * waiting; returns how many entries (at most 5) were used. */
+  static char open[]= "[", close[]= "]";
+  char *name;
+  int n;
+
+  if (!mark->addr || !mark->addr->ans->nrrs)
+    return ringiov(iov,mark->start,mark->len);
+  name= mark->addr->ans->rrs.str[0];
+  iov[0].iov_base= name;
+  iov[0].iov_len= strlen(name);
+  if (!address) return 1;
+  n= 1;
+  if (!bracket) { iov[n].iov_base= open; iov[n].iov_len= 1; n++; }
+  n+= ringiov(iov+n,mark->start,mark->len);
+  if (!bracket) { iov[n].iov_base= close; iov[n].iov_len= 1; n++; }
+  return n;
+}
+
+static void discardoutput(size_t r) {
+  /* Forgets the first r bytes of the output, which have been written. */
+  struct iovec pieces[5];
+  struct outmark *mark;
+  unsigned long end;
+  size_t marklen;
+  int i, n;
+
+  for (;;) {
+    mark= markhead == marktail ? 0 : &marks[markhead & markmask];
+    if (mark && mark->start == outhead && !markwaiting(mark)) {
+      n= markiov(pieces,mark);
+      for (i=0, marklen=0; i<n; i++) marklen+= pieces[i].iov_len;
+      if (r < marklen - markdone) { markdone+= r; return; }
+      r-= marklen - markdone;
+      markdone= 0;
+      outhead+= mark->len;
+      if (mark->addr) thingunref(mark->addr);
+      markhead++;
+    } else {
+      end= mark ? mark->start : outtail;
+      if (end-outhead > r) end= outhead + r;
+      if (end == outhead) return;
+      r-= end-outhead;
+      outhead= end;
+    }
+  }
+}
+
+static void writestdout(void) {
+  /* Writes out everything before the first address still waiting for
+   * an answer, unless stdout fills up first. */
+  struct iovec iov[MAXIOV], pieces[5];
+  const struct outmark *mark;
+  unsigned long pos, end, m;
+  size_t skip;
+  ssize_t r;
+  int niov, i, n;
+
+  for (;;) {
+    niov= 0;
+    pos= outhead;
+    skip= markdone;
+    for (m= markhead; niov <= MAXIOV-7; m++) {
+      mark= m == marktail ? 0 : &marks[m & markmask];
+      end= mark ? mark->start : outtail;
+      if (end != pos) niov+= ringiov(iov+niov,pos,end-pos);
+      if (!mark || markwaiting(mark)) break;
+      n= markiov(pieces,mark);
+      for (i=0; i<n; i++) {
+	if (skip >= pieces[i].iov_len) { skip-= pieces[i].iov_len; continue; }
+	iov[niov].iov_base= (char*)pieces[i].iov_base + skip;
+	iov[niov].iov_len= pieces[i].iov_len - skip;
+	niov++;
+	skip= 0;
+      }
+      pos= mark->start + mark->len;
+    }
+    if (!niov) return;
+    r= writev(1,iov,niov);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) { outblocked= 1; return; }
+      sysfail("write stdout");
+    }
+    discardoutput(r);
   }
 }
 
@@ -281,7 +580,7 @@ static void checkadnsqueries(void) {
   adns_query qu;
   adns_answer *ans;
   void *context;
-  struct treething *foundthing;
+  struct addrthing *foundthing;
   int r;
 
   for (;;) {
@@ -292,154 +591,225 @@ static void checkadnsqueries(void) {
     foundthing= context;
     foundthing->ans= ans;
     foundthing->qu= 0;
+    /* Unchecked answers are not cached, since others may rely on
+     * the cache only holding names which map back to the address;
+     * and the cache is keyed on IPv4 addresses only. */
+    if (revcache && rrt == adns_r_ptr && thingisv4(foundthing))
+      revcache_store(revcache,thingaddr(foundthing),ans);
+    thingunref(foundthing);
   }
 }
 
-static void restartbuf(void) {
-  if (inbuf>0) queueoutstr(addrtextbuf,inbuf);
-  inbuf= 0;
-}
+static void procaddr(const char *text, int len, const unsigned char *key) {
+  struct addrthing *foundthing;
+  const struct sockaddr *sap;
+  int r;
 
-static int comparer(const void *a, const void *b) {
-  return memcmp(a,b,4);
+  foundthing= getthing(key);
+
+  if (!foundthing->ans && !foundthing->qu) {
+    if (revcache && thingisv4(foundthing))
+      foundthing->ans= revcache_lookup(revcache,thingaddr(foundthing),0);
+    if (!foundthing->ans) {
+      if (thingisv4(foundthing)) {
+	memcpy(&sa.sin_addr,key+12,4);
+	sap= (const struct sockaddr*)&sa;
+      } else {
+	memcpy(&sa6.sin6_addr,key,16);
+	sap= (const struct sockaddr*)&sa6;
+      }
+      r= adns_submit_reverse(ads,sap,rrt,0,foundthing,&foundthing->qu);
+      if (r) adnsfail("submit",r);
+      foundthing->refs++;
+    }
+  }
+  queueoutaddr(text,len,foundthing);
 }
 
-static void procaddr(void) {
-  struct treething *foundthing;
-  void **searchfound;
-  struct outqueuenode *entry;
-  int r;
-  
-  if (!newthing) {
-    newthing= xmalloc(sizeof(struct treething));
-    newthing->qu= 0;
-    newthing->ans= 0;
+static int parseipv4(const char *p, const char *end, unsigned char *key) {
+  /* Returns the length of the dotted quad at p, or 0 if there isn't one. */
+  const char *start= p;
+  int i, ndigits, val;
+
+  memcpy(key,v4mapped,12);
+  for (i=0; i<4; i++) {
+    if (i) {
+      if (p == end || *p != '.') return 0;
+      p++;
+    }
+    for (ndigits=0, val=0;
+	 ndigits < 3 && p < end && *p >= '0' && *p <= '9';
+	 ndigits++, p++)
+      val= val*10 + (*p - '0');
+    if (!ndigits || val > 255) return 0;
+    key[12+i]= val;
   }
+  return p - start;
+}
+
+static int parseipv6(const char *p, int len, unsigned char *key) {
+  static const unsigned char unspecified[16];
+  char buf[MAXADDRTEXT+1];
+
+  if (len > MAXADDRTEXT) return 0;
+  memcpy(buf,p,len);
+  buf[len]= 0;
+  return inet_pton(AF_INET6,buf,key) == 1 && memcmp(key,unspecified,16);
+}
 
-  memcpy(newthing->bytes,bytes,4);
-  searchfound= tsearch(newthing,&treeroot,comparer);
-  if (!searchfound) sysfail("tsearch");
-  foundthing= *searchfound;
-
-  if (foundthing == newthing) {
-    newthing= 0;
-    memcpy(&sa.sin_addr,bytes,4);
-    r= adns_submit_reverse(ads, (const struct sockaddr*)&sa,
-			   rrt,0,foundthing,&foundthing->qu);
-    if (r) adnsfail("submit",r);
+static int matchaddr(const char *p, const char *run, const char *runend,
+		     const char *end, int colon, unsigned char *key) {
+  /* run..runend is the run of address characters at or (after a `[')
+   * just after p.  Returns the length of the address text at p,
+   * brackets included, or 0 if it isn't one. */
+  int len;
+
+  if (bracket) {
+    if (runend == run || runend == end || *runend != ']') return 0;
+    if (colon ? !parseipv6(run,runend-run,key) :
+	parseipv4(run,runend,key) != runend-run)
+      return 0;
+    return runend+1 - p;
   }
-  entry= xmalloc(sizeof(*entry));
-  entry->buffer= xmalloc(inbuf);
-  entry->textp= entry->buffer;
-  memcpy(entry->textp,addrtextbuf,inbuf);
-  entry->textlen= inbuf;
-  entry->addr= foundthing;
-  entry->printbefore= printbefore;
-  LIST_LINK_TAIL(outqueue,entry);
-  outqueuelen++;
-  inbuf= 0;
-  cbyte= -1;
+  if (colon) {
+    /* allow for a full stop after the address */
+    len= runend-run;
+    if (!parseipv6(run,len,key) &&
+	!(runend[-1] == '.' && parseipv6(run,--len,key)))
+      len= 0;
+    if (len && !(run+len < end &&
+		 (charclass[(unsigned char)run[len]] & CC_ALNUM)))
+      return len;
+  }
+  len= parseipv4(run,runend,key);
+  if (len && !(run+len < end &&
+	       (charclass[(unsigned char)run[len]] & CC_ALNUM)))
+    return len;
+  return 0;
 }
 
-static void startaddr(void) {
-  bytes[cbyte=0]= 0;
-  inbyte= 0;
+static int scaninput(const char *buf, int len, int eof) {
+  /* Queues the text and addresses in buf, and returns how much of it
+   * was used; the rest might be the start of an address. */
+  const char *p, *end, *textstart, *run, *runend;
+  unsigned char key[16];
+  int colon, alen;
+
+  p= textstart= buf;
+  end= buf+len;
+  for (;;) {
+    if (bracket) {
+      p= memchr(p,'[',end-p);
+      if (!p) { p= end; break; }
+      run= p+1;
+    } else {
+      while (p < end &&
+	     (prevalnum || !(charclass[(unsigned char)*p] & CC_START))) {
+	prevalnum= charclass[(unsigned char)*p] & CC_ALNUM;
+	p++;
+      }
+      if (p == end) break;
+      run= p;
+    }
+    colon= 0;
+    for (runend= run;
+	 runend < end && runend-run < MAXADDRTEXT &&
+	   (charclass[(unsigned char)*runend] & CC_ADDR);
+	 runend++)
+      if (*runend == ':') colon= 1;
+    if (runend == end && runend-run < MAXADDRTEXT && !eof) break;
+
+    alen= matchaddr(p,run,runend,end,colon,key);
+    if (alen) {
+      queueoutstr(textstart,p-textstart);
+      procaddr(p,alen,key);
+      p+= alen;
+      textstart= p;
+      prevalnum= charclass[(unsigned char)p[-1]] & CC_ALNUM;
+    } else {
+      prevalnum= charclass[(unsigned char)*p] & CC_ALNUM;
+      p++;
+    }
+  }
+  queueoutstr(textstart,p-textstart);
+  return p - buf;
 }
 
 static void readstdin(void) {
-  char readbuf[512], *p;
-  int r, c, nbyte;
+  int r, used;
 
-  while ((r= read(0,readbuf,sizeof(readbuf))) <= 0) {
-    if (r == 0) { inputeof= 1; return; }
-    if (r == EAGAIN) return;
-    if (r != EINTR) sysfail("read stdin");
+  for (;;) {
+    r= read(0,inbuffer+inkept,READSIZE);
+    if (r >= 0) break;
+    if (errno == EAGAIN) return;
+    if (errno != EINTR) sysfail("read stdin");
   }
-  for (p=readbuf; r>0; r--,p++) {
-    c= *p;
-    if (cbyte==-1 && bracket && c=='[') {
-      addrtextbuf[inbuf++]= c;
-      startaddr();
-    } else if (cbyte==-1 && !bracket && !isalnum(c)) {
-      queueoutchar(c);
-      startaddr();
-    } else if (cbyte>=0 && inbyte<3 && c>='0' && c<='9' &&
-	       (nbyte= bytes[cbyte]*10 + (c-'0')) <= 255) {
-      bytes[cbyte]= nbyte;
-      addrtextbuf[inbuf++]= c;
-      inbyte++;
-    } else if (cbyte>=0 && cbyte<3 && inbyte>0 && c=='.') {
-      bytes[++cbyte]= 0;
-      addrtextbuf[inbuf++]= c;
-      inbyte= 0;
-    } else if (cbyte==3 && inbyte>0 && bracket && c==']') {
-      addrtextbuf[inbuf++]= c;
-      procaddr();
-    } else if (cbyte==3 && inbyte>0 && !bracket && !isalnum(c)) {
-      procaddr();
-      queueoutchar(c);
-      startaddr();
-    } else {
-      restartbuf();
-      queueoutchar(c);
-      cbyte= -1;
-      if (!bracket && !isalnum(c)) startaddr();
-    }
+  if (!r) {
+    inputeof= 1;
+    if (!inkept) return;
   }
+  r+= inkept;
+  used= scaninput(inbuffer,r,inputeof);
+  inkept= r - used;
+  memmove(inbuffer,inbuffer+used,inkept);
+  /* Answers to what we just submitted may already be in, and if
+   * stdin is leaving the select set nothing else will wake us. */
+  if (inputeof || outqueuefull()) checkadnsqueries();
 }
 
 static void startup(void) {
-  int r;
+  int r, c;
 
   if (nonblock(0,1)) sysfail("set stdin to nonblocking mode");
   if (nonblock(1,1)) sysfail("set stdout to nonblocking mode");
   memset(&sa,0,sizeof(sa));
   sa.sin_family= AF_INET;
+  memset(&sa6,0,sizeof(sa6));
+  sa6.sin6_family= AF_INET6;
+  for (c=0; c<256; c++) {
+    if (isalnum(c)) charclass[c] |= CC_ALNUM;
+    if (isxdigit(c) || c == ':') charclass[c] |= CC_ADDR|CC_START;
+  }
+  charclass['.'] |= CC_ADDR;
   if (config_text) {
     r= adns_init_strcfg(&ads,initflags,stderr,config_text);
   } else {
     r= adns_init(&ads,initflags,0);
   }
   if (r) adnsfail("init",r);
-  cbyte= -1;
-  inbyte= -1;
-  inbuf= 0;
-  if (!bracket) startaddr();
+  if (cachefile) {
+    r= revcache_open(&revcache,cachefile);
+    if (r) { errno= r; sysfail("open cache"); }
+  }
 }
 
 int main(int argc, const char *const *argv) {
   int r, maxfd;
   fd_set readfds, writefds, exceptfds;
-  struct outqueuenode *entry;
+  struct outmark *mark;
   struct timeval *tv, tvbuf, now;
 
   parseargs(argv);
   startup();
 
-  while (!inputeof || outqueue.head) {
+  while (!inputeof || outhead != outtail) {
     maxfd= 2;
     tv= 0;
     FD_ZERO(&readfds); FD_ZERO(&writefds); FD_ZERO(&exceptfds);
-    if ((entry= outqueue.head) && !outblocked) {
-      if (!entry->addr) {
-	writestdout(entry);
-	continue;
-      }
-      if (entry->addr->ans) {
-	if (entry->addr->ans->nrrs) 
-	  replacetextwithname(entry);
-	entry->addr= 0;
-	continue;
-      }
+    if (outhead != outtail && !outblocked) {
+      writestdout();
+      if (outblocked || outhead == outtail) continue;
+      mark= &marks[markhead & markmask];
       r= gettimeofday(&now,0);  if (r) sysfail("gettimeofday");
       if (forever) {
 	tv= 0;
-      } else if (!timercmp(&now,&entry->printbefore,<)) {
-	entry->addr= 0;
+      } else if (!timercmp(&now,&mark->printbefore,<)) {
+	thingunref(mark->addr);
+	mark->addr= 0;
 	continue;
       } else {
-	tvbuf.tv_sec= entry->printbefore.tv_sec - now.tv_sec - 1;
-	tvbuf.tv_usec= entry->printbefore.tv_usec - now.tv_usec + 1000000;
+	tvbuf.tv_sec= mark->printbefore.tv_sec - now.tv_sec - 1;
+	tvbuf.tv_usec= mark->printbefore.tv_usec - now.tv_usec + 1000000;
 	tvbuf.tv_sec += tvbuf.tv_usec / 1000000;
 	tvbuf.tv_usec %= 1000000;
 	tv= &tvbuf;
@@ -448,7 +818,7 @@ int main(int argc, const char *const *argv) {
 			&tv,&tvbuf,&now);
     }
     if (outblocked) FD_SET(1,&writefds);
-    if (!inputeof && outqueuelen<1024) FD_SET(0,&readfds);
+    if (!inputeof && !outqueuefull()) FD_SET(0,&readfds);
     
     r= select(maxfd,&readfds,&writefds,&exceptfds,tv);
     if (r < 0) { if (r == EINTR) continue; else sysfail("select"); }
@@ -470,5 +840,15 @@ int main(int argc, const char *const *argv) {
   if (nonblock(0,0)) sysfail("un-nonblock stdin");
   if (nonblock(1,0)) sysfail("un-nonblock stdout");
   adns_finish(ads);
+  free(outring);
+  free(marks);
+  if (stats)
+    fprintf(stderr,"adnsresfilter: %lu addresses seen, %lu already known,"
+	    " %lu expired, %lu evicted, %lu remembered\n",
+	    nhits+nmisses, nhits, nexpired, nevictions, nthings);
+  if (revcache) {
+    r= revcache_close(revcache);
+    if (r) { errno= r; sysfail("update cache"); }
+  }
   exit(0);
 }
@@ -52,11 +52,20 @@ struct myctx {
 static struct myctx *mcs;
 static adns_state ads;
 static adns_rrtype *types_a;
+static adns_submission *subs;
+static adns_query *qus;
+static int *errs;
+static adns_completed *comps;
+static int checkincallback;
 
 static void quitnow(int rc) NONRETURNING;
 static void quitnow(int rc) {
   free(mcs);
   free(types_a);
+  free(subs);
+  free(qus);
+  free(errs);
+  free(comps);
   if (ads) adns_finish(ads);
   
   exit(rc);
@@ -104,6 +113,11 @@ static void usageerr(const char *why) {
 	  "              [ [<queryflagsnum>[,<ownqueryflags>]/]<domain> ... ]\n"
 	  "initflags:   p  use poll(2) instead of select(2)\n"
 	  "             s  use adns_wait with specified query, instead of 0\n"
+	  "             c  collect answers with adns_set_completionfn\n"
+	  "             k  with c, also call adns_check from the callback\n"
+	  "             b  submit all queries with one adns_submit_many\n"
+	  "             m  collect answers with adns_wait_many\n"
+	  "             t  print adns_getstats counters at the end\n"
 	  "queryflags:  a  print status abbrevs instead of strings\n"
 	  "typenum:      may be 0x<hex>|<dec>, or 0x<hex> or <dec>\n"
 	  "exit status:  0 ok (though some queries may have failed)\n"
@@ -166,6 +180,99 @@ static int consistsof(const char *string, const char *accept) {
   return strspn(string,accept) == strlen(string);
 }
 
+static void report(struct myctx *mc, adns_answer *ans) {
+  const char *domain, *rrtn, *fmtn;
+  char *show;
+  int len, i, qflags;
+  adns_status ri;
+  struct timeval now;
+  char ownflags[10];
+
+  fdom_split(mc->fdom,&domain,&qflags,ownflags,sizeof(ownflags));
+
+  if (gettimeofday(&now,0)) { perror("gettimeofday"); quitnow(3); }
+      
+  ri= adns_rr_info(ans->type, &rrtn,&fmtn,&len, 0,0);
+  fprintf(stdout, "%s flags %d type ",domain,qflags);
+  dumptype(ri,rrtn,fmtn);
+  fprintf(stdout, "%s%s: %s; nrrs=%d; cname=%s; owner=%s; ttl=%ld%s\n",
+	  ownflags[0] ? " ownflags=" : "", ownflags,
+	  strchr(ownflags,'a')
+	  ? adns_errabbrev(ans->status)
+	  : adns_strerror(ans->status),
+	  ans->nrrs,
+	  ans->cname ? ans->cname : "$",
+	  ans->owner ? ans->owner : "$",
+	  (long)ans->expires - (long)now.tv_sec,
+	  ans->partial ? "; partial" : "");
+  if (ans->nrrs) {
+    assert(!ri);
+    for (i=0; i<ans->nrrs; i++) {
+      ri= adns_rr_info(ans->type, 0,0,0, ans->rrs.bytes + i*len, &show);
+      if (ri) failure_status("info",ri);
+      fprintf(stdout," %s\n",show);
+      free(show);
+    }
+  }
+  free(ans);
+
+  mc->doneyet= 1;
+}
+
+static void dumpstats(void) {
+  adns_stats st;
+  char addrbuf[ADNS_ADDR2TEXT_BUFLEN];
+  int i, serv, addrbuflen;
+
+  adns_getstats(ads,&st);
+  fprintf(stdout,"stats: submitted %lu child %lu udpsent %lu udpretries %lu"
+	  " timeouts %lu\n",
+	  st.submitted,st.childqueries,st.udpsent,st.udpretries,st.timeouts);
+  fprintf(stdout,"stats: tcpfallbacks %lu tcpconnects %lu tcpbreaks %lu"
+	  " unknownserver %lu queries %lu\n",
+	  st.tcpfallbacks,st.tcpconnects,st.tcpbreaks,st.unknownserver,
+	  st.queries);
+  fprintf(stdout,"stats: rcodes");
+  for (i=0; i<16; i++) fprintf(stdout," %lu",st.rcodes[i]);
+  putc('\n',stdout);
+  for (serv=0; serv<st.nservers; serv++) {
+    addrbuflen= sizeof(addrbuf);
+    if (adns_addr2text(&st.servers[serv].addr.addr.sa,0,
+		       addrbuf,&addrbuflen,0))
+      strcpy(addrbuf,"?");
+    fprintf(stdout,"stats: server %s replies %lu latency",
+	    addrbuf,st.servers[serv].replies);
+    for (i=0; i<ADNS_STATS_NBUCKETS; i++)
+      fprintf(stdout," %lu",st.servers[serv].latency[i]);
+    putc('\n',stdout);
+  }
+}
+
+static void completed(adns_state cads, void *fndata,
+		      adns_query qu, adns_answer *ans, void *context) {
+  struct myctx *mc= context;
+  adns_query cqu;
+  adns_answer *cans;
+  void *cctx;
+  int r;
+
+  assert(cads == ads);
+  assert(qu == (qus ? qus[mc-mcs] : mc->qu));
+  assert(!mc->doneyet);
+  report(mc,ans);
+
+  if (checkincallback) {
+    /* Anything else which is ready must still come to us, later. */
+    cqu= 0;
+    r= adns_check(ads,&cqu,&cans,&cctx);
+    if (!r) {
+      fputs("adns_check returned an answer inside the callback\n",stderr);
+      quitnow(3);
+    }
+    if (r != EAGAIN && r != ESRCH) failure_errno("check in callback",r);
+  }
+}
+
 int main(int argc, char *const *argv) {
   adns_query qu;
   struct myctx *mc, *mcw;
@@ -173,12 +280,11 @@ int main(int argc, char *const *argv) {
   adns_answer *ans;
   const char *initstring, *rrtn, *fmtn;
   const char *const *fdomlist, *domain;
-  char *show, *cp;
-  int len, i, qc, qi, tc, ti, ch, qflags, initflagsnum;
+  char *cp;
+  int qc, qi, tc, ti, ci, nc, ch, qflags, initflagsnum;
   adns_status ri;
   int r;
   const adns_rrtype *types;
-  struct timeval now;
   char ownflags[10];
   char *ep;
   const char *initflags, *owninitflags;
@@ -199,7 +305,13 @@ int main(int argc, char *const *argv) {
   initflagsnum= strtoul(initflags,&ep,0);
   if (*ep == ',') {
     owninitflags= ep+1;
-    if (!consistsof(owninitflags,"ps")) usageerr("unknown owninitflag");
+    if (!consistsof(owninitflags,"pscbmtk")) usageerr("unknown owninitflag");
+    if (strchr(owninitflags,'s') && strchr(owninitflags,'c'))
+      usageerr("owninitflags s and c are incompatible");
+    if (strchr(owninitflags,'m') && strpbrk(owninitflags,"sp"))
+      usageerr("owninitflag m is incompatible with s and p");
+    if (strchr(owninitflags,'k') && !strchr(owninitflags,'c'))
+      usageerr("owninitflag k needs c");
   } else if (!*ep) {
     owninitflags= "";
   } else {
@@ -255,17 +367,50 @@ int main(int argc, char *const *argv) {
   }
   if (r) failure_errno("init",r);
 
+  checkincallback= !!strchr(owninitflags,'k');
+  if (strchr(owninitflags,'c')) adns_set_completionfn(ads,completed,0);
+
+  if (strchr(owninitflags,'m')) {
+    comps= malloc(sizeof(*comps)*(qc*tc+1));
+    if (!comps) { perror("malloc comps"); quitnow(3); }
+  }
+
+  if (strchr(owninitflags,'b')) {
+    subs= malloc(sizeof(*subs)*(qc*tc+1));
+    qus= malloc(sizeof(*qus)*(qc*tc+1));
+    errs= malloc(sizeof(*errs)*(qc*tc+1));
+    if (!subs || !qus || !errs) { perror("malloc batch"); quitnow(3); }
+    for (qi=0; qi<qc; qi++) {
+      fdom_split(fdomlist[qi],&domain,&qflags,ownflags,sizeof(ownflags));
+      for (ti=0; ti<tc; ti++) {
+	mc= &mcs[qi*tc+ti];
+	mc->doneyet= 0;
+	mc->fdom= fdomlist[qi];
+	subs[qi*tc+ti].owner= domain;
+	subs[qi*tc+ti].type= types[ti];
+	subs[qi*tc+ti].flags= qflags;
+	subs[qi*tc+ti].context= mc;
+      }
+    }
+    adns_submit_many(ads,qc*tc,subs,qus,errs);
+  }
+
   for (qi=0; qi<qc; qi++) {
     fdom_split(fdomlist[qi],&domain,&qflags,ownflags,sizeof(ownflags));
     if (!consistsof(ownflags,"a")) usageerr("unknown ownqueryflag");
     for (ti=0; ti<tc; ti++) {
       mc= &mcs[qi*tc+ti];
-      mc->doneyet= 0;
-      mc->fdom= fdomlist[qi];
 
       fprintf(stdout,"%s flags %d type %d",
 	      domain,qflags,types[ti]&adns_rrt_reprmask);
-      r= adns_submit(ads,domain,types[ti],qflags,mc,&mc->qu);
+      if (qus) {
+	mc->qu= qus[qi*tc+ti];
+	r= errs[qi*tc+ti];
+      } else {
+	mc->doneyet= 0;
+	mc->fdom= fdomlist[qi];
+	r= adns_submit(ads,domain,types[ti],qflags,mc,&mc->qu);
+      }
       if (r == ENOSYS) {
 	fprintf(stdout," not implemented\n");
 	mc->qu= 0;
@@ -315,47 +460,38 @@ int main(int argc, char *const *argv) {
       mc= 0;
     }
 
-    if (strchr(owninitflags,'p')) {
+    if (comps) {
+      r= adns_wait_many(ads,comps,qc*tc+1,&nc);
+    } else if (strchr(owninitflags,'p')) {
       r= adns_wait_poll(ads,&qu,&ans,&mcr);
     } else {
       r= adns_wait(ads,&qu,&ans,&mcr);
     }
+    if (strchr(owninitflags,'c')) {
+      if (r != ESRCH) failure_errno("wait/check with callback",r);
+      continue;
+    }
     if (r) failure_errno("wait/check",r);
+
+    if (comps) {
+      assert(nc > 0);
+      for (ci=0; ci<nc; ci++) {
+	mc= comps[ci].context;
+	assert(comps[ci].query == mc->qu);
+	assert(!mc->doneyet);
+	report(mc,comps[ci].answer);
+      }
+      continue;
+    }
     
     if (mc) assert(mcr==mc);
     else mc= mcr;
     assert(qu==mc->qu);
     assert(!mc->doneyet);
     
-    fdom_split(mc->fdom,&domain,&qflags,ownflags,sizeof(ownflags));
-
-    if (gettimeofday(&now,0)) { perror("gettimeofday"); quitnow(3); }
-      
-    ri= adns_rr_info(ans->type, &rrtn,&fmtn,&len, 0,0);
-    fprintf(stdout, "%s flags %d type ",domain,qflags);
-    dumptype(ri,rrtn,fmtn);
-    fprintf(stdout, "%s%s: %s; nrrs=%d; cname=%s; owner=%s; ttl=%ld\n",
-	    ownflags[0] ? " ownflags=" : "", ownflags,
-	    strchr(ownflags,'a')
-	    ? adns_errabbrev(ans->status)
-	    : adns_strerror(ans->status),
-	    ans->nrrs,
-	    ans->cname ? ans->cname : "$",
-	    ans->owner ? ans->owner : "$",
-	    (long)ans->expires - (long)now.tv_sec);
-    if (ans->nrrs) {
-      assert(!ri);
-      for (i=0; i<ans->nrrs; i++) {
-	ri= adns_rr_info(ans->type, 0,0,0, ans->rrs.bytes + i*len, &show);
-	if (ri) failure_status("info",ri);
-	fprintf(stdout," %s\n",show);
-	free(show);
-      }
-    }
-    free(ans);
-
-    mc->doneyet= 1;
+    report(mc,ans);
   }
 
+  if (strchr(owninitflags,'t')) dumpstats();
   quitnow(0);
 }
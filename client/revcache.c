@@ -0,0 +1,443 @@
+/*
+ * revcache.c
+ * - on-disk reverse lookup cache shared by the client programs
+ */
+/*
+ *  This file is part of adns, which is
+ *    Copyright (C) 1997-2000,2003,2006,2014-2016  Ian Jackson
+ *    Copyright (C) 2014  Mark Wooding
+ *    Copyright (C) 1999-2000,2003,2006  Tony Finch
+ *    Copyright (C) 1991 Massachusetts Institute of Technology
+ *  (See the file INSTALL for full details.)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation.
+ */
+
+/*
+ * The cache file is a header, then an open-addressed hash table of
+ * slots keyed by IPv4 address (linear probing, never more than half
+ * full), then a string area holding the names one after another,
+ * each nul-terminated.  Everything is in host byte order: the file is
+ * a local cache, not an interchange format.
+ *
+ * A cache file is never modified once it is in place.  Readers map it
+ * and look things up without any locking.  A writer takes an fcntl
+ * lock on the current file, writes a new file holding its own answers
+ * and the unexpired entries of the current one, and renames it over
+ * the old one; anyone who still has the old one mapped carries on
+ * using it.  If the file was replaced while the writer was waiting
+ * for the lock, it starts again with the new one.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "config.h"
+#include "adns.h"
+#include "revcache.h"
+
+#ifdef ADNS_REGRESS_TEST
+# include "hredirect.h"
+#endif
+
+#define MAGIC "adnsrc1\n"
+#define MINSLOTS 1024
+#define MAXENTRIES 0x10000000UL
+#define MAXSTRSIZE 0x7fffffffUL
+#define MAXOWNER sizeof("255.255.255.255.in-addr.arpa")
+
+struct rc_header {
+  char magic[8];
+  uint32_t nslots, nentries, strsize, spare;
+};
+
+struct rc_slot {
+  uint32_t addr, nameoff; /* nameoff only meaningful if status is ok */
+  int32_t status, used;
+  int64_t expires;
+};
+
+struct rc_view {
+  void *map;
+  size_t maplen;
+  const struct rc_header *hdr; /* 0 => empty */
+  const struct rc_slot *slots;
+  const char *strs;
+};
+
+struct rc_pending {
+  unsigned long addr;
+  adns_status status;
+  time_t expires;
+  char *name; /* 0 unless status is ok */
+};
+
+struct revcache {
+  char *path;
+  struct rc_view view;
+  struct rc_pending *pending;
+  int npending, apending;
+};
+
+static uint32_t rc_hash(unsigned long addr, uint32_t mask) {
+  uint32_t h= addr * 0x9e3779b1UL;
+  return (h ^ (h >> 16)) & mask;
+}
+
+static int rc_attach(struct rc_view *v, int fd) {
+  /* Leaves v empty if fd is not a cache file we understand. */
+  const struct rc_header *hdr;
+  struct stat stab;
+
+  memset(v,0,sizeof(*v));
+  if (fstat(fd,&stab)) return errno;
+  if (!S_ISREG(stab.st_mode) || stab.st_size < (off_t)sizeof(*hdr)) return 0;
+  v->map= mmap(0,stab.st_size,PROT_READ,MAP_SHARED,fd,0);
+  if (v->map == MAP_FAILED) { v->map= 0; return errno; }
+  v->maplen= stab.st_size;
+  hdr= v->map;
+  if (memcmp(hdr->magic,MAGIC,sizeof(hdr->magic)) ||
+      !hdr->nslots || (hdr->nslots & (hdr->nslots-1)) ||
+      hdr->nslots > v->maplen / sizeof(struct rc_slot) ||
+      v->maplen != sizeof(*hdr) + hdr->nslots*sizeof(struct rc_slot) +
+                   hdr->strsize) {
+    munmap(v->map,v->maplen);
+    memset(v,0,sizeof(*v));
+    return 0;
+  }
+  v->hdr= hdr;
+  v->slots= (const struct rc_slot*)(hdr+1);
+  v->strs= (const char*)(v->slots + hdr->nslots);
+  return 0;
+}
+
+static void rc_detach(struct rc_view *v) {
+  if (v->map) munmap(v->map,v->maplen);
+  memset(v,0,sizeof(*v));
+}
+
+static const struct rc_slot *rc_find(const struct rc_view *v,
+				     unsigned long addr) {
+  const struct rc_slot *s;
+  uint32_t mask, h, i;
+
+  if (!v->hdr) return 0;
+  mask= v->hdr->nslots - 1;
+  for (i=0, h= rc_hash(addr,mask); i <= mask; i++, h= (h+1) & mask) {
+    s= &v->slots[h];
+    if (!s->used) return 0;
+    if (s->addr == addr) return s;
+  }
+  return 0;
+}
+
+static const char *rc_name(const struct rc_view *v, const struct rc_slot *s) {
+  /* Returns 0 if the name runs off the end of the string area. */
+  uint32_t strsize= v->hdr->strsize;
+
+  if (s->nameoff >= strsize ||
+      !memchr(v->strs + s->nameoff, 0, strsize - s->nameoff))
+    return 0;
+  return v->strs + s->nameoff;
+}
+
+int revcache_open(struct revcache **rc_r, const char *path) {
+  struct revcache *rc;
+  int fd, e;
+
+  rc= malloc(sizeof(*rc));  if (!rc) return errno;
+  rc->path= malloc(strlen(path)+1);
+  if (!rc->path) { e= errno; free(rc); return e; }
+  strcpy(rc->path,path);
+  memset(&rc->view,0,sizeof(rc->view));
+  rc->pending= 0;
+  rc->npending= rc->apending= 0;
+
+  fd= open(path,O_RDONLY);
+  if (fd >= 0) {
+    e= rc_attach(&rc->view,fd);
+    close(fd);
+  } else {
+    e= errno == ENOENT ? 0 : errno;
+  }
+  if (e) { free(rc->path); free(rc); return e; }
+  *rc_r= rc;
+  return 0;
+}
+
+adns_answer *revcache_lookup(struct revcache *rc, unsigned long addr,
+			     adns_queryflags flags) {
+  const struct rc_slot *s;
+  const char *name;
+  adns_answer *ans;
+  size_t namelen, ownerlen;
+  char *p;
+
+  s= rc_find(&rc->view,addr);
+  if (!s || s->expires <= time(0)) return 0;
+  if (s->status == adns_s_ok) {
+    name= rc_name(&rc->view,s);  if (!name) return 0;
+    namelen= strlen(name)+1;
+  } else {
+    name= 0;
+    namelen= 0;
+  }
+  ownerlen= (flags & adns_qf_owner) ? MAXOWNER : 0;
+
+  ans= malloc(sizeof(*ans) + sizeof(char*) + namelen + ownerlen);
+  if (!ans) return 0;
+  p= (char*)(ans+1) + sizeof(char*);
+  ans->status= s->status;
+  ans->cname= 0;
+  ans->owner= 0;
+  ans->type= adns_r_ptr;
+  ans->expires= s->expires;
+  ans->rrsz= sizeof(char*);
+  ans->partial= 0;
+  if (name) {
+    ans->nrrs= 1;
+    ans->rrs.str= (char**)(ans+1);
+    ans->rrs.str[0]= p;
+    memcpy(p,name,namelen);
+    p+= namelen;
+  } else {
+    ans->nrrs= 0;
+    ans->rrs.untyped= 0;
+  }
+  if (ownerlen) {
+    ans->owner= p;
+    sprintf(p,"%lu.%lu.%lu.%lu.in-addr.arpa",
+	    addr & 0xffUL, (addr>>8) & 0xffUL,
+	    (addr>>16) & 0xffUL, (addr>>24) & 0xffUL);
+  }
+  return ans;
+}
+
+void revcache_store(struct revcache *rc, unsigned long addr,
+		    const adns_answer *answer) {
+  /* The cache is only an optimisation, so if we run out of memory
+   * the answer is just not stored. */
+  struct rc_pending *pe;
+  char *name;
+  int na;
+
+  if (answer->status == adns_s_ok) {
+    if (!answer->nrrs) return;
+    name= malloc(strlen(answer->rrs.str[0])+1);  if (!name) return;
+    strcpy(name,answer->rrs.str[0]);
+  } else if (answer->status > adns_s_max_tempfail) {
+    name= 0;
+  } else {
+    return;
+  }
+  if (rc->npending == rc->apending) {
+    na= rc->apending ? rc->apending*2 : 64;
+    pe= realloc(rc->pending, sizeof(*pe)*na);
+    if (!pe) { free(name); return; }
+    rc->pending= pe;
+    rc->apending= na;
+  }
+  pe= &rc->pending[rc->npending++];
+  pe->addr= addr;
+  pe->status= answer->status;
+  pe->expires= answer->expires;
+  pe->name= name;
+}
+
+static int rc_lock(const char *path, int *fd_r) {
+  /* Opens and locks whichever file is at path once we have the lock. */
+  struct stat fdstab, pathstab;
+  struct flock fl;
+  int fd, e;
+
+  for (;;) {
+    fd= open(path,O_RDWR|O_CREAT,0666);
+    if (fd < 0) return errno;
+    memset(&fl,0,sizeof(fl));
+    fl.l_type= F_WRLCK;
+    fl.l_whence= SEEK_SET;
+    if (fcntl(fd,F_SETLKW,&fl)) {
+      e= errno; close(fd);
+      if (e == EINTR) continue;
+      return e;
+    }
+    if (fstat(fd,&fdstab)) { e= errno; close(fd); return e; }
+    if (!stat(path,&pathstab)) {
+      if (pathstab.st_dev == fdstab.st_dev &&
+	  pathstab.st_ino == fdstab.st_ino) {
+	*fd_r= fd;
+	return 0;
+      }
+    } else if (errno != ENOENT) {
+      e= errno; close(fd); return e;
+    }
+    close(fd);
+  }
+}
+
+static struct rc_slot *rc_newslot(struct rc_slot *slots, uint32_t mask,
+				  unsigned long addr) {
+  /* Returns 0 if addr already has a slot. */
+  uint32_t h;
+
+  for (h= rc_hash(addr,mask); slots[h].used; h= (h+1) & mask)
+    if (slots[h].addr == addr) return 0;
+  return &slots[h];
+}
+
+static void rc_fill(struct rc_slot *s, unsigned long addr,
+		    adns_status status, time_t expires, const char *name,
+		    char *strs, size_t *strsize_io) {
+  size_t len;
+
+  s->addr= addr;
+  s->status= status;
+  s->used= 1;
+  s->expires= expires;
+  s->nameoff= 0;
+  if (name) {
+    len= strlen(name)+1;
+    memcpy(strs + *strsize_io, name, len);
+    s->nameoff= *strsize_io;
+    *strsize_io += len;
+  }
+}
+
+static int rc_writeall(int fd, const void *buf, size_t len) {
+  const char *p= buf;
+  ssize_t r;
+
+  while (len) {
+    r= write(fd,p,len);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return errno;
+    }
+    p+= r;
+    len-= r;
+  }
+  return 0;
+}
+
+static int rc_rewrite(struct revcache *rc, const struct rc_view *old) {
+  /* Replaces the file at rc->path with one holding rc's pending
+   * answers and the live entries from old, newest first. */
+  const struct rc_pending *pe;
+  const struct rc_slot *os;
+  struct rc_header hdr;
+  struct rc_slot *slots, *s;
+  const char *name;
+  char *strs, *tmppath;
+  unsigned long want, nslots, i;
+  size_t strsalloc, strsize;
+  uint32_t nentries;
+  time_t now;
+  int fd, e;
+
+  now= time(0);
+  want= rc->npending;
+  strsalloc= 0;
+  for (i=0; i < (unsigned long)rc->npending; i++)
+    if (rc->pending[i].name) strsalloc += strlen(rc->pending[i].name)+1;
+  if (old->hdr) {
+    for (i=0; i < old->hdr->nslots; i++) want += !!old->slots[i].used;
+    strsalloc += old->hdr->strsize;
+  }
+  if (want > MAXENTRIES || strsalloc > MAXSTRSIZE) return EFBIG;
+  for (nslots= MINSLOTS; nslots < want*2; nslots<<= 1);
+
+  slots= calloc(nslots,sizeof(*slots));
+  strs= malloc(strsalloc ? strsalloc : 1);
+  tmppath= malloc(strlen(rc->path) + 30);
+  if (!slots || !strs || !tmppath) { e= errno; goto x_free; }
+
+  nentries= 0;
+  strsize= 0;
+  for (i= rc->npending; i-- > 0; ) {
+    pe= &rc->pending[i];
+    if (pe->expires <= now) continue;
+    s= rc_newslot(slots,nslots-1,pe->addr);  if (!s) continue;
+    rc_fill(s,pe->addr,pe->status,pe->expires,pe->name,strs,&strsize);
+    nentries++;
+  }
+  for (i=0; old->hdr && i < old->hdr->nslots; i++) {
+    os= &old->slots[i];
+    if (!os->used || os->expires <= now) continue;
+    if (os->status == adns_s_ok) {
+      name= rc_name(old,os);  if (!name) continue;
+    } else {
+      name= 0;
+    }
+    s= rc_newslot(slots,nslots-1,os->addr);  if (!s) continue;
+    rc_fill(s,os->addr,os->status,os->expires,name,strs,&strsize);
+    nentries++;
+  }
+
+  memcpy(hdr.magic,MAGIC,sizeof(hdr.magic));
+  hdr.nslots= nslots;
+  hdr.nentries= nentries;
+  hdr.strsize= strsize;
+  hdr.spare= 0;
+
+  sprintf(tmppath,"%s.tmp.%lu",rc->path,(unsigned long)getpid());
+  fd= open(tmppath,O_WRONLY|O_CREAT|O_TRUNC,0666);
+  if (fd < 0) { e= errno; goto x_free; }
+  e= rc_writeall(fd,&hdr,sizeof(hdr));
+  if (!e) e= rc_writeall(fd,slots,sizeof(*slots)*nslots);
+  if (!e) e= rc_writeall(fd,strs,strsize);
+  if (close(fd) && !e) e= errno;
+  if (!e && rename(tmppath,rc->path)) e= errno;
+  if (e) unlink(tmppath);
+
+x_free:
+  free(slots);
+  free(strs);
+  free(tmppath);
+  return e;
+}
+
+int revcache_close(struct revcache *rc) {
+  struct rc_view cur;
+  int fd, e, i;
+
+  e= 0;
+  fd= -1;
+  if (rc->npending) {
+    e= rc_lock(rc->path,&fd);
+    if (!e) {
+      e= rc_attach(&cur,fd);
+      if (!e) {
+	e= rc_rewrite(rc,&cur);
+	rc_detach(&cur);
+      }
+      close(fd);
+    }
+  }
+  rc_detach(&rc->view);
+  for (i=0; i < rc->npending; i++) free(rc->pending[i].name);
+  free(rc->pending);
+  free(rc->path);
+  free(rc);
+  return e;
+}
@@ -0,0 +1,54 @@
+/*
+ * revcache.h
+ * - declarations for the on-disk reverse lookup cache
+ */
+/*
+ *  This file is part of adns, which is
+ *    Copyright (C) 1997-2000,2003,2006,2014-2016  Ian Jackson
+ *    Copyright (C) 2014  Mark Wooding
+ *    Copyright (C) 1999-2000,2003,2006  Tony Finch
+ *    Copyright (C) 1991 Massachusetts Institute of Technology
+ *  (See the file INSTALL for full details.)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation.
+ */
+
+#ifndef REVCACHE_H_INCLUDED
+#define REVCACHE_H_INCLUDED
+
+struct revcache;
+
+int revcache_open(struct revcache **rc_r, const char *path);
+/* Maps the cache file at path for lookups.  A cache that does not
+ * exist yet, or is not in the expected format, is treated as empty
+ * and is replaced by revcache_close.  Returns 0 or an errno value. */
+
+adns_answer *revcache_lookup(struct revcache *rc, unsigned long addr,
+			     adns_queryflags flags);
+/* addr is an IPv4 address in host byte order.  If the cache holds an
+ * unexpired answer for it, returns a freshly malloc'd answer like the
+ * one a reverse lookup of type adns_r_ptr would give, which the
+ * caller should free.  The only flag heeded is adns_qf_owner.  Returns
+ * 0 if there is no usable entry. */
+
+void revcache_store(struct revcache *rc, unsigned long addr,
+		    const adns_answer *answer);
+/* Remembers answer, to a lookup for addr of type adns_r_ptr, until
+ * revcache_close writes it out.  Temporary failures are not stored. */
+
+int revcache_close(struct revcache *rc);
+/* Merges the stored answers into the cache file, dropping expired
+ * entries, and frees rc.  Returns 0 or an errno value. */
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ * adnsbench.c
+ * - end-to-end throughput benchmark against dnsstandin
+ *   (part of complex test harness, not of the library)
+ */
+/*
+ *  This file is part of adns, which is
+ *    Copyright (C) 1997-2000,2003,2006,2014-2016  Ian Jackson
+ *    Copyright (C) 2014  Mark Wooding
+ *    Copyright (C) 1999-2000,2003,2006  Tony Finch
+ *    Copyright (C) 1991 Massachusetts Institute of Technology
+ *  (See the file INSTALL for full details.)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation.
+ */
+
+/*
+ * Usage:
+ *   adnsbench [-q queries] [-c conc,conc,...] [-S standin-program]
+ *             [-- standin-options ...]
+ *
+ * Starts the stand-in nameserver (default ./dnsstandin) with the
+ * given options, points a fresh adns_state at it for each
+ * concurrency level (default 1,10,100,1000), and keeps that many A
+ * queries outstanding with adns_submit and adns_check until <queries>
+ * (default 20000) have completed.  For each level it prints the
+ * queries per second, the median and 99th percentile latency, and
+ * the user+system CPU time used per query, along with the UDP
+ * retransmissions and TCP fallbacks reported by adns_getstats.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+
+#include "adns.h"
+
+static char defstandin[]= "./dnsstandin";
+static char *standin= defstandin;
+static pid_t standinpid;
+
+static void sysfail(const char *what) {
+  fprintf(stderr,"adnsbench: %s: %s\n",what,strerror(errno));
+  if (standinpid) kill(standinpid,SIGTERM);
+  exit(2);
+}
+
+static void *xmalloc(size_t sz) {
+  void *p= malloc(sz);
+  if (!p) sysfail("malloc");
+  return p;
+}
+
+static int startstandin(char **opts, int nopts) {
+  /* Returns the port the stand-in is listening on. */
+  int pfd[2], port, i;
+  char **argv;
+  FILE *f;
+
+  argv= xmalloc(sizeof(*argv)*(nopts+2));
+  argv[0]= standin;
+  for (i=0; i<nopts; i++) argv[i+1]= opts[i];
+  argv[nopts+1]= 0;
+
+  if (pipe(pfd)) sysfail("pipe");
+  standinpid= fork();
+  if (standinpid<0) sysfail("fork");
+  if (!standinpid) {
+    if (dup2(pfd[1],1)<0) { perror("dup2"); _exit(127); }
+    close(pfd[0]); close(pfd[1]);
+    execvp(standin,argv);
+    fprintf(stderr,"adnsbench: exec %s: %s\n",standin,strerror(errno));
+    _exit(127);
+  }
+  close(pfd[1]);
+  free(argv);
+  f= fdopen(pfd[0],"r");  if (!f) sysfail("fdopen");
+  if (fscanf(f,"port %d",&port) != 1) {
+    fprintf(stderr,"adnsbench: %s did not report its port\n",standin);
+    kill(standinpid,SIGTERM);
+    exit(2);
+  }
+  fclose(f);
+  return port;
+}
+
+static double tvdiff(const struct timeval *a, const struct timeval *b) {
+  /* b-a, in seconds */
+  return (b->tv_sec - a->tv_sec) + (b->tv_usec - a->tv_usec) * 1e-6;
+}
+
+static double cputime(void) {
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF,&ru)) sysfail("getrusage");
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+}
+
+static int dblcmp(const void *av, const void *bv) {
+  const double *a= av, *b= bv;
+  return *a < *b ? -1 : *a > *b;
+}
+
+static void runlevel(int port, int conc, int nqueries) {
+  struct timeval *started, now, begin, tvbuf, *tv;
+  double *latency, cpu0, wall;
+  char cfg[80], name[40];
+  adns_state ads;
+  adns_stats st;
+  adns_query qu;
+  adns_answer *ans;
+  void *ctx;
+  fd_set rfds, wfds, efds;
+  int r, maxfd, submitted, done, outstanding, failed, ix;
+
+  snprintf(cfg,sizeof(cfg),
+	   "nameserver 127.0.0.1\noptions adns_nsport:%d\n",port);
+  r= adns_init_strcfg(&ads,adns_if_noenv|adns_if_noautosys,stderr,cfg);
+  if (r) { errno= r; sysfail("adns_init_strcfg"); }
+
+  started= xmalloc(sizeof(*started)*nqueries);
+  latency= xmalloc(sizeof(*latency)*nqueries);
+  submitted= done= outstanding= failed= 0;
+
+  cpu0= cputime();
+  gettimeofday(&begin,0);
+  while (done < nqueries) {
+    while (outstanding < conc && submitted < nqueries) {
+      snprintf(name,sizeof(name),"q%d.bench.test",submitted);
+      gettimeofday(&started[submitted],0);
+      r= adns_submit(ads,name,adns_r_a,adns_qf_owner,
+		     &started[submitted],&qu);
+      if (r) { errno= r; sysfail("adns_submit"); }
+      submitted++; outstanding++;
+    }
+
+    maxfd= 0; tv= 0;
+    FD_ZERO(&rfds); FD_ZERO(&wfds); FD_ZERO(&efds);
+    adns_beforeselect(ads,&maxfd,&rfds,&wfds,&efds,&tv,&tvbuf,0);
+    r= select(maxfd,&rfds,&wfds,&efds,tv);
+    if (r<0) {
+      if (errno == EINTR) continue;
+      sysfail("select");
+    }
+    gettimeofday(&now,0);
+    adns_afterselect(ads,maxfd,&rfds,&wfds,&efds,&now);
+
+    for (;;) {
+      qu= 0;
+      r= adns_check(ads,&qu,&ans,&ctx);
+      if (r == EAGAIN || r == ESRCH) break;
+      if (r) { errno= r; sysfail("adns_check"); }
+      ix= (struct timeval*)ctx - started;
+      latency[done]= tvdiff(&started[ix],&now);
+      if (ans->status != adns_s_ok) failed++;
+      free(ans);
+      done++; outstanding--;
+    }
+  }
+  gettimeofday(&now,0);
+  wall= tvdiff(&begin,&now);
+
+  adns_getstats(ads,&st);
+
+  qsort(latency,nqueries,sizeof(*latency),dblcmp);
+  printf("conc %5d  %9.0f q/s  p50 %8.3fms  p99 %8.3fms"
+	 "  cpu %7.2fus/q  retries %lu  tcp %lu  failed %d\n",
+	 conc, nqueries/wall,
+	 latency[nqueries/2]*1e3, latency[nqueries*99/100]*1e3,
+	 (cputime()-cpu0)*1e6/nqueries,
+	 st.udpretries, st.tcpfallbacks, failed);
+  fflush(stdout);
+
+  adns_finish(ads);
+  free(started);
+  free(latency);
+}
+
+static void usage(void) {
+  fputs("usage: adnsbench [-q queries] [-c conc,conc,...] [-S standin]\n"
+	"                 [-- standin-options ...]\n",
+	stderr);
+  exit(4);
+}
+
+int main(int argc, char **argv) {
+  const char *concs= "1,10,100,1000";
+  char *ep;
+  int c, nqueries= 20000, port, conc, status;
+
+  while ((c= getopt(argc,argv,"q:c:S:")) != -1) {
+    switch (c) {
+    case 'q': nqueries= atoi(optarg); break;
+    case 'c': concs= optarg; break;
+    case 'S': standin= optarg; break;
+    default: usage();
+    }
+  }
+  if (nqueries <= 0) usage();
+
+  port= startstandin(argv+optind,argc-optind);
+  while (*concs) {
+    conc= strtol(concs,&ep,10);
+    if (ep == concs || conc <= 0 || (*ep && *ep != ',')) usage();
+    runlevel(port,conc,nqueries);
+    concs= *ep ? ep+1 : ep;
+  }
+
+  kill(standinpid,SIGTERM);
+  waitpid(standinpid,&status,0);
+  return 0;
+}
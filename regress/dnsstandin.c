@@ -0,0 +1,447 @@
+/*
+ * dnsstandin.c
+ * - stand-in nameserver for adnsbench
+ *   (part of complex test harness, not of the library)
+ */
+/*
+ *  This file is part of adns, which is
+ *    Copyright (C) 1997-2000,2003,2006,2014-2016  Ian Jackson
+ *    Copyright (C) 2014  Mark Wooding
+ *    Copyright (C) 1999-2000,2003,2006  Tony Finch
+ *    Copyright (C) 1991 Massachusetts Institute of Technology
+ *  (See the file INSTALL for full details.)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation.
+ */
+
+/*
+ * Usage:
+ *   dnsstandin [-p port] [-l latency-ms] [-j jitter-ms] [-d drop-percent]
+ *              [-u duplicate-percent] [-t truncate-percent] [-n answers]
+ *              [-s seed] [-T ttl] [-N address ...] [-S address ...]
+ *              [-I address ...]
+ *
+ * Listens on 127.0.0.1, on the same UDP and TCP port (by default one
+ * chosen by the kernel), and prints `port <n>' on stdout once it is
+ * ready.  Every query for an A record gets an authoritative answer
+ * with <answers> addresses (default 1), except that a name whose first
+ * label is a dotted quad written with hyphens, eg a-b-c-d.standin.test,
+ * gets just the address a.b.c.d.  A PTR query for d.c.b.a.in-addr.arpa
+ * is answered with a-b-c-d.standin.test, so reverse lookups check out,
+ * unless the address was given with -N or -S, in which case the answer
+ * is NXDOMAIN or SERVFAIL respectively, or with -I, in which case the
+ * query is ignored.  Any query for a name whose
+ * first label starts with `nxdomain' or `servfail' fails in the same
+ * way.  An MX query for a name whose first label is `mx' gets five
+ * MX records, all with preference 10, for nxdomain-a, servfail-a,
+ * 10-0-0-1, nxdomain-b and servfail-b in .standin.test, in that order.
+ * Other queries get an empty NOERROR answer.  All records have the
+ * given TTL (default 3600).  Replies are held back by the latency plus a random
+ * amount up to the jitter, so a jitter reorders them.  UDP queries are
+ * dropped, answered twice, or answered with just the TC bit, with the
+ * given probabilities; UDP answers too big for 512 bytes are truncated
+ * too.  Runs until killed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAXMSG 65535
+#define MAXCONNS 16
+#define MAXFAILADDRS 16
+
+struct pending {
+  struct pending *next;
+  struct timeval due;
+  int tcpfd; /* -1 for UDP */
+  struct sockaddr_in to;
+  int len;
+  unsigned char msg[1];
+};
+
+static struct pending *head, *tail;
+static int latencyms, jitterms, droppct, duppct, truncpct, nanswers= 1;
+static unsigned long ttl= 3600;
+static unsigned short xsubi[3]= { 1, 2, 3 };
+
+static struct { struct in_addr addr; int rcode; /* -1: ignore */ }
+  failaddrs[MAXFAILADDRS];
+static int nfailaddrs;
+
+static const char *const mxhosts[]= {
+  "nxdomain-a", "servfail-a", "10-0-0-1", "nxdomain-b", "servfail-b"
+};
+#define NMXHOSTS ((int)(sizeof(mxhosts)/sizeof(*mxhosts)))
+
+struct conn {
+  int fd, used;
+  unsigned char buf[2+MAXMSG];
+};
+static struct conn *conns[MAXCONNS];
+
+static void sysfail(const char *what) {
+  fprintf(stderr,"dnsstandin: %s: %s\n",what,strerror(errno));
+  exit(2);
+}
+
+static void *xmalloc(size_t sz) {
+  void *p= malloc(sz);
+  if (!p) sysfail("malloc");
+  return p;
+}
+
+static int chance(int pct) {
+  return pct && nrand48(xsubi) % 100 < pct;
+}
+
+static int hyphenquad(const unsigned char *label, int len,
+		      unsigned char addr[4]) {
+  /* Parses a-b-c-d; returns 1 if it is one. */
+  char buf[16], *p, *ep;
+  unsigned long v;
+  int i;
+
+  if (len >= (int)sizeof(buf)) return 0;
+  memcpy(buf,label,len);  buf[len]= 0;
+  for (i=0, p= buf; i<4; i++, p= ep+1) {
+    v= strtoul(p,&ep,10);
+    if (ep == p || v > 255 || *ep != (i<3 ? '-' : 0)) return 0;
+    addr[i]= v;
+  }
+  return 1;
+}
+
+static int ptrquery(const unsigned char *q, int qdend, unsigned char *rdata,
+		    int *rcode_r) {
+  /* If q asks about d.c.b.a.in-addr.arpa, writes a-b-c-d.standin.test
+   * to rdata and returns its length, or sets *rcode_r if a.b.c.d is to
+   * fail (to -1 if it is to be ignored); otherwise returns 0. */
+  unsigned long octet[4], addr;
+  char name[64], *ep;
+  int i, o, len;
+
+  for (i=0, o= 12; i<4; i++, o+= len+1) {
+    len= q[o];
+    if (!len || len > 3) return 0;
+    memcpy(name,q+o+1,len);  name[len]= 0;
+    octet[i]= strtoul(name,&ep,10);
+    if (*ep || octet[i] > 255) return 0;
+  }
+  if (qdend-4-o != 14 || memcmp(q+o,"\7in-addr\4arpa",14)) return 0;
+  addr= octet[3]<<24 | octet[2]<<16 | octet[1]<<8 | octet[0];
+  for (i=0; i<nfailaddrs; i++) {
+    if (ntohl(failaddrs[i].addr.s_addr) != addr) continue;
+    *rcode_r= failaddrs[i].rcode;
+    return 0;
+  }
+  len= sprintf(name,"%lu-%lu-%lu-%lu",octet[3],octet[2],octet[1],octet[0]);
+  rdata[0]= len;
+  memcpy(rdata+1,name,len);
+  memcpy(rdata+1+len,"\7standin\4test",14);
+  return len+15;
+}
+
+static int failname(const unsigned char *label) {
+  /* Returns the rcode a name starting with label is to fail with. */
+  if (label[0] >= 8 && !memcmp(label+1,"nxdomain",8)) return 3;
+  if (label[0] >= 8 && !memcmp(label+1,"servfail",8)) return 2;
+  return 0;
+}
+
+static unsigned char *addmx(unsigned char *p, const char *host) {
+  int len= strlen(host);
+
+  *p++= 0; *p++= len+17;	/* RDLENGTH */
+  *p++= 0; *p++= 10;		/* preference */
+  *p++= len;
+  memcpy(p,host,len);  p+= len;
+  memcpy(p,"\7standin\4test",14);
+  return p+14;
+}
+
+static int makereply(const unsigned char *q, int qlen, int udp,
+		     unsigned char *r) {
+  /* Returns the reply length, or -1 to ignore the query. */
+  int qdend, qtype, i, rlen, n, ptrlen, rcode, mx;
+  unsigned char *p, addr[4], ptr[64];
+
+  if (qlen < 12 || (q[2] & 0x80) || q[4] || q[5] != 1) return -1;
+  for (qdend= 12; qdend < qlen && q[qdend]; qdend+= q[qdend]+1) {
+    if (q[qdend] & 0xc0) return -1;
+  }
+  qdend+= 5;
+  if (qdend > qlen) return -1;
+  qtype= (q[qdend-4]<<8) | q[qdend-3];
+
+  memcpy(r,q,qdend);
+  r[2]= 0x84 | (q[2] & 0x01); /* QR, AA, RD copied */
+  r[3]= 0x80; /* RA, NOERROR */
+  memset(r+6,0,6);
+  ptrlen= 0;
+  mx= 0;
+  rcode= failname(q+12);
+  if (rcode) {
+    n= 0;
+  } else if (qtype == 1 && hyphenquad(q+13,q[12],addr)) {
+    n= 1;
+  } else if (qtype == 12 && (ptrlen= ptrquery(q,qdend,ptr,&rcode))) {
+    n= 1;
+  } else if (qtype == 15 && q[12] == 2 && !memcmp(q+13,"mx",2)) {
+    n= NMXHOSTS;
+    mx= 1;
+  } else {
+    if (rcode < 0) return -1;
+    n= qtype == 1 && !rcode ? nanswers : 0;
+    for (i=0; i<4; i++) addr[i]= 0;
+    addr[0]= 10;
+  }
+  if (udp && (chance(truncpct) || qdend + n*16 > 512)) {
+    r[2] |= 0x02;
+    return qdend;
+  }
+  r[3] |= rcode;
+  for (i=0, p= r+qdend; i<n; i++) {
+    *p++= 0xc0; *p++= 12;	/* name: pointer to question */
+    *p++= 0; *p++= mx ? 15 : ptrlen ? 12 : 1; /* type MX, PTR or A */
+    *p++= 0; *p++= 1;		/* class IN */
+    *p++= ttl>>24; *p++= ttl>>16; *p++= ttl>>8; *p++= ttl; /* TTL */
+    if (mx) {
+      p= addmx(p,mxhosts[i]);
+    } else if (ptrlen) {
+      *p++= 0; *p++= ptrlen;
+      memcpy(p,ptr,ptrlen);  p+= ptrlen;
+    } else {
+      *p++= 0; *p++= 4;
+      *p++= addr[0]; *p++= addr[1];
+      *p++= addr[2] | i>>8; *p++= addr[3] | i;
+    }
+  }
+  rlen= p-r;
+  r[6]= n>>8; r[7]= n;
+  return rlen;
+}
+
+static void queue1(const unsigned char *reply, int rlen, int tcpfd,
+		   const struct sockaddr_in *from) {
+  struct pending *pe, **pep;
+  int delayms;
+
+  pe= xmalloc(sizeof(*pe) + rlen + 2);
+  gettimeofday(&pe->due,0);
+  delayms= latencyms + (jitterms ? nrand48(xsubi) % (jitterms+1) : 0);
+  pe->due.tv_usec += delayms*1000;
+  pe->due.tv_sec += pe->due.tv_usec / 1000000;
+  pe->due.tv_usec %= 1000000;
+  pe->tcpfd= tcpfd;
+  if (from) pe->to= *from;
+  if (tcpfd < 0) {
+    memcpy(pe->msg,reply,rlen);
+    pe->len= rlen;
+  } else {
+    pe->msg[0]= rlen>>8; pe->msg[1]= rlen;
+    memcpy(pe->msg+2,reply,rlen);
+    pe->len= rlen+2;
+  }
+  /* Keep the queue in order of due time; without jitter, new
+   * entries always go on the end. */
+  if (!tail || !timercmp(&pe->due,&tail->due,<)) {
+    pe->next= 0;
+    if (tail) tail->next= pe; else head= pe;
+    tail= pe;
+    return;
+  }
+  for (pep= &head; !timercmp(&pe->due,&(*pep)->due,<); pep= &(*pep)->next);
+  pe->next= *pep;
+  *pep= pe;
+}
+
+static void queue(const unsigned char *q, int qlen, int tcpfd,
+		  const struct sockaddr_in *from) {
+  unsigned char reply[MAXMSG];
+  int rlen;
+
+  if (tcpfd < 0 && chance(droppct)) return;
+  rlen= makereply(q,qlen,tcpfd<0,reply);
+  if (rlen < 0) return;
+  if (rlen > MAXMSG-2) rlen= MAXMSG-2;
+  queue1(reply,rlen,tcpfd,from);
+  if (tcpfd < 0 && chance(duppct)) queue1(reply,rlen,tcpfd,from);
+}
+
+static void sendready(int udpfd, const struct timeval *now) {
+  struct pending *pe;
+  int i;
+
+  while ((pe= head) && !timercmp(&pe->due,now,>)) {
+    head= pe->next;
+    if (!head) tail= 0;
+    if (pe->tcpfd < 0) {
+      sendto(udpfd,pe->msg,pe->len,0,
+	     (const struct sockaddr*)&pe->to,sizeof(pe->to));
+    } else {
+      for (i=0; i<MAXCONNS; i++)
+	if (conns[i] && conns[i]->fd == pe->tcpfd) break;
+      if (i<MAXCONNS) write(pe->tcpfd,pe->msg,pe->len);
+    }
+    free(pe);
+  }
+}
+
+static void tcpread(struct conn *c, int ix) {
+  int r, l;
+
+  r= read(c->fd,c->buf+c->used,sizeof(c->buf)-c->used);
+  if (r<=0) {
+    close(c->fd);
+    free(c);
+    conns[ix]= 0;
+    return;
+  }
+  c->used+= r;
+  for (;;) {
+    if (c->used < 2) return;
+    l= (c->buf[0]<<8) | c->buf[1];
+    if (c->used < l+2) return;
+    queue(c->buf+2,l,c->fd,0);
+    memmove(c->buf,c->buf+2+l,c->used-2-l);
+    c->used-= 2+l;
+  }
+}
+
+int main(int argc, char **argv) {
+  struct sockaddr_in sin, from;
+  socklen_t sl;
+  unsigned char buf[MAXMSG];
+  struct timeval now, tv, *tvp;
+  fd_set rfds;
+  int udpfd, tcpfd, fd, c, r, i, maxfd, port= 0, one= 1;
+  int rcvbuf= 1024*1024;
+
+  while ((c= getopt(argc,argv,"p:l:j:d:u:t:n:s:T:N:S:I:")) != -1) {
+    switch (c) {
+    case 'p': port= atoi(optarg); break;
+    case 'l': latencyms= atoi(optarg); break;
+    case 'j': jitterms= atoi(optarg); break;
+    case 'd': droppct= atoi(optarg); break;
+    case 'u': duppct= atoi(optarg); break;
+    case 't': truncpct= atoi(optarg); break;
+    case 'n': nanswers= atoi(optarg); break;
+    case 's': xsubi[0]= atoi(optarg); break;
+    case 'T': ttl= strtoul(optarg,0,0); break;
+    case 'N': case 'S': case 'I':
+      if (nfailaddrs == MAXFAILADDRS ||
+	  !inet_aton(optarg,&failaddrs[nfailaddrs].addr)) {
+	fputs("dnsstandin: bad or too many -N/-S/-I addresses\n",stderr);
+	exit(4);
+      }
+      failaddrs[nfailaddrs++].rcode= c == 'N' ? 3 : c == 'S' ? 2 : -1;
+      break;
+    default:
+      fputs("usage: dnsstandin [-p port] [-l latency-ms] [-j jitter-ms]\n"
+	    "                  [-d drop-percent] [-u duplicate-percent]\n"
+	    "                  [-t truncate-percent] [-n answers] [-s seed]\n"
+	    "                  [-T ttl] [-N address ...] [-S address ...]\n"
+	    "                  [-I address ...]\n",
+	    stderr);
+      exit(4);
+    }
+  }
+  if (nanswers < 0 || nanswers > 4000) {
+    fputs("dnsstandin: -n must be 0..4000\n",stderr);
+    exit(4);
+  }
+
+  memset(&sin,0,sizeof(sin));
+  sin.sin_family= AF_INET;
+  sin.sin_addr.s_addr= htonl(INADDR_LOOPBACK);
+  sin.sin_port= htons(port);
+
+  udpfd= socket(AF_INET,SOCK_DGRAM,0);  if (udpfd<0) sysfail("socket udp");
+  if (bind(udpfd,(struct sockaddr*)&sin,sizeof(sin))) sysfail("bind udp");
+  sl= sizeof(sin);
+  if (getsockname(udpfd,(struct sockaddr*)&sin,&sl)) sysfail("getsockname");
+  /* Bursts of a thousand queries should not overflow the default. */
+  setsockopt(udpfd,SOL_SOCKET,SO_RCVBUF,&rcvbuf,sizeof(rcvbuf));
+
+  tcpfd= socket(AF_INET,SOCK_STREAM,0);  if (tcpfd<0) sysfail("socket tcp");
+  setsockopt(tcpfd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+  if (bind(tcpfd,(struct sockaddr*)&sin,sizeof(sin))) sysfail("bind tcp");
+  if (listen(tcpfd,5)) sysfail("listen");
+  if (fcntl(udpfd,F_SETFL,O_NONBLOCK)) sysfail("fcntl");
+
+  printf("port %d\n",ntohs(sin.sin_port));
+  if (fflush(stdout)) sysfail("stdout");
+
+  for (;;) {
+    FD_ZERO(&rfds);
+    FD_SET(udpfd,&rfds);
+    FD_SET(tcpfd,&rfds);
+    maxfd= udpfd > tcpfd ? udpfd : tcpfd;
+    for (i=0; i<MAXCONNS; i++) {
+      if (!conns[i]) continue;
+      FD_SET(conns[i]->fd,&rfds);
+      if (conns[i]->fd > maxfd) maxfd= conns[i]->fd;
+    }
+    tvp= 0;
+    if (head) {
+      gettimeofday(&now,0);
+      if (timercmp(&head->due,&now,>)) timersub(&head->due,&now,&tv);
+      else timerclear(&tv);
+      tvp= &tv;
+    }
+    r= select(maxfd+1,&rfds,0,0,tvp);
+    if (r<0) {
+      if (errno == EINTR) continue;
+      sysfail("select");
+    }
+
+    if (FD_ISSET(udpfd,&rfds)) {
+      for (;;) {
+	sl= sizeof(from);
+	r= recvfrom(udpfd,buf,sizeof(buf),0,(struct sockaddr*)&from,&sl);
+	if (r<0) break;
+	queue(buf,r,-1,&from);
+      }
+    }
+    if (FD_ISSET(tcpfd,&rfds)) {
+      fd= accept(tcpfd,0,0);
+      if (fd>=0) {
+	for (i=0; i<MAXCONNS && conns[i]; i++);
+	if (i<MAXCONNS) {
+	  conns[i]= xmalloc(sizeof(*conns[i]));
+	  conns[i]->fd= fd;
+	  conns[i]->used= 0;
+	} else {
+	  close(fd);
+	}
+      }
+    }
+    for (i=0; i<MAXCONNS; i++)
+      if (conns[i] && FD_ISSET(conns[i]->fd,&rfds)) tcpread(conns[i],i);
+
+    gettimeofday(&now,0);
+    sendready(udpfd,&now);
+  }
+}
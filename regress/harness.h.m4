@@ -52,6 +52,7 @@ void Tnomem(void);
 void Tfsyscallr(const char *fmt, ...) PRINTFFORMAT(1,2);
 void Tensurerecordfile(void);
 void Tmust(const char *call, const char *arg, int cond);
+unsigned long Tmalloccount(void);
 
 void Tvbf(const char *fmt, ...) PRINTFFORMAT(1,2);
 void Tvbvf(const char *fmt, va_list al);
@@ -289,6 +289,9 @@ void *Hrealloc(void *op, size_t nsz) {
   Hfree(op);
   return np;
 }
+unsigned long Tmalloccount(void) {
+  return malloccount;
+}
 void Texit(int rv) {
   struct malloced *loopnode;
   Tshutdown();
@@ -311,6 +311,10 @@ void *Hrealloc(void *op, size_t nsz) {
   return np;
 }
 
+unsigned long Tmalloccount(void) {
+  return malloccount;
+}
+
 void Texit(int rv) {
   struct malloced *loopnode;
 
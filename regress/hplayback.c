@@ -7,14 +7,45 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include "harness.h"
 static FILE *Tinputfile, *Treportfile;
 static vbuf vb2;
+/* For ADNS_REGRESS_LOOP; see Ploop. */
+struct Tloopstats { unsigned long allocs; double cpu, harness; };
+static int Tloopfd= -1;
+static unsigned long Tloopallocs;
+static double Tloopcpu;
+static double Tharnessstart, Tharnesstime;
 extern void Tshutdown(void) {
   adns__vbuf_free(&vb2);
 }
+static double Tcputime(void) {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID,&ts)) Tfailed("clock_gettime");
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+static void Tloopdone(void) {
+  /* atexit handler in each looped replay: not every client calls
+   * exit, so Texit is not enough. */
+  struct Tloopstats st;
+  st.allocs= Tmalloccount() - Tloopallocs;
+  st.cpu= Tcputime() - Tloopcpu;
+  st.harness= Tharnesstime;
+  if (write(Tloopfd,&st,sizeof(st)) != sizeof(st)) _exit(-1);
+}
+static void Tharness(int entering) {
+  /* Keeps track of the CPU time spent replaying syscalls, so that it
+   * can be subtracted from the CPU time of each looped replay. */
+  double now;
+  if (Tloopfd < 0) return;
+  now= Tcputime();
+  if (entering) { Tharnessstart= now; return; }
+  Tharnesstime += now - Tharnessstart;
+}
 static void Tensurereportfile(void) {
   const char *fdstr;
   int fd;
@@ -32,6 +63,76 @@ static void Pcheckinput(void) {
   if (ferror(Tinputfile)) Tfailed("read test log input file");
   if (feof(Tinputfile)) Psyntax("eof at syscall reply");
 }
+static void Ploop(void) {
+  /* If ADNS_REGRESS_LOOP=<n>, first replay the rest of the session n
+   * times, each in a child process forked here with its output
+   * discarded, and add a line to the report giving the mean CPU time,
+   * time spent in the harness, and allocations, per replay.  Then
+   * carry on with the real replay as usual.  The input file and
+   * stdin must be seekable.  Every replay must exit the same way;
+   * whether that was the right way is checked by the real one.  The
+   * children read the input file through
+   * a buffer, since they need not leave the offset at the end of the
+   * session for r1test. */
+  struct Tloopstats st;
+  const char *lv;
+  char *ep;
+  unsigned long n, i;
+  off_t inpos, stdinpos;
+  int pfd[2], status, firststatus= 0, devnull, infd;
+  double cpu= 0, harness= 0, allocs= 0;
+  pid_t child;
+  lv= getenv("ADNS_REGRESS_LOOP");  if (!lv) return;
+  n= strtoul(lv,&ep,10);
+  if (!n || *ep) Tfailed("ADNS_REGRESS_LOOP bad value");
+  inpos= lseek(fileno(Tinputfile),0,SEEK_CUR);
+  stdinpos= lseek(0,0,SEEK_CUR);
+  if (inpos == -1 || stdinpos == -1) Tfailed("ADNS_REGRESS_LOOP lseek input");
+  for (i=0; i<n; i++) {
+    if (fflush(0)) Toutputerr();
+    if (pipe(pfd)) Tfailed("pipe");
+    child= fork();  if (child == -1) Tfailed("fork");
+    if (!child) {
+      close(pfd[0]);
+      devnull= open("/dev/null",O_WRONLY);
+      if (devnull < 0) Tfailed("open /dev/null");
+      if (dup2(devnull,1) < 0 || dup2(devnull,2) < 0) Tfailed("dup2");
+      Treportfile= fdopen(devnull,"w");
+      if (!Treportfile) Tfailed("fdopen /dev/null");
+      infd= dup(fileno(Tinputfile));  if (infd < 0) Tfailed("dup");
+      Tinputfile= fdopen(infd,"r");
+      if (!Tinputfile) Tfailed("fdopen test log input file");
+      Tloopfd= pfd[1];
+      Tloopallocs= Tmalloccount();
+      Tloopcpu= Tcputime();
+      if (atexit(Tloopdone)) Tfailed("atexit");
+      Tharness(1);
+      return;
+    }
+    close(pfd[1]);
+    if (waitpid(child,&status,0) == -1) Tfailed("waitpid");
+    if (!i) firststatus= status;
+    if (!WIFEXITED(status) || status != firststatus) {
+      fprintf(stderr,"adns test harness: looped replay %lu failed"
+	      " (wait status %d); try without ADNS_REGRESS_LOOP\n",
+	      i,status);
+      exit(-1);
+    }
+    if (read(pfd[0],&st,sizeof(st)) != sizeof(st))
+      Tfailed("read loop statistics");
+    close(pfd[0]);
+    cpu += st.cpu;
+    harness += st.harness;
+    allocs += st.allocs;
+    if (lseek(fileno(Tinputfile),inpos,SEEK_SET) == -1 ||
+	lseek(0,stdinpos,SEEK_SET) == -1)
+      Tfailed("ADNS_REGRESS_LOOP lseek input");
+  }
+  Tensurereportfile();
+  fprintf(Treportfile,"loop %lu: cpu %.2fus harness %.2fus library %.2fus"
+	  " allocations %.1f\n", n, cpu*1e6/n, harness*1e6/n,
+	  (cpu-harness)*1e6/n, allocs/n);
+}
 void Tensurerecordfile(void) {
   const char *fdstr;
   int fd;
@@ -45,6 +146,7 @@ void Tensurerecordfile(void) {
     Tinputfile= fdopen(fd,"r"); if (!Tinputfile) Tfailed("fdopen ADNS_TEST_IN_FD");
   }
   setvbuf(Tinputfile,0,_IONBF,0);
+  Ploop();
   if (!adns__vbuf_ensure(&vb2,1000)) Tnomem();
   fgets(vb2.buf,vb2.avail,Tinputfile); Pcheckinput();
   chars= -1;
@@ -235,6 +337,7 @@ void Q_vb(void) {
 int Hselect(	int max , fd_set *rfds , fd_set *wfds , fd_set *efds , struct timeval *to 	) {
  int r, amtread;
  char *ep;
+ Tharness(1);
  Qselect(	max , rfds , wfds , efds , to 	);
  if (!adns__vbuf_ensure(&vb2,1000)) Tnomem();
  fgets(vb2.buf,vb2.avail,Tinputfile); Pcheckinput();
@@ -249,6 +352,7 @@ int Hselect(	int max , fd_set *rfds , fd_set *wfds , fd_set *efds , struct timev
   int e;
   e= Perrno(vb2.buf+8);
   P_updatetime();
+  Tharness(0);
   errno= e;
   return -1;
  }
@@ -261,12 +365,14 @@ int Hselect(	int max , fd_set *rfds , fd_set *wfds , fd_set *efds , struct timev
  assert(vb2.used <= amtread);
  if (vb2.used != amtread) Psyntax("junk at end of line");
  P_updatetime();
+ Tharness(0);
  return r;
 }
 #ifdef HAVE_POLL
 int Hpoll(	struct pollfd *fds , int nfds , int timeout 	) {
  int r, amtread;
  char *ep;
+ Tharness(1);
  Qpoll(	fds , nfds , timeout 	);
  if (!adns__vbuf_ensure(&vb2,1000)) Tnomem();
  fgets(vb2.buf,vb2.avail,Tinputfile); Pcheckinput();
@@ -281,6 +387,7 @@ int Hpoll(	struct pollfd *fds , int nfds , int timeout 	) {
   int e;
   e= Perrno(vb2.buf+6);
   P_updatetime();
+  Tharness(0);
   errno= e;
   return -1;
  }
@@ -291,6 +398,7 @@ int Hpoll(	struct pollfd *fds , int nfds , int timeout 	) {
  assert(vb2.used <= amtread);
  if (vb2.used != amtread) Psyntax("junk at end of line");
  P_updatetime();
+ Tharness(0);
  return r;
 }
 #endif
@@ -299,6 +407,7 @@ int Hsocket(	int domain , int type , int protocol 	) {
  char *ep;
   Tmust("socket","domain",domain==AF_INET || domain==AF_INET6); 
   Tmust("socket","type",type==SOCK_STREAM || type==SOCK_DGRAM); 
+ Tharness(1);
  Qsocket(	domain , type 	);
  if (!adns__vbuf_ensure(&vb2,1000)) Tnomem();
  fgets(vb2.buf,vb2.avail,Tinputfile); Pcheckinput();
@@ -313,6 +422,7 @@ int Hsocket(	int domain , int type , int protocol 	) {
   int e;
   e= Perrno(vb2.buf+8);
   P_updatetime();
+  Tharness(0);
   errno= e;
   return -1;
  }
@@ -322,6 +432,7 @@ int Hsocket(	int domain , int type , int protocol 	) {
  assert(vb2.used <= amtread);
  if (vb2.used != amtread) Psyntax("junk at end of line");
  P_updatetime();
+ Tharness(0);
  return r;
 }
 int Hfcntl(	int fd , int cmd , ... 	) {
@@ -333,6 +444,7 @@ int Hfcntl(	int fd , int cmd , ... 	) {
   } else {
     arg= 0;
   } 
+ Tharness(1);
  Qfcntl(	fd , cmd , arg 	);
  if (!adns__vbuf_ensure(&vb2,1000)) Tnomem();
  fgets(vb2.buf,vb2.avail,Tinputfile); Pcheckinput();
@@ -347,6 +459,7 @@ int Hfcntl(	int fd , int cmd , ... 	) {
   int e;
   e= Perrno(vb2.buf+7);
   P_updatetime();
+  Tharness(0);
   errno= e;
   return -1;
  }
@@ -370,10 +483,12 @@ int Hfcntl(	int fd , int cmd , ... 	) {
  assert(vb2.used <= amtread);
  if (vb2.used != amtread) Psyntax("junk at end of line");
  P_updatetime();
+ Tharness(0);
  return r;
 }
 int Hconnect(	int fd , const struct sockaddr *addr , int addrlen 	) {
  int r, amtread;
+ Tharness(1);
  Qconnect(	fd , addr , addrlen 	);
  if (!adns__vbuf_ensure(&vb2,1000)) Tnomem();
  fgets(vb2.buf,vb2.avail,Tinputfile); Pcheckinput();
@@ -388,6 +503,7 @@ int Hconnect(	int fd , const struct sockaddr *addr , int addrlen 	) {
   int e;
   e= Perrno(vb2.buf+9);
   P_updatetime();
+  Tharness(0);
   errno= e;
   return -1;
  }
@@ -397,10 +513,12 @@ int Hconnect(	int fd , const struct sockaddr *addr , int addrlen 	) {
  assert(vb2.used <= amtread);
  if (vb2.used != amtread) Psyntax("junk at end of line");
  P_updatetime();
+ Tharness(0);
  return r;
 }
 int Hbind(	int fd , const struct sockaddr *addr , int addrlen 	) {
  int r, amtread;
+ Tharness(1);
  Qbind(	fd , addr , addrlen 	);
  if (!adns__vbuf_ensure(&vb2,1000)) Tnomem();
  fgets(vb2.buf,vb2.avail,Tinputfile); Pcheckinput();
@@ -415,6 +533,7 @@ int Hbind(	int fd , const struct sockaddr *addr , int addrlen 	) {
   int e;
   e= Perrno(vb2.buf+6);
   P_updatetime();
+  Tharness(0);
   errno= e;
   return -1;
  }
@@ -424,10 +543,12 @@ int Hbind(	int fd , const struct sockaddr *addr , int addrlen 	) {
  assert(vb2.used <= amtread);
  if (vb2.used != amtread) Psyntax("junk at end of line");
  P_updatetime();
+ Tharness(0);
  return r;
 }
 int Hlisten(	int fd , int backlog 	) {
  int r, amtread;
+ Tharness(1);
  Qlisten(	fd , backlog 	);
  if (!adns__vbuf_ensure(&vb2,1000)) Tnomem();
  fgets(vb2.buf,vb2.avail,Tinputfile); Pcheckinput();
@@ -442,6 +563,7 @@ int Hlisten(	int fd , int backlog 	) {
   int e;
   e= Perrno(vb2.buf+8);
   P_updatetime();
+  Tharness(0);
   errno= e;
   return -1;
  }
@@ -451,10 +573,12 @@ int Hlisten(	int fd , int backlog 	) {
  assert(vb2.used <= amtread);
  if (vb2.used != amtread) Psyntax("junk at end of line");
  P_updatetime();
+ Tharness(0);
  return r;
 }
 int Hclose(	int fd 	) {
  int r, amtread;
+ Tharness(1);
  Qclose(	fd 	);
  if (!adns__vbuf_ensure(&vb2,1000)) Tnomem();
  fgets(vb2.buf,vb2.avail,Tinputfile); Pcheckinput();
@@ -469,6 +593,7 @@ int Hclose(	int fd 	) {
   int e;
   e= Perrno(vb2.buf+7);
   P_updatetime();
+  Tharness(0);
   errno= e;
   return -1;
  }
@@ -478,12 +603,14 @@ int Hclose(	int fd 	) {
  assert(vb2.used <= amtread);
  if (vb2.used != amtread) Psyntax("junk at end of line");
  P_updatetime();
+ Tharness(0);
  return r;
 }
 int Hsendto(	int fd , const void *msg , int msglen , unsigned int flags , const struct sockaddr *addr , int addrlen 	) {
  int r, amtread;
  char *ep;
 	Tmust("sendto","flags",flags==0); 
+ Tharness(1);
  Qsendto(	fd , msg , msglen , addr , addrlen 	);
  if (!adns__vbuf_ensure(&vb2,1000)) Tnomem();
  fgets(vb2.buf,vb2.avail,Tinputfile); Pcheckinput();
@@ -498,6 +625,7 @@ int Hsendto(	int fd , const void *msg , int msglen , unsigned int flags , const
   int e;
   e= Perrno(vb2.buf+8);
   P_updatetime();
+  Tharness(0);
   errno= e;
   return -1;
  }
@@ -507,12 +635,14 @@ int Hsendto(	int fd , const void *msg , int msglen , unsigned int flags , const
  assert(vb2.used <= amtread);
  if (vb2.used != amtread) Psyntax("junk at end of line");
  P_updatetime();
+ Tharness(0);
  return r;
 }
 int Hrecvfrom(	int fd , void *buf , int buflen , unsigned int flags , struct sockaddr *addr , int *addrlen 	) {
  int r, amtread;
 	Tmust("recvfrom","flags",flags==0); 
 	Tmust("recvfrom","*addrlen",*addrlen>=sizeof(struct sockaddr_in)); 
+ Tharness(1);
  Qrecvfrom(	fd , buflen , *addrlen 	);
  if (!adns__vbuf_ensure(&vb2,1000)) Tnomem();
  fgets(vb2.buf,vb2.avail,Tinputfile); Pcheckinput();
@@ -527,6 +657,7 @@ int Hrecvfrom(	int fd , void *buf , int buflen , unsigned int flags , struct soc
   int e;
   e= Perrno(vb2.buf+10);
   P_updatetime();
+  Tharness(0);
   errno= e;
   return -1;
  }
@@ -538,10 +669,12 @@ int Hrecvfrom(	int fd , void *buf , int buflen , unsigned int flags , struct soc
  if (vb2.used != amtread) Psyntax("junk at end of line");
 	r= Pbytes(buf,buflen); 
  P_updatetime();
+ Tharness(0);
  return r;
 }
 int Hread(	int fd , void *buf , size_t buflen 	) {
  int r, amtread;
+ Tharness(1);
  Qread(	fd , buflen 	);
  if (!adns__vbuf_ensure(&vb2,1000)) Tnomem();
  fgets(vb2.buf,vb2.avail,Tinputfile); Pcheckinput();
@@ -556,6 +689,7 @@ int Hread(	int fd , void *buf , size_t buflen 	) {
   int e;
   e= Perrno(vb2.buf+6);
   P_updatetime();
+  Tharness(0);
   errno= e;
   return -1;
  }
@@ -566,11 +700,13 @@ int Hread(	int fd , void *buf , size_t buflen 	) {
  if (vb2.used != amtread) Psyntax("junk at end of line");
 	r= Pbytes(buf,buflen); 
  P_updatetime();
+ Tharness(0);
  return r;
 }
 int Hwrite(	int fd , const void *buf , size_t len 	) {
  int r, amtread;
  char *ep;
+ Tharness(1);
  Qwrite(	fd , buf , len 	);
  if (!adns__vbuf_ensure(&vb2,1000)) Tnomem();
  fgets(vb2.buf,vb2.avail,Tinputfile); Pcheckinput();
@@ -585,6 +721,7 @@ int Hwrite(	int fd , const void *buf , size_t len 	) {
   int e;
   e= Perrno(vb2.buf+7);
   P_updatetime();
+  Tharness(0);
   errno= e;
   return -1;
  }
@@ -594,5 +731,6 @@ int Hwrite(	int fd , const void *buf , size_t len 	) {
  assert(vb2.used <= amtread);
  if (vb2.used != amtread) Psyntax("junk at end of line");
  P_updatetime();
+ Tharness(0);
  return r;
 }
@@ -34,7 +34,9 @@ m4_include(hmacros.i4)
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -43,10 +45,46 @@ m4_include(hmacros.i4)
 static FILE *Tinputfile, *Treportfile;
 static vbuf vb2;
 
+/* For ADNS_REGRESS_LOOP; see Ploop. */
+struct Tloopstats { unsigned long allocs; double cpu, harness; };
+static int Tloopfd= -1;
+static unsigned long Tloopallocs;
+static double Tloopcpu;
+static double Tharnessstart, Tharnesstime;
+
 extern void Tshutdown(void) {
   adns__vbuf_free(&vb2);
 }
 
+static double Tcputime(void) {
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID,&ts)) Tfailed("clock_gettime");
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void Tloopdone(void) {
+  /* atexit handler in each looped replay: not every client calls
+   * exit, so Texit is not enough. */
+  struct Tloopstats st;
+
+  st.allocs= Tmalloccount() - Tloopallocs;
+  st.cpu= Tcputime() - Tloopcpu;
+  st.harness= Tharnesstime;
+  if (write(Tloopfd,&st,sizeof(st)) != sizeof(st)) _exit(-1);
+}
+
+static void Tharness(int entering) {
+  /* Keeps track of the CPU time spent replaying syscalls, so that it
+   * can be subtracted from the CPU time of each looped replay. */
+  double now;
+
+  if (Tloopfd < 0) return;
+  now= Tcputime();
+  if (entering) { Tharnessstart= now; return; }
+  Tharnesstime += now - Tharnessstart;
+}
+
 static void Tensurereportfile(void) {
   const char *fdstr;
   int fd;
@@ -68,6 +106,79 @@ static void Pcheckinput(void) {
   if (feof(Tinputfile)) Psyntax("eof at syscall reply");
 }
 
+static void Ploop(void) {
+  /* If ADNS_REGRESS_LOOP=<n>, first replay the rest of the session n
+   * times, each in a child process forked here with its output
+   * discarded, and add a line to the report giving the mean CPU time,
+   * time spent in the harness, and allocations, per replay.  Then
+   * carry on with the real replay as usual.  The input file and
+   * stdin must be seekable.  Every replay must exit the same way;
+   * whether that was the right way is checked by the real one.  The
+   * children read the input file through
+   * a buffer, since they need not leave the offset at the end of the
+   * session for r1test. */
+  struct Tloopstats st;
+  const char *lv;
+  char *ep;
+  unsigned long n, i;
+  off_t inpos, stdinpos;
+  int pfd[2], status, firststatus= 0, devnull, infd;
+  double cpu= 0, harness= 0, allocs= 0;
+  pid_t child;
+
+  lv= getenv("ADNS_REGRESS_LOOP");  if (!lv) return;
+  n= strtoul(lv,&ep,10);
+  if (!n || *ep) Tfailed("ADNS_REGRESS_LOOP bad value");
+  inpos= lseek(fileno(Tinputfile),0,SEEK_CUR);
+  stdinpos= lseek(0,0,SEEK_CUR);
+  if (inpos == -1 || stdinpos == -1) Tfailed("ADNS_REGRESS_LOOP lseek input");
+
+  for (i=0; i<n; i++) {
+    if (fflush(0)) Toutputerr();
+    if (pipe(pfd)) Tfailed("pipe");
+    child= fork();  if (child == -1) Tfailed("fork");
+    if (!child) {
+      close(pfd[0]);
+      devnull= open("/dev/null",O_WRONLY);
+      if (devnull < 0) Tfailed("open /dev/null");
+      if (dup2(devnull,1) < 0 || dup2(devnull,2) < 0) Tfailed("dup2");
+      Treportfile= fdopen(devnull,"w");
+      if (!Treportfile) Tfailed("fdopen /dev/null");
+      infd= dup(fileno(Tinputfile));  if (infd < 0) Tfailed("dup");
+      Tinputfile= fdopen(infd,"r");
+      if (!Tinputfile) Tfailed("fdopen test log input file");
+      Tloopfd= pfd[1];
+      Tloopallocs= Tmalloccount();
+      Tloopcpu= Tcputime();
+      if (atexit(Tloopdone)) Tfailed("atexit");
+      Tharness(1);
+      return;
+    }
+    close(pfd[1]);
+    if (waitpid(child,&status,0) == -1) Tfailed("waitpid");
+    if (!i) firststatus= status;
+    if (!WIFEXITED(status) || status != firststatus) {
+      fprintf(stderr,"adns test harness: looped replay %lu failed"
+	      " (wait status %d); try without ADNS_REGRESS_LOOP\n",
+	      i,status);
+      exit(-1);
+    }
+    if (read(pfd[0],&st,sizeof(st)) != sizeof(st))
+      Tfailed("read loop statistics");
+    close(pfd[0]);
+    cpu += st.cpu;
+    harness += st.harness;
+    allocs += st.allocs;
+    if (lseek(fileno(Tinputfile),inpos,SEEK_SET) == -1 ||
+	lseek(0,stdinpos,SEEK_SET) == -1)
+      Tfailed("ADNS_REGRESS_LOOP lseek input");
+  }
+  Tensurereportfile();
+  fprintf(Treportfile,"loop %lu: cpu %.2fus harness %.2fus library %.2fus"
+	  " allocations %.1f\n", n, cpu*1e6/n, harness*1e6/n,
+	  (cpu-harness)*1e6/n, allocs/n);
+}
+
 void Tensurerecordfile(void) {
   const char *fdstr;
   int fd;
@@ -82,6 +193,7 @@ void Tensurerecordfile(void) {
     Tinputfile= fdopen(fd,"r"); if (!Tinputfile) Tfailed("fdopen ADNS_TEST_IN_FD");
   }
   setvbuf(Tinputfile,0,_IONBF,0);
+  Ploop();
 
   if (!adns__vbuf_ensure(&vb2,1000)) Tnomem();
   fgets(vb2.buf,vb2.avail,Tinputfile); Pcheckinput();
@@ -318,6 +430,7 @@ int H$1(hm_args_massage($3,void)) {
  $3
 
  hm_create_hqcall_args
+ Tharness(1);
  Q$1(hm_args_massage($3));
 
  m4_define(`hm_r_offset',`m4_len(` $1=')')
@@ -336,6 +449,7 @@ int H$1(hm_args_massage($3,void)) {
   int e;
   e= Perrno(vb2.buf+hm_r_offset);
   P_updatetime();
+  Tharness(0);
   errno= e;
   return -1;
  }
@@ -385,6 +499,7 @@ int H$1(hm_args_massage($3,void)) {
  $3
 
  P_updatetime();
+ Tharness(0);
  return r;
 }
 ')
@@ -0,0 +1,532 @@
+/*
+ * parsebench.c
+ * - microbenchmark for the reply parsing layer
+ *   (part of complex test harness, not of the library)
+ */
+/*
+ *  This file is part of adns, which is
+ *    Copyright (C) 1997-2000,2003,2006,2014-2016  Ian Jackson
+ *    Copyright (C) 2014  Mark Wooding
+ *    Copyright (C) 1999-2000,2003,2006  Tony Finch
+ *    Copyright (C) 1991 Massachusetts Institute of Technology
+ *  (See the file INSTALL for full details.)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation.
+ */
+
+/*
+ * Usage:
+ *   parsebench [case-<name>.sys ...]
+ *
+ * With no arguments, uses a built-in corpus of generated replies, one
+ * or more for each of the common RR types.  Otherwise, the corpus is
+ * every untruncated NOERROR UDP reply (recvfrom=OK) with a nonempty
+ * answer section found in the given regression recordings.
+ *
+ * Each reply is benchmarked twice, without any sockets being read:
+ *
+ *  parse   the answer section is walked with adns__findrr and each
+ *          RR of the query type is passed to typei->parse, and then
+ *          to typei->convstring, just as reply.c and adns_rr_info do;
+ *  procdgram  a query is submitted and the reply handed to
+ *          adns__procdgram, and the answer collected with adns_check.
+ *          The cost of submitting and cancelling a query is measured
+ *          separately and subtracted.
+ *
+ * The types are queried in their raw forms (eg, MX rather than MX
+ * with addresses), so that no child queries are made.  The results
+ * are reported per type, as CPU ns per RR for parse and convstring,
+ * ns per answer for procdgram, and the number of interim allocations
+ * made while parsing one answer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+#include "internal.h"
+
+#define MAXSAMPLES 1000
+#define TARGETRRS 2000000 /* RRs parsed in total, over all the samples */
+
+struct sample {
+  byte *dgram;
+  int len, qtype, ancount, anstart, nsstart, nscount, arcount;
+  char owner[DNS_MAXDOMAIN+1];
+};
+
+struct typestats {
+  int qtype, samples, procsamples;
+  long rrs, answers, allocs;
+  double tparse, tconv, tproc;
+  long nparse, nconv, nproc;
+};
+
+static struct sample samples[MAXSAMPLES];
+static int nsamples;
+static struct typestats tstats[MAXSAMPLES];
+static int ntstats;
+static adns_state ads;
+
+static void *xmalloc(size_t sz) {
+  void *p= malloc(sz);
+  if (!p) { perror("malloc"); exit(2); }
+  return p;
+}
+
+static double elapsed(clock_t start) {
+  return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+/*
+ * Corpus
+ */
+
+static int skipname(const byte *dgram, int len, int *cbyte_io,
+		    char *text_r) {
+  /* Skips an uncompressed name, optionally rendering it as text.
+   * Returns 0 on success, -1 if the name is malformed. */
+  int cbyte= *cbyte_io, l, i, tl= 0;
+
+  for (;;) {
+    if (cbyte >= len) return -1;
+    l= dgram[cbyte++];
+    if (!l) break;
+    if ((l & 0xc0) == 0xc0) { cbyte++; break; }
+    if (l & 0xc0 || cbyte+l > len || tl+l+1 > DNS_MAXDOMAIN) return -1;
+    if (text_r) {
+      if (tl) text_r[tl++]= '.';
+      for (i=0; i<l; i++) text_r[tl++]= dgram[cbyte+i];
+    }
+    cbyte+= l;
+  }
+  if (text_r) text_r[tl]= 0;
+  *cbyte_io= cbyte;
+  return 0;
+}
+
+static int skiprrs(const byte *dgram, int len, int *cbyte_io, int n) {
+  int cbyte= *cbyte_io;
+
+  while (n-- > 0) {
+    if (skipname(dgram,len,&cbyte,0)) return -1;
+    if (cbyte+10 > len) return -1;
+    cbyte+= 10 + ((dgram[cbyte+8]<<8) | dgram[cbyte+9]);
+    if (cbyte > len) return -1;
+  }
+  *cbyte_io= cbyte;
+  return 0;
+}
+
+static void addsample(const byte *dgram, int len, const char *where) {
+  struct sample *s;
+  int cbyte, qdcount;
+
+  if (nsamples >= MAXSAMPLES) return;
+  if (len < DNS_HDRSIZE || !(dgram[2] & 0x80) || (dgram[2] & 0x02) ||
+      (dgram[3] & 0x0f))
+    return;
+  s= &samples[nsamples];
+  qdcount= (dgram[4]<<8) | dgram[5];
+  s->ancount= (dgram[6]<<8) | dgram[7];
+  s->nscount= (dgram[8]<<8) | dgram[9];
+  s->arcount= (dgram[10]<<8) | dgram[11];
+  if (qdcount != 1 || !s->ancount) return;
+  cbyte= DNS_HDRSIZE;
+  if (skipname(dgram,len,&cbyte,s->owner) || cbyte+4 > len) goto bad;
+  s->qtype= (dgram[cbyte]<<8) | dgram[cbyte+1];
+  if (dgram[cbyte+2] || dgram[cbyte+3] != DNS_CLASS_IN) return;
+  cbyte+= 4;
+  s->anstart= cbyte;
+  if (skiprrs(dgram,len,&cbyte,s->ancount)) goto bad;
+  s->nsstart= cbyte;
+  if (!adns__findtype(s->qtype)) return;
+  s->dgram= xmalloc(len);
+  memcpy(s->dgram,dgram,len);
+  s->len= len;
+  nsamples++;
+  return;
+
+ bad:
+  fprintf(stderr,"parsebench: %s: ignoring malformed reply\n",where);
+}
+
+static void loadsys(const char *fn) {
+  /* Picks out the datagrams following `recvfrom=OK' lines. */
+  char line[1000], *p, *ep;
+  byte dgram[DNS_MAXUDP*2];
+  int len, inreply= 0;
+  unsigned long v;
+  FILE *f;
+
+  f= fopen(fn,"r");
+  if (!f) { fprintf(stderr,"parsebench: %s: %s\n",fn,strerror(errno)); exit(2); }
+  len= 0;
+  while (fgets(line,sizeof(line),f)) {
+    if (inreply && !strncmp(line,"     ",5)) {
+      for (p= line; ; p= ep) {
+	while (*p == ' ') p++;
+	if (!isxdigit((unsigned char)*p)) break;
+	v= strtoul(p,&ep,16);
+	for (; p+1 < ep && len < sizeof(dgram); p+= 2)
+	  dgram[len++]= v >> ((ep-p-2)*4);
+      }
+      continue;
+    }
+    if (inreply) addsample(dgram,len,fn);
+    inreply= !strncmp(line," recvfrom=OK",12);
+    len= 0;
+  }
+  if (inreply) addsample(dgram,len,fn);
+  if (ferror(f)) { perror(fn); exit(2); }
+  fclose(f);
+}
+
+static byte *putname(byte *p, const char *name) {
+  const char *dot;
+  int l;
+
+  for (;;) {
+    dot= strchr(name,'.');
+    l= dot ? dot-name : strlen(name);
+    *p++= l;
+    memcpy(p,name,l);  p+= l;
+    if (!dot) break;
+    name= dot+1;
+  }
+  *p++= 0;
+  return p;
+}
+
+static byte *putrrhead(byte *p, int type) {
+  /* Owner is the question name; rdlength is filled in by putrdlen. */
+  *p++= 0xc0; *p++= DNS_HDRSIZE;
+  *p++= type>>8; *p++= type;
+  *p++= 0; *p++= DNS_CLASS_IN;
+  *p++= 0; *p++= 0; *p++= 0x0e; *p++= 0x10;
+  return p+2;
+}
+
+static void putrdlen(byte *rdstart, byte *p) {
+  rdstart[-2]= (p-rdstart)>>8;
+  rdstart[-1]= (p-rdstart);
+}
+
+static void generate(int type, int nrrs) {
+  static const char *const hosts[]= {
+    "mail.example.com", "ns1.example.net", "server.subdomain.example.org",
+    "a.very.long.host.name.in.a.deep.subdomain.example.com"
+  };
+  byte dgram[DNS_MAXUDP], *p, *rd;
+  const char *qname;
+  int i;
+
+  qname= type == adns_r_ptr_raw ? "4.3.2.1.in-addr.arpa" : "bench.example.com";
+  memset(dgram,0,DNS_HDRSIZE);
+  dgram[2]= 0x85; dgram[3]= 0x80;
+  dgram[5]= 1;
+  dgram[6]= nrrs>>8; dgram[7]= nrrs;
+  p= putname(dgram+DNS_HDRSIZE,qname);
+  *p++= type>>8; *p++= type; *p++= 0; *p++= DNS_CLASS_IN;
+
+  for (i=0; i<nrrs; i++) {
+    rd= p= putrrhead(p,type);
+    switch (type) {
+    case adns_r_a:
+      *p++= 192; *p++= 0; *p++= 2; *p++= i;
+      break;
+    case adns_r_aaaa:
+      memset(p,0,16); p[0]= 0x20; p[1]= 0x01; p[2]= 0x0d; p[3]= 0xb8;
+      p[15]= i; p+= 16;
+      break;
+    case adns_r_mx_raw:
+      *p++= 0; *p++= i*10;
+      /* fall through */
+    case adns_r_ns_raw: case adns_r_ptr_raw: case adns_r_cname:
+      p= putname(p,hosts[i%4]);
+      break;
+    case adns_r_srv_raw:
+      *p++= 0; *p++= i/2; *p++= 0; *p++= 10+i; *p++= 0x13; *p++= 0xc4;
+      p= putname(p,hosts[i%4]);
+      break;
+    case adns_r_txt:
+      *p++= 22; memcpy(p,"v=spf1 -all include:x ",22); p+= 22;
+      *p++= 10; memcpy(p,"some\"quote",10); p+= 10;
+      break;
+    case adns_r_hinfo:
+      *p++= 5; memcpy(p,"Intel",5); p+= 5;
+      *p++= 5; memcpy(p,"Linux",5); p+= 5;
+      break;
+    case adns_r_soa_raw:
+      p= putname(p,hosts[1]);
+      p= putname(p,"hostmaster.example.com");
+      memset(p,0,20); p[3]= 1; p[7]= 60; p[11]= 60; p[15]= 60; p[19]= 60;
+      p+= 20;
+      break;
+    case adns_r_rp_raw:
+      p= putname(p,"admin.example.com");
+      p= putname(p,"info.example.com");
+      break;
+    default:
+      abort();
+    }
+    putrdlen(rd,p);
+  }
+  addsample(dgram,p-dgram,"generated");
+}
+
+static void builtin(void) {
+  generate(adns_r_a,1);
+  generate(adns_r_a,8);
+  generate(adns_r_aaaa,4);
+  generate(adns_r_cname,1);
+  generate(adns_r_ptr_raw,1);
+  generate(adns_r_ns_raw,4);
+  generate(adns_r_mx_raw,4);
+  generate(adns_r_srv_raw,8);
+  generate(adns_r_txt,4);
+  generate(adns_r_hinfo,1);
+  generate(adns_r_soa_raw,1);
+  generate(adns_r_rp_raw,2);
+}
+
+/*
+ * Benchmarks
+ */
+
+static struct typestats *findstats(int qtype) {
+  struct typestats *ts;
+
+  for (ts= tstats; ts < tstats+ntstats; ts++)
+    if (ts->qtype == qtype) return ts;
+  ts= &tstats[ntstats++];
+  memset(ts,0,sizeof(*ts));
+  ts->qtype= qtype;
+  return ts;
+}
+
+static void freeafter(adns_query qu, allocnode *mark) {
+  allocnode *an, *ann;
+
+  for (an= mark ? mark->next : qu->allocations.head; an; an= ann) {
+    ann= an->next;
+    adns__free_interim(qu,(byte*)an + MEM_ROUND(sizeof(*an)));
+  }
+}
+
+static int countallocs(adns_query qu) {
+  allocnode *an;
+  int n;
+
+  for (an= qu->allocations.head, n=0; an; an= an->next) n++;
+  return n;
+}
+
+static int parseanswer(adns_query qu, const struct sample *s, int rrsz,
+		       byte **rrs_r, int *nallocs_r) {
+  /* Parses the answer as reply.c does.  Returns the number of RRs,
+   * or -1 on failure.  The RRs are left in interim allocations. */
+  const typeinfo *typei= qu->typei;
+  struct glueindex glue;
+  parseinfo pai;
+  unsigned long ttl;
+  int cbyte, rri, nrrs, type, class, rdlen, rdstart;
+  byte *rrs;
+  adns_status st;
+
+  rrs= adns__alloc_interim(qu,rrsz*s->ancount);
+  if (!rrs) return -1;
+  pai.ads= ads;
+  pai.qu= qu;
+  pai.serv= 0;
+  pai.dgram= s->dgram;
+  pai.dglen= s->len;
+  pai.nsstart= s->nsstart;
+  pai.nscount= s->nscount;
+  pai.arcount= s->arcount;
+  gettimeofday(&pai.now,0);
+  pai.glue= &glue;
+  glue.built= 0;
+
+  cbyte= s->anstart;
+  for (rri=0, nrrs=0; rri<s->ancount; rri++) {
+    st= adns__findrr(qu,0, s->dgram,s->len,&cbyte,
+		     &type,&class,&ttl, &rdlen,&rdstart, 0);
+    if (st || type == -1) return -1;
+    if (class != DNS_CLASS_IN || type != s->qtype) continue;
+    st= typei->parse(&pai, rdstart,rdstart+rdlen, rrs+nrrs*rrsz);
+    if (st || rdstart == -1) return -1;
+    nrrs++;
+  }
+  if (nallocs_r) *nallocs_r= countallocs(qu);
+  *rrs_r= rrs;
+  return nrrs;
+}
+
+static void bench_parse(const struct sample *s, struct typestats *ts) {
+  const typeinfo *typei;
+  adns_query qu;
+  allocnode *mark;
+  byte *rrs;
+  vbuf vb;
+  int r, reps, rep, nrrs, rrsz, i, nallocs, mallocs;
+  clock_t start;
+
+  r= adns_submit(ads,s->owner,s->qtype,adns_qf_quoteok_query,0,&qu);
+  if (r) {
+    fprintf(stderr,"parsebench: cannot submit %s: %s\n",
+	    s->owner,strerror(r));
+    return;
+  }
+  if (qu->state != query_tosend) {
+    /* Failed at once, eg because the name is not acceptable. */
+    adns_cancel(qu);
+    return;
+  }
+  typei= qu->typei;
+  rrsz= qu->answer->rrsz;
+  mark= qu->allocations.tail;
+  mallocs= countallocs(qu);
+
+  nrrs= parseanswer(qu,s,rrsz,&rrs,&nallocs);
+  freeafter(qu,mark);
+  if (nrrs <= 0) {
+    /* nrrs==0 is eg a CNAME with no RRs of the query type */
+    if (nrrs)
+      fprintf(stderr,"parsebench: %s %s: reply does not parse\n",
+	      typei->rrtname,s->owner);
+    adns_cancel(qu);
+    return;
+  }
+  reps= TARGETRRS / nsamples / nrrs + 1;
+
+  start= clock();
+  for (rep=0; rep<reps; rep++) {
+    parseanswer(qu,s,rrsz,&rrs,0);
+    freeafter(qu,mark);
+  }
+  ts->tparse+= elapsed(start);
+  ts->nparse+= (long)reps*nrrs;
+
+  adns__vbuf_init(&vb);
+  parseanswer(qu,s,rrsz,&rrs,0);
+  start= clock();
+  for (rep=0; rep<reps; rep++) {
+    for (i=0; i<nrrs; i++) {
+      vb.used= 0;
+      typei->convstring(&vb,rrs+i*rrsz);
+    }
+  }
+  ts->tconv+= elapsed(start);
+  ts->nconv+= (long)reps*nrrs;
+  freeafter(qu,mark);
+  adns__vbuf_free(&vb);
+
+  ts->samples++;
+  ts->rrs+= nrrs;
+  ts->answers++;
+  ts->allocs+= nallocs - mallocs;
+  adns_cancel(qu);
+}
+
+static double submitcost(const struct sample *s, int reps) {
+  adns_query qu;
+  clock_t start;
+  int rep;
+
+  start= clock();
+  for (rep=0; rep<reps; rep++) {
+    if (adns_submit(ads,s->owner,s->qtype,adns_qf_quoteok_query,0,&qu))
+      return 0;
+    adns_cancel(qu);
+  }
+  return elapsed(start);
+}
+
+static void bench_procdgram(struct sample *s, struct typestats *ts) {
+  /* Only called for samples which bench_parse found acceptable. */
+  adns_query qu;
+  adns_answer *ans;
+  struct timeval now;
+  int r, rep, reps;
+  clock_t start;
+  double t;
+
+  reps= TARGETRRS / nsamples / s->ancount / 4 + 1;
+  start= clock();
+  for (rep=0; rep<reps; rep++) {
+    r= adns_submit(ads,s->owner,s->qtype,adns_qf_quoteok_query,0,&qu);
+    if (r) return;
+    if (qu->state != query_tosend) { adns_cancel(qu); return; }
+    s->dgram[0]= qu->id>>8;
+    s->dgram[1]= qu->id;
+    gettimeofday(&now,0);
+    adns__procdgram(ads,s->dgram,s->len,0,0,now);
+    r= adns_check(ads,&qu,&ans,0);
+    if (r) {
+      fprintf(stderr,"parsebench: %s: reply not accepted by procdgram\n",
+	      s->owner);
+      adns_cancel(qu);
+      return;
+    }
+    free(ans);
+  }
+  t= elapsed(start) - submitcost(s,reps);
+  ts->tproc+= t > 0 ? t : 0;
+  ts->nproc+= reps;
+  ts->procsamples++;
+}
+
+int main(int argc, const char *const *argv) {
+  struct typestats *ts;
+  const typeinfo *typei;
+  int r, i;
+
+  if (argc > 1) {
+    for (i=1; i<argc; i++) loadsys(argv[i]);
+  } else {
+    builtin();
+  }
+  if (!nsamples) { fputs("parsebench: no usable replies\n",stderr); exit(1); }
+
+  /* Queries are sent to the discard port; nothing is ever read. */
+  r= adns_init_strcfg(&ads, adns_if_noenv|adns_if_noautosys|
+		      adns_if_noerrprint|adns_if_noserverwarn, 0,
+		      "nameserver 127.0.0.1\noptions adns_nsport:9\n");
+  if (r) { fprintf(stderr,"parsebench: init: %s\n",strerror(r)); exit(2); }
+
+  for (i=0; i<nsamples; i++) {
+    ts= findstats(samples[i].qtype);
+    r= ts->samples;
+    bench_parse(&samples[i],ts);
+    if (ts->samples > r) bench_procdgram(&samples[i],ts);
+  }
+
+  printf("%-8s %7s %6s %12s %12s %14s %12s\n", "type","samples","RRs",
+	 "parse ns/RR","conv ns/RR","procdgram ns","allocs/ans");
+  for (ts= tstats; ts < tstats+ntstats; ts++) {
+    if (!ts->samples) continue;
+    typei= adns__findtype(ts->qtype);
+    printf("%-8s %7d %6ld %12.1f %12.1f %14.1f %12.2f\n",
+	   typei->rrtname, ts->samples, ts->rrs,
+	   ts->tparse*1e9/ts->nparse, ts->tconv*1e9/ts->nconv,
+	   ts->nproc ? ts->tproc*1e9/ts->nproc : 0.0,
+	   (double)ts->allocs/ts->answers);
+  }
+  adns_finish(ads);
+  return 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * revcachetest.c
+ * - test for the on-disk reverse lookup cache used by the clients
+ *   (part of complex test harness, not of the library)
+ */
+/*
+ *  This file is part of adns, which is
+ *    Copyright (C) 1997-2000,2003,2006,2014-2016  Ian Jackson
+ *    Copyright (C) 2014  Mark Wooding
+ *    Copyright (C) 1999-2000,2003,2006  Tony Finch
+ *    Copyright (C) 1991 Massachusetts Institute of Technology
+ *  (See the file INSTALL for full details.)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation.
+ */
+
+/*
+ * Usage:
+ *   revcachetest    run the tests; exit status 0 iff they pass
+ *
+ * Works on revcachetest.tmp in the current directory, which is
+ * removed afterwards.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "adns.h"
+#include "revcache.h"
+
+#define CACHEFILE "revcachetest.tmp"
+
+#define ADDR_OK      0x0a010203UL /* 10.1.2.3 */
+#define ADDR_NX      0x0a010204UL
+#define ADDR_TEMP    0x0a010205UL
+#define ADDR_GONE    0x0a010206UL /* already expired when stored */
+#define ADDR_SHORT   0x0a010207UL /* expires while we wait */
+#define ADDR_UNKNOWN 0x0a090909UL
+
+static int fails;
+
+static void fail(const char *what) {
+  fprintf(stderr,"revcachetest: %s\n",what);
+  fails++;
+}
+
+static void store(struct revcache *rc, unsigned long addr,
+		  adns_status status, const char *name, time_t expires) {
+  adns_answer ans;
+  char buf[100], *str= buf;
+
+  if (name) strcpy(buf,name);
+  memset(&ans,0,sizeof(ans));
+  ans.status= status;
+  ans.type= adns_r_ptr;
+  ans.expires= expires;
+  ans.rrsz= sizeof(char*);
+  ans.nrrs= !!name;
+  ans.rrs.str= name ? &str : 0;
+  revcache_store(rc,addr,&ans);
+}
+
+static struct revcache *openit(void) {
+  struct revcache *rc;
+  int r;
+
+  r= revcache_open(&rc,CACHEFILE);
+  if (r) {
+    fprintf(stderr,"revcachetest: open: %s\n",strerror(r));
+    exit(2);
+  }
+  return rc;
+}
+
+static void closeit(struct revcache *rc) {
+  int r;
+
+  r= revcache_close(rc);
+  if (r) {
+    fprintf(stderr,"revcachetest: close: %s\n",strerror(r));
+    exit(2);
+  }
+}
+
+static void expectmiss(struct revcache *rc, unsigned long addr,
+		       const char *what) {
+  adns_answer *ans;
+
+  ans= revcache_lookup(rc,addr,0);
+  if (ans) { fail(what); free(ans); }
+}
+
+static void writefile(const void *data, size_t len) {
+  FILE *f;
+
+  f= fopen(CACHEFILE,"wb");
+  if (!f || fwrite(data,1,len,f) != len || fclose(f)) {
+    perror("revcachetest: write " CACHEFILE);
+    exit(2);
+  }
+}
+
+static void populate(void) {
+  struct revcache *rc;
+  time_t now= time(0);
+
+  rc= openit();
+  expectmiss(rc,ADDR_OK,"entry found in a cache which does not exist");
+  store(rc,ADDR_OK,adns_s_ok,"host.example.",now+3600);
+  store(rc,ADDR_NX,adns_s_nxdomain,0,now+3600);
+  store(rc,ADDR_TEMP,adns_s_timeout,0,now+3600);
+  store(rc,ADDR_GONE,adns_s_ok,"gone.example.",now-1);
+  store(rc,ADDR_SHORT,adns_s_ok,"short.example.",now+1);
+  closeit(rc);
+}
+
+static void test_roundtrip(void) {
+  struct revcache *rc;
+  adns_answer *ans;
+
+  populate();
+  rc= openit();
+
+  ans= revcache_lookup(rc,ADDR_OK,0);
+  if (!ans) {
+    fail("stored answer not found after reopening");
+  } else {
+    if (ans->status != adns_s_ok || ans->type != adns_r_ptr ||
+	ans->nrrs != 1 || strcmp(ans->rrs.str[0],"host.example."))
+      fail("stored answer came back wrong");
+    if (ans->partial) fail("answer from the cache marked partial");
+    if (ans->owner) fail("owner set without adns_qf_owner");
+    if (ans->expires <= time(0)) fail("answer from the cache expired");
+    free(ans);
+  }
+  ans= revcache_lookup(rc,ADDR_OK,adns_qf_owner);
+  if (!ans || !ans->owner || strcmp(ans->owner,"3.2.1.10.in-addr.arpa"))
+    fail("owner wrong with adns_qf_owner");
+  free(ans);
+
+  ans= revcache_lookup(rc,ADDR_NX,0);
+  if (!ans || ans->status != adns_s_nxdomain || ans->nrrs || ans->partial)
+    fail("permanent failure not remembered");
+  free(ans);
+
+  expectmiss(rc,ADDR_TEMP,"temporary failure was stored");
+  expectmiss(rc,ADDR_GONE,"answer which had expired was stored");
+  expectmiss(rc,ADDR_UNKNOWN,"entry found for an address never stored");
+  closeit(rc);
+
+  /* The file is only checked at lookup time, not just when written. */
+  sleep(2);
+  rc= openit();
+  expectmiss(rc,ADDR_SHORT,"entry returned after it expired");
+  if (!(ans= revcache_lookup(rc,ADDR_OK,0)))
+    fail("entry lost when the cache was merged");
+  free(ans);
+  closeit(rc);
+}
+
+static void test_bad(const char *what, const void *data, size_t len) {
+  struct revcache *rc;
+  adns_answer *ans;
+  char buf[200];
+
+  writefile(data,len);
+  rc= openit();
+  snprintf(buf,sizeof(buf),"entry found in %s",what);
+  expectmiss(rc,ADDR_OK,buf);
+  store(rc,ADDR_NX,adns_s_nxdomain,0,time(0)+3600);
+  closeit(rc);
+
+  rc= openit();
+  ans= revcache_lookup(rc,ADDR_NX,0);
+  snprintf(buf,sizeof(buf),"%s not replaced by a good cache",what);
+  if (!ans || ans->status != adns_s_nxdomain) fail(buf);
+  free(ans);
+  closeit(rc);
+}
+
+static void test_corrupt(void) {
+  static const char junk[256]= "this is not a cache file\n";
+  char *good;
+  long len;
+  FILE *f;
+
+  test_bad("an empty file","",0);
+  test_bad("a short file","adnsrc1\n",8);
+  test_bad("a file of junk",junk,sizeof(junk));
+
+  populate();
+  f= fopen(CACHEFILE,"rb");
+  if (!f || fseek(f,0,SEEK_END) || (len= ftell(f)) <= 0) {
+    perror("revcachetest: read " CACHEFILE);
+    exit(2);
+  }
+  good= malloc(len);
+  rewind(f);
+  if (!good || fread(good,1,len,f) != (size_t)len) {
+    perror("revcachetest: read " CACHEFILE);
+    exit(2);
+  }
+  fclose(f);
+  test_bad("a truncated file",good,len-1);
+  free(good);
+}
+
+int main(void) {
+  unlink(CACHEFILE);
+  test_roundtrip();
+  test_corrupt();
+  unlink(CACHEFILE);
+  if (fails) { fprintf(stderr,"revcachetest: FAILED\n"); exit(1); }
+  printf("revcache: all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * wshuffle.c
+ * - test and benchmark for adns__wshuffle (SRV weighted ordering)
+ *   (part of complex test harness, not of the library)
+ */
+/*
+ *  This file is part of adns, which is
+ *    Copyright (C) 1997-2000,2003,2006,2014-2016  Ian Jackson
+ *    Copyright (C) 2014  Mark Wooding
+ *    Copyright (C) 1999-2000,2003,2006  Tony Finch
+ *    Copyright (C) 1991 Massachusetts Institute of Technology
+ *  (See the file INSTALL for full details.)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation.
+ */
+
+/*
+ * Usage:
+ *   wshuffle        run the tests; exit status 0 iff they pass
+ *   wshuffle -b     also time adns__wshuffle against the old
+ *                   linear-scan selection, for various group sizes
+ *
+ * The tests check that adns__wshuffle selects exactly the same
+ * ordering as the old algorithm given the same random state, and
+ * that the position-0 frequencies fit the intended distribution
+ * (chi-squared test).  The random seeds are fixed so the results are
+ * reproducible.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "internal.h"
+
+struct obj { int weight, ix; };
+
+static int getweight(const void *obj) {
+  const struct obj *o= obj;
+  return o->weight;
+}
+
+static void oldshuffle(struct obj *objs, int n, unsigned short xsubi[3]) {
+  /* The linear-scan selection formerly in postsort_srv. */
+  struct obj *workbegin, *workend, *search, tmp;
+  int totalweight, runtotal, i;
+  long randval;
+
+  workend= objs + n;
+  for (i=0, totalweight=0; i<n; i++) totalweight += objs[i].weight;
+  for (workbegin= objs; workbegin+1 < workend; workbegin++) {
+    randval= nrand48(xsubi);
+    randval %= (totalweight + 1);
+    for (search=workbegin, runtotal=0;
+	 (runtotal += search->weight) < randval;
+	 search++);
+    totalweight -= search->weight;
+    if (search != workbegin) {
+      tmp= *workbegin; *workbegin= *search; *search= tmp;
+    }
+  }
+}
+
+static void *xmalloc(size_t sz) {
+  void *p= malloc(sz);
+  if (!p) { perror("malloc"); exit(2); }
+  return p;
+}
+
+static void setup(struct obj *objs, int n, int maxweight,
+		  unsigned short gen[3]) {
+  int i;
+  for (i=0; i<n; i++) {
+    /* plenty of zero weights, which are the interesting edge case */
+    objs[i].weight= nrand48(gen) % 4 ? nrand48(gen) % (maxweight+1) : 0;
+    objs[i].ix= i;
+  }
+}
+
+static int test_same(void) {
+  unsigned short gen[3]= { 1, 2, 3 };
+  unsigned short xa[3], xb[3];
+  static const int maxweights[]= { 0, 1, 10, 65535 };
+  struct obj *a, *b;
+  void *tempbuf;
+  int trial, n, m, fails= 0;
+
+  a= xmalloc(sizeof(*a)*1000);
+  b= xmalloc(sizeof(*b)*1000);
+  tempbuf= xmalloc(SORT_TEMPSZ(1000,sizeof(*a)));
+  for (trial=0; trial<5000; trial++) {
+    n= trial < 1000 ? trial % 10 + 1 : nrand48(gen) % 1000 + 1;
+    m= maxweights[trial % (sizeof(maxweights)/sizeof(*maxweights))];
+    setup(a,n,m,gen);
+    memcpy(b,a,sizeof(*a)*n);
+    xa[0]= xb[0]= nrand48(gen);
+    xa[1]= xb[1]= nrand48(gen);
+    xa[2]= xb[2]= nrand48(gen);
+    oldshuffle(a,n,xa);
+    adns__wshuffle(b,n,sizeof(*b),tempbuf,getweight,xb);
+    if (memcmp(a,b,sizeof(*a)*n) || memcmp(xa,xb,sizeof(xa))) {
+      fprintf(stderr,"wshuffle: trial %d (n=%d) differs from old order\n",
+	      trial,n);
+      fails++;
+    }
+  }
+  free(a); free(b); free(tempbuf);
+  return fails;
+}
+
+static int test_distribution(void) {
+  /* With randval uniform in 0..W (W the total weight), the object at
+   * position i is chosen first with probability w_i/(W+1), except
+   * that the first object also takes the randval==0 case.  We pad
+   * with zero-weight objects so as to exercise the Fenwick tree
+   * rather than the linear scan used for small arrays. */
+  static const int weights[200]= { 0, 10, 20, 0, 30, 5, 60, 1, 0, 100 };
+  enum { n= sizeof(weights)/sizeof(*weights), ntrials= 200000 };
+  unsigned short xsubi[3]= { 0x1234, 0x5678, 0x9abc };
+  struct obj objs[n];
+  long counts[n];
+  char tempbuf[SORT_TEMPSZ(n,sizeof(struct obj))];
+  double expected, diff, chisq= 0;
+  int i, trial, total, df= 0;
+
+  for (i=0, total=0; i<n; i++) { total += weights[i]; counts[i]= 0; }
+  for (trial=0; trial<ntrials; trial++) {
+    for (i=0; i<n; i++) { objs[i].weight= weights[i]; objs[i].ix= i; }
+    adns__wshuffle(objs,n,sizeof(*objs),tempbuf,getweight,xsubi);
+    counts[objs[0].ix]++;
+  }
+  for (i=0; i<n; i++) {
+    expected= (double)ntrials * (weights[i] + !i) / (total + 1);
+    if (!expected) {
+      if (counts[i]) {
+	fprintf(stderr,"wshuffle: zero-weight object %d chosen first\n",i);
+	return 1;
+      }
+      continue;
+    }
+    diff= counts[i] - expected;
+    chisq += diff*diff / expected;
+    df++;
+  }
+  df--;
+  /* 7 degrees of freedom; the 0.001 critical value is 24.32 */
+  if (df != 7 || chisq > 24.32) {
+    fprintf(stderr,"wshuffle: chi-squared %g with %d d.f. is too large\n",
+	    chisq,df);
+    return 1;
+  }
+  printf("distribution: chi-squared %.2f with %d d.f.\n",chisq,df);
+  return 0;
+}
+
+static double elapsed(clock_t start) {
+  return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void benchmark(void) {
+  static const int sizes[]= { 4, 16, 64, 256, 1024, 4096 };
+  unsigned short gen[3]= { 4, 5, 6 }, xsubi[3]= { 7, 8, 9 };
+  struct obj *orig, *work;
+  void *tempbuf;
+  int si, n, reps, r;
+  clock_t start;
+  double told, tnew;
+
+  for (si=0; si<sizeof(sizes)/sizeof(*sizes); si++) {
+    n= sizes[si];
+    reps= 4000000 / n / (n < 256 ? 1 : n/256);
+    orig= xmalloc(sizeof(*orig)*n);
+    work= xmalloc(sizeof(*work)*n);
+    tempbuf= xmalloc(SORT_TEMPSZ(n,sizeof(*work)));
+    setup(orig,n,100,gen);
+
+    start= clock();
+    for (r=0; r<reps; r++) {
+      memcpy(work,orig,sizeof(*work)*n);
+      oldshuffle(work,n,xsubi);
+    }
+    told= elapsed(start);
+
+    start= clock();
+    for (r=0; r<reps; r++) {
+      memcpy(work,orig,sizeof(*work)*n);
+      adns__wshuffle(work,n,sizeof(*work),tempbuf,getweight,xsubi);
+    }
+    tnew= elapsed(start);
+
+    printf("n=%5d reps=%7d  old %8.3fus  new %8.3fus  per group\n",
+	   n, reps, told*1e6/reps, tnew*1e6/reps);
+    free(orig); free(work); free(tempbuf);
+  }
+}
+
+int main(int argc, const char *const *argv) {
+  int fails;
+
+  fails= test_same();
+  if (!fails) printf("ordering: identical to linear-scan selection\n");
+  fails += test_distribution();
+  if (argc > 1 && !strcmp(argv[1],"-b")) benchmark();
+  if (fails) { fprintf(stderr,"wshuffle: FAILED\n"); exit(1); }
+  return 0;
+}
@@ -105,6 +105,7 @@ typedef enum { /* In general, or together the desired flags: */
  adns_if_nosigpipe=   0x0040,/* applic has SIGPIPE ignored, do not protect */
  adns_if_checkc_entex=0x0100,/* consistency checks on entry/exit to adns fns */
  adns_if_checkc_freq= 0x0300,/* consistency checks very frequently (slow!) */
+ adns_if_trace=       0x1000,/* log a structured trace of every query */
 
  adns_if_permit_ipv4= 0x0400,/* allow _addr queries to return IPv4 addresses  */
  adns_if_permit_ipv6= 0x0800,/* allow _addr queries to return IPv6 addresses */
@@ -145,6 +146,24 @@ typedef enum { /* In general, or together the desired flags: */
  adns_qf_addrlit_scope_numeric=0x00004000,/* %<scope> may only be numeric */
  adns_qf_addrlit_ipv4_quadonly=0x00008000,/* reject non-dotted-quad ipv4 */
 
+ adns_qf_addr_early=	 0x00020000,/* complete addr lookups early: see below */
+   /* Normally an address lookup which wants several address families
+    * waits until all of them have been answered.  With this flag, once
+    * one family has yielded some addresses the others are given only a
+    * short grace period (the `adns_addrgrace:' configuration option,
+    * default 50ms); if that expires the answer is returned with just
+    * the addresses found so far, and with answer->partial set.
+    * Intended for callers which race connections to the addresses.
+    */
+ adns_qf_search_parallel=0x00040000,/* with _qf_search, try all names at once */
+   /* The candidate names from the searchlist (and the bare name) are
+    * all queried at once instead of one after another.  The answer is
+    * the same as a serial search would give - the first name in search
+    * order which does not yield NXDOMAIN - but costs one round trip
+    * instead of one per searchlist entry, at the expense of extra
+    * queries.  Has no effect without adns_qf_search.
+    */
+
  adns__qf_internalmask=  0x0ff00000,
  adns__qf_sizeforce=     0x7fffffff
 } adns_queryflags;
@@ -440,6 +459,7 @@ typedef struct {
     adns_rr_srvha *srvha;/* srv */
     adns_rr_byteblock *byteblock;    /* ...|unknown */
   } rrs;
+  int partial; /* adns_qf_addr_early gave up on some address families */
 } adns_answer;
 
 /* Memory management:
@@ -500,7 +520,24 @@ typedef void adns_logcallbackfn(adns_state ads, void *logfndata,
    * message is complete, the string implied by fmt and al will end in
    * a newline.  Log messages start with `adns debug:' or `adns
    * warning:' or `adns:' (for errors), or `adns debug [PID]:'
-   * etc. if adns_if_logpid is set. */
+   * etc. if adns_if_logpid is set.
+   *
+   * With adns_if_trace, the log function is also passed batches of
+   * trace events, each a line containing one JSON object (starting
+   * with `{').  Every event has "t" (the time, in seconds), "ev" and
+   * "q" (a number identifying the query, 0 if none).  The events are:
+   *   submit  "name", "type", "flags"    query submitted by application
+   *   child   "parent", "type"           query made by adns itself
+   *   send    "id", "serv", "tcp"        query sent to server index serv
+   *   retry   "id", "serv", "tcp"        query sent again
+   *   reply   "id", "serv", "rcode", "len"  reply received
+   *   cname   "name"                     query followed a CNAME
+   *   done    "status", "nrrs"           answer complete
+   * Events are buffered, and logged when a few kilobytes have
+   * accumulated, and by adns_finish.  Other log messages are not
+   * delayed, so they may appear before trace events which precede
+   * them.  Times in done events are the last time adns knew, which
+   * may be slightly early. */
 
 int adns_init_logfn(adns_state *newstate_r, adns_initflags flags,
 		    const char *configtext /*0=>use default config files*/,
@@ -539,9 +576,10 @@ int adns_init_logfn(adns_state *newstate_r, adns_initflags flags,
  *  sortlist <addr>/<mask> ...
  *   Should be followed by a sequence of IP-address and netmask pairs,
  *   separated by spaces.  They may be specified as
- *   eg. 172.30.206.0/24 or 172.30.206.0/255.255.255.0.  Currently up
- *   to 15 pairs may be specified (but note that libresolv only
- *   supports up to 10).
+ *   eg. 172.30.206.0/24 or 172.30.206.0/255.255.255.0.  Addresses
+ *   are ordered by the first pair that they match.  There is no limit
+ *   on the number of pairs (but note that libresolv only supports up
+ *   to 10).
  *
  *  options
  *   Should followed by one or more options, separated by spaces.
@@ -590,6 +628,23 @@ int adns_init_logfn(adns_state *newstate_r, adns_initflags flags,
  *   control the relative order of addresses in answers.  This option
  *   overrides the corresponding init flags (covered by adns_if_afmask).
  *
+ *  adns_addrgrace:<milliseconds>
+ *   How long an address lookup with adns_qf_addr_early waits for the
+ *   remaining address families once it has some addresses.  The
+ *   default is 50.
+ *
+ *  adns_nsport:<port>
+ *   Talk to the nameservers on this UDP and TCP port rather than 53.
+ *   This applies to all the nameservers, wherever they are listed.
+ *   It is mostly useful for testing.
+ *
+ *  adns_negmemo:<entries>
+ *   How many names recently found not to exist (by queries with
+ *   adns_qf_search) adns remembers, so that later searches can skip
+ *   those candidates without asking the nameserver again.  Names are
+ *   remembered for as long as the negative answer may be cached
+ *   according to its SOA record.  The default is 32; 0 disables it.
+ *
  *  adns_ignoreunkcfg
  *   Ignore unknown options and configuration directives, rather than
  *   logging them.  To be effective, appear in the configuration
@@ -642,6 +697,31 @@ int adns_submit(adns_state ads,
 
 /* The owner should be quoted in master file format. */
 
+typedef struct {
+  const char *owner;
+  adns_rrtype type;
+  adns_queryflags flags;
+  void *context;
+} adns_submission;
+
+int adns_submit_many(adns_state ads,
+		     int n, const adns_submission *subs,
+		     adns_query *queries_r /* n entries, always filled in */,
+		     int *errors_r /* n entries, or 0 */);
+/* Submits n queries in one go, as if adns_submit were called for each
+ * of subs[0..n-1] in turn, but reading the clock only once and doing
+ * the processing (if any) that _submit would do on the way out only
+ * once, after all the queries have been submitted.  This is cheaper
+ * for programs which submit many queries at a time.
+ *
+ * queries_r[i] is set to the query handle for subs[i], or to 0 if it
+ * could not be submitted; in that case errors_r[i] (if errors_r is
+ * not 0) is set to the errno value _submit would have returned, and
+ * to 0 otherwise.  The return value is 0 if all of the queries were
+ * submitted, or the first of the errors.  Queries which were
+ * submitted remain outstanding even if others failed.
+ */
+
 int adns_check(adns_state ads,
 	       adns_query *query_io,
 	       adns_answer **answer_r,
@@ -658,6 +738,32 @@ int adns_wait_poll(adns_state ads,
 		   adns_answer **answer_r,
 		   void **context_r);
 
+typedef struct {
+  adns_query query;
+  adns_answer *answer;
+  void *context;
+} adns_completed;
+
+int adns_check_many(adns_state ads,
+		    adns_completed *results, int nmax, int *nresults_r);
+int adns_wait_many(adns_state ads,
+		   adns_completed *results, int nmax, int *nresults_r);
+/* Like adns_check and adns_wait with *query_io == 0, but collect up
+ * to nmax (which must be at least 1) answers in one call, storing
+ * each answer, its query handle and context in results[0..*nresults_r-1].
+ * The answers are in the order adns_check would have returned them.
+ *
+ * Both return 0 if at least one answer was collected.  Otherwise
+ * *nresults_r is set to 0 and they return ESRCH if there are no
+ * outstanding queries; _check_many returns EAGAIN if there are, and
+ * _wait_many blocks until at least one answer is available (or
+ * returns EINTR, if you set adns_if_eintr).
+ *
+ * This is cheaper than calling adns_check repeatedly, since the
+ * consistency checks and automatic event processing happen once per
+ * call rather than once per answer.
+ */
+
 void adns_cancel(adns_query query);
 
 /* The adns_query you get back from _submit is valid (ie, can be
@@ -695,6 +801,46 @@ int adns_submit_reverse_any(adns_state ads,
  * addr->sa_family must be AF_INET or you get ENOSYS.
  */
 
+typedef void adns_completioncallbackfn(adns_state ads, void *completionfndata,
+				       adns_query query, adns_answer *answer,
+				       void *context);
+
+void adns_set_completionfn(adns_state ads,
+			   adns_completioncallbackfn *completionfn /*0=>none*/,
+			   void *completionfndata);
+/* Arranges for answers to be delivered by calling completionfn,
+ * instead of being collected with adns_check or adns_wait.  Each
+ * query which completes is passed to completionfn exactly once, along
+ * with its answer (which the callback must free) and the context
+ * supplied to _submit.  The query is finished with when the callback
+ * is made: the handle must not be passed to any adns function, and is
+ * provided only so that it can be compared with handles saved by the
+ * caller.
+ *
+ * Callbacks are made just before adns returns from whichever call
+ * caused the query to complete; that may be any adns function which
+ * processes events, including adns_submit itself (so the callback may
+ * happen before _submit returns the query handle) and the function
+ * which sets the callback (which delivers any answers already
+ * waiting).
+ *
+ * The callback may call adns_submit, adns_submit_reverse*,
+ * adns_cancel, adns_check and adns_set_completionfn; answers for
+ * queries which complete during such calls are delivered after the
+ * callback returns, rather than recursively.  It must not call
+ * adns_finish, adns_wait, adns_wait_poll or adns_synchronous.  If it
+ * sets the completion function to 0, any remaining answers are left
+ * for adns_check and adns_wait.
+ *
+ * While a completion function is set, adns_check and adns_wait should
+ * be called with *query_io == 0; they are still useful for driving
+ * adns but never return answers themselves (they give EAGAIN while
+ * anything is outstanding or waiting to be delivered, and ESRCH once
+ * nothing is), and likewise adns_check_many and adns_wait_many.
+ * adns_synchronous is unaffected: its own answer is always returned
+ * directly.
+ */
+
 void adns_finish(adns_state ads);
 /* You may call this even if you have queries outstanding;
  * they will be cancelled.
@@ -773,6 +919,54 @@ adns_query adns_forallqueries_next(adns_state ads, void **context_r);
  * context_r may be 0.  *context_r may not be set when _next returns 0.
  */
 
+#define ADNS_STATS_MAXSERVERS 5
+#define ADNS_STATS_NBUCKETS 16
+
+typedef struct {
+  unsigned long submitted, childqueries;
+  unsigned long udpsent, udpretries, timeouts;
+  unsigned long tcpfallbacks, tcpconnects, tcpbreaks;
+  unsigned long unknownserver;
+  unsigned long rcodes[16];
+  unsigned long queries, memory;
+  int nservers;
+  struct {
+    adns_rr_addr addr;
+    unsigned long replies;
+    unsigned long latency[ADNS_STATS_NBUCKETS];
+  } servers[ADNS_STATS_MAXSERVERS];
+} adns_stats;
+
+void adns_getstats(adns_state ads, adns_stats *stats_r);
+/* Fills in *stats_r with a snapshot of what the resolver has been
+ * doing since adns_init.  The counters are:
+ *
+ *  submitted      queries submitted by the application
+ *  childqueries   queries made by adns itself, eg for the addresses
+ *                 of mail exchangers
+ *  udpsent        datagrams sent
+ *  udpretries     of those, retransmissions of a query
+ *  timeouts       queries which failed with adns_s_timeout
+ *  tcpfallbacks   queries retried over TCP because of a truncated reply
+ *  tcpconnects    TCP connections established
+ *  tcpbreaks      TCP connections (or attempts) which failed
+ *  unknownserver  datagrams ignored because they came from an address
+ *                 which is not one of our nameservers
+ *  rcodes[]       replies received, indexed by RCODE
+ *
+ * queries and memory are not counters: they are the number of
+ * outstanding queries (including internal ones and answers not yet
+ * collected) and roughly how many bytes of memory adns is using for
+ * them and for its buffers.
+ *
+ * servers[] has an entry for each of the first nservers nameservers,
+ * giving the number of replies from it that answered a query, and a
+ * histogram of how long those replies took: latency[0] counts
+ * replies within 1ms, latency[i] those taking at least 2^(i-1)ms but
+ * less than 2^i ms, and the last bucket everything slower.  Latency
+ * is measured from the most recent transmission of the query.
+ */
+
 void adns_checkconsistency(adns_state ads, adns_query qu);
 /* Checks the consistency of adns's internal data structures.
  * If any error is found, the program will abort().
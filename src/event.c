@@ -55,6 +55,7 @@ void adns__tcp_broken(adns_state ads, const char *what, const char *why) {
   assert(ads->tcpstate == server_connecting || ads->tcpstate == server_ok);
   serv= ads->tcpserver;
   if (what) adns__warn(ads,serv,0,"TCP connection failed: %s: %s",what,why);
+  ads->stats.tcpbreaks++;
 
   if (ads->tcpstate == server_connecting) {
     /* Counts as a retry for all the queries waiting for TCP. */
@@ -64,6 +65,7 @@ void adns__tcp_broken(adns_state ads, const char *what, const char *why) {
 
   tcp_close(ads);
   ads->tcpstate= server_broken;
+  TRACE_TCPSTATE_NOTIME(ads);
   ads->tcpserver= (serv+1)%ads->nservers;
 }
 
@@ -72,6 +74,8 @@ static void tcp_connected(adns_state ads, struct timeval now) {
   
   adns__debug(ads,ads->tcpserver,0,"TCP connected");
   ads->tcpstate= server_ok;
+  TRACE_TCPSTATE(ads,now);
+  ads->stats.tcpconnects++;
   for (qu= ads->tcpw.head; qu && ads->tcpstate == server_ok; qu= nqu) {
     nqu= qu->next;
     assert(qu->state == query_tcpw);
@@ -92,6 +96,7 @@ static void tcp_broken_events(adns_state ads) {
     }
   }
   ads->tcpstate= server_disconnected;
+  TRACE_TCPSTATE_NOTIME(ads);
 }
 
 void adns__tcp_tryconnect(adns_state ads, struct timeval now) {
@@ -136,6 +141,7 @@ void adns__tcp_tryconnect(adns_state ads, struct timeval now) {
     r= connect(fd,&addr->addr.sa,addr->len);
     ads->tcpsocket= fd;
     ads->tcpstate= server_connecting;
+    TRACE_TCPSTATE(ads,now);
     if (r==0) { tcp_connected(ads,now); return; }
     if (errno == EWOULDBLOCK || errno == EINPROGRESS) {
       ads->tcptimeout= now;
@@ -218,6 +224,7 @@ static void timeouts_queue(adns_state ads, int act,
       if (!act) { inter_immed(tv_io,tvbuf); return; }
       LIST_UNLINK(*queue,qu);
       if (qu->state != query_tosend) {
+	ads->stats.timeouts++;
 	adns__query_fail(qu,adns_s_timeout);
       } else {
 	adns__query_send(qu,now);
@@ -227,6 +234,29 @@ static void timeouts_queue(adns_state ads, int act,
   }
 }
 
+static void timeouts_childw(adns_state ads, int act,
+			    struct timeval **tv_io, struct timeval *tvbuf,
+			    struct timeval now) {
+  /* Only addr queries with adns_qf_addr_early have a deadline while
+   * waiting for their children; when it passes we abandon the
+   * outstanding address families and complete with what we have. */
+  adns_query qu, nqu;
+
+  for (qu= ads->childw.head; qu; qu= nqu) {
+    nqu= qu->next;
+    if (!(qu->flags & adns__qf_addr_grace)) continue;
+    if (!timercmp(&now,&qu->timeout,>)) {
+      inter_maxtoabs(tv_io,tvbuf,now,qu->timeout);
+    } else {
+      if (!act) { inter_immed(tv_io,tvbuf); return; }
+      LIST_UNLINK(ads->childw,qu);
+      qu->answer->partial= 1;
+      adns__query_done(qu);
+      nqu= ads->childw.head;
+    }
+  }
+}
+
 static void tcp_events(adns_state ads, int act,
 		       struct timeval **tv_io, struct timeval *tvbuf,
 		       struct timeval now) {
@@ -260,6 +290,7 @@ static void tcp_events(adns_state ads, int act,
 	case server_ok: /* idle timeout */
 	  tcp_close(ads);
 	  ads->tcpstate= server_disconnected;
+	  TRACE_TCPSTATE(ads,now);
 	  return;
 	default:
 	  abort();
@@ -278,6 +309,7 @@ void adns__timeouts(adns_state ads, int act,
 		    struct timeval now) {
   timeouts_queue(ads,act,tv_io,tvbuf,now, &ads->udpw);
   timeouts_queue(ads,act,tv_io,tvbuf,now, &ads->tcpw);
+  timeouts_childw(ads,act,tv_io,tvbuf,now);
   tcp_events(ads,act,tv_io,tvbuf,now);
 }
 
@@ -416,6 +448,7 @@ int adns_processreadable(adns_state ads, int fd, const struct timeval *now) {
 				    &ads->servers[serv].addr.sa);
 	   serv++);
       if (serv >= ads->nservers) {
+	ads->stats.unknownserver++;
 	adns__warn(ads,-1,0,"datagram received from unknown nameserver %s",
 		   adns__sockaddr_ntoa(&udpaddr.sa, addrbuf));
 	continue;
@@ -681,9 +714,11 @@ int adns__internal_check(adns_state ads,
 
   qu= *query_io;
   if (!qu) {
-    if (ads->output.head) {
+    if (ads->output.head && !ads->completionfn) {
       qu= ads->output.head;
-    } else if (ads->udpw.head || ads->tcpw.head) {
+    } else if (ads->udpw.head || ads->tcpw.head || ads->output.head) {
+      /* With a completion function set, answers are only ever handed
+       * to it - even if we are being called from inside it. */
       return EAGAIN;
     } else {
       return ESRCH;
@@ -699,17 +734,44 @@ int adns__internal_check(adns_state ads,
   return 0;
 }
 
-int adns_wait(adns_state ads,
-	      adns_query *query_io,
-	      adns_answer **answer_r,
-	      void **context_r) {
+static int internal_check_many(adns_state ads,
+			       adns_completed *results, int nmax,
+			       int *nresults_r) {
+  adns_query qu;
+  int n;
+
+  if (!ads->output.head || ads->completionfn) {
+    /* See adns__internal_check. */
+    *nresults_r= 0;
+    return (ads->udpw.head || ads->tcpw.head || ads->output.head)
+      ? EAGAIN : ESRCH;
+  }
+  for (n=0; n<nmax && (qu= ads->output.head); n++) {
+    LIST_UNLINK(ads->output,qu);
+    results[n].query= qu;
+    results[n].answer= qu->answer;
+    results[n].context= qu->ctx.ext;
+    free(qu);
+  }
+  *nresults_r= n;
+  return 0;
+}
+
+static int internal_wait(adns_state ads,
+			 adns_query *query_io, adns_answer **answer_r,
+			 void **context_r,
+			 adns_completed *results, int nmax, int *nresults_r) {
+  /* The select loop shared by adns_wait and adns_wait_many; results
+   * is 0 for adns_wait, and the other arguments are passed to the
+   * corresponding internal check. */
   int r, maxfd, rsel;
   fd_set readfds, writefds, exceptfds;
   struct timeval tvbuf, *tvp;
-  
-  adns__consistency(ads,*query_io,cc_entex);
+
   for (;;) {
-    r= adns__internal_check(ads,query_io,answer_r,context_r);
+    r= results
+      ? internal_check_many(ads,results,nmax,nresults_r)
+      : adns__internal_check(ads,query_io,answer_r,context_r);
     if (r != EAGAIN) break;
     maxfd= 0; tvp= 0;
     FD_ZERO(&readfds); FD_ZERO(&writefds); FD_ZERO(&exceptfds);
@@ -728,6 +790,17 @@ int adns_wait(adns_state ads,
       adns_afterselect(ads,maxfd,&readfds,&writefds,&exceptfds,0);
     }
   }
+  return r;
+}
+
+int adns_wait(adns_state ads,
+	      adns_query *query_io,
+	      adns_answer **answer_r,
+	      void **context_r) {
+  int r;
+  
+  adns__consistency(ads,*query_io,cc_entex);
+  r= internal_wait(ads,query_io,answer_r,context_r,0,0,0);
   adns__returning(ads,0);
   return r;
 }
@@ -747,3 +820,29 @@ int adns_check(adns_state ads,
   adns__returning(ads,0);
   return r;
 }
+
+int adns_wait_many(adns_state ads,
+		   adns_completed *results, int nmax, int *nresults_r) {
+  int r;
+  
+  adns__consistency(ads,0,cc_entex);
+  assert(nmax > 0);
+  r= internal_wait(ads,0,0,0,results,nmax,nresults_r);
+  adns__returning(ads,0);
+  return r;
+}
+
+int adns_check_many(adns_state ads,
+		    adns_completed *results, int nmax, int *nresults_r) {
+  struct timeval now;
+  int r;
+  
+  adns__consistency(ads,0,cc_entex);
+  assert(nmax > 0);
+  r= gettimeofday(&now,0);
+  if (!r) adns__autosys(ads,now);
+
+  r= internal_check_many(ads,results,nmax,nresults_r);
+  adns__returning(ads,0);
+  return r;
+}
@@ -120,6 +120,68 @@ void adns__diag(adns_state ads, int serv, adns_query qu,
   va_end(al);
 }
 
+/* Structured trace */
+
+static int trace_appendjson(vbuf *vb, const char *str) {
+  /* Appends str as a JSON string.  Returns 0 if there was no memory. */
+  char buf[8];
+  const char *p;
+  int ch, l;
+
+  if (!adns__vbuf_append(vb,"\"",1)) return 0;
+  for (p= str; (ch= (unsigned char)*p); p++) {
+    if (ch == '"' || ch == '\\') {
+      buf[0]= '\\'; buf[1]= ch; l= 2;
+    } else if (ch < 0x20 || ch >= 0x7f) {
+      l= sprintf(buf,"\\u%04x",ch);
+    } else {
+      buf[0]= ch; l= 1;
+    }
+    if (!adns__vbuf_append(vb,buf,l)) return 0;
+  }
+  return adns__vbuf_append(vb,"\"",1);
+}
+
+void adns__trace(adns_state ads, adns_query qu, const char *event,
+		 const struct timeval *now, const char *name,
+		 const char *fmt, ...) {
+  va_list al;
+  vbuf *vb= &ads->tracevb;
+  char head[100], tail[200];
+  int oldused;
+
+  if (!(ads->iflags & adns_if_trace)) return;
+  if (now) ads->tracetime= *now;
+
+  snprintf(head,sizeof(head),"{\"t\":%ld.%06ld,\"ev\":\"%s\",\"q\":%lu",
+	   (long)ads->tracetime.tv_sec,(long)ads->tracetime.tv_usec,
+	   event, qu ? qu->serial : 0UL);
+  va_start(al,fmt);
+  vsnprintf(tail,sizeof(tail),fmt,al);
+  va_end(al);
+
+  oldused= vb->used;
+  if (!(adns__vbuf_appendstr(vb,head) &&
+	(!name ||
+	 (adns__vbuf_appendstr(vb,",\"name\":") &&
+	  trace_appendjson(vb,name))) &&
+	adns__vbuf_appendstr(vb,tail) &&
+	adns__vbuf_append(vb,"}\n",2))) {
+    /* Don't leave half an event behind. */
+    vb->used= oldused;
+    return;
+  }
+
+  if (vb->used >= TRACEBATCH) adns__trace_flush(ads);
+}
+
+void adns__trace_flush(adns_state ads) {
+  if (!ads->tracevb.used) return;
+  if (ads->logfn)
+    adns__lprintf(ads,"%.*s",ads->tracevb.used,ads->tracevb.buf);
+  ads->tracevb.used= 0;
+}
+
 /* vbuf functions */
 
 void adns__vbuf_init(vbuf *vb) {
@@ -336,20 +398,130 @@ const char *adns_errtypeabbrev(adns_status st) {
 }
 
 
-void adns__isort(void *array, int nobjs, int sz, void *tempbuf,
-		 int (*needswap)(void *context, const void *a, const void *b),
-		 void *context) {
-  byte *data= array;
-  int i, place;
-
-  for (i=0; i<nobjs; i++) {
-    for (place= i;
-	 place>0 && needswap(context, data + (place-1)*sz, data + i*sz);
-	 place--);
-    if (place != i) {
-      memcpy(tempbuf, data + i*sz, sz);
-      memmove(data + (place+1)*sz, data + place*sz, (i-place)*sz);
-      memcpy(data + place*sz, tempbuf, sz);
+struct sortrec { int key, ix; };
+
+#define WSHUFFLE_LINEARMAX 128
+
+void adns__sort(void *array, int nobjs, int sz, void *tempbuf,
+		int (*sortkey)(void *context, const void *obj),
+		void *context) {
+  /* We sort (key,index) records rather than the objects themselves,
+   * with a bottom-up merge sort, and then permute the objects into
+   * place in a single pass via tempbuf. */
+  byte *data= array, *objs;
+  struct sortrec *from, *to, *t;
+  int i, j, k, lo, mid, hi, width, sorted;
+
+  assert(sizeof(struct sortrec) == 2*sizeof(int));
+  from= tempbuf;
+  to= from + nobjs;
+  objs= (byte*)(to + nobjs);
+
+  for (i=0, sorted=1; i<nobjs; i++) {
+    from[i].key= sortkey(context, data + i*sz);
+    from[i].ix= i;
+    if (i && from[i].key < from[i-1].key) sorted= 0;
+  }
+  if (sorted) return;
+
+  for (width=1; width<nobjs; width*=2) {
+    for (lo=0; lo<nobjs; lo=hi) {
+      mid= lo+width;  if (mid>nobjs) mid= nobjs;
+      hi= mid+width;  if (hi>nobjs) hi= nobjs;
+      for (i=lo, j=mid, k=lo; k<hi; k++)
+	to[k]= (j>=hi || (i<mid && from[i].key <= from[j].key))
+	  ? from[i++] : from[j++];
+    }
+    t= from; from= to; to= t;
+  }
+
+  for (i=0; i<nobjs; i++)
+    memcpy(objs + i*sz, data + from[i].ix*sz, sz);
+  memcpy(data, objs, (size_t)nobjs*sz);
+}
+
+void adns__wshuffle(void *array, int nobjs, int sz, void *tempbuf,
+		    int (*getweight)(const void *obj),
+		    unsigned short xsubi[3]) {
+  /* We keep the weights of the not-yet-placed objects in a Fenwick
+   * tree indexed by position, so that each selection costs O(log n)
+   * rather than a linear scan.  The draw and the object selected are
+   * exactly those of the straightforward algorithm: the first object
+   * whose running total of weights reaches randval, or the first
+   * remaining object if randval is zero.  Small arrays (the usual
+   * case) are quicker with the plain linear scan, so we use that for
+   * them; the two give identical results. */
+  byte *data= array, *objtmp, *cur, *sel;
+  int *tree= tempbuf;
+  int i, j, pos, step, topstep, rem, totalweight, runtotal, wcur, wsel;
+  long randval;
+
+  objtmp= (byte*)(tree + nobjs + 1);
+
+  if (nobjs <= WSHUFFLE_LINEARMAX) {
+    for (i=0, totalweight=0; i<nobjs; i++)
+      totalweight += (tree[i]= getweight(data + i*sz));
+    for (i=0; i+1 < nobjs; i++) {
+      randval= nrand48(xsubi);
+      randval %= (totalweight + 1);
+      for (pos=i, runtotal=0; (runtotal += tree[pos]) < randval; pos++);
+      assert(pos < nobjs);
+      totalweight -= tree[pos];
+      if (pos != i) {
+	wsel= tree[pos]; tree[pos]= tree[i]; tree[i]= wsel;
+	memcpy(objtmp, data + i*sz, sz);
+	memcpy(data + i*sz, data + pos*sz, sz);
+	memcpy(data + pos*sz, objtmp, sz);
+      }
+    }
+    return;
+  }
+
+  for (i=1; i<=nobjs; i++) tree[i]= 0;
+  for (i=1, totalweight=0; i<=nobjs; i++) {
+    wcur= getweight(data + (i-1)*sz);
+    totalweight += wcur;
+    tree[i] += wcur;
+    j= i + (i & -i);
+    if (j <= nobjs) tree[j] += tree[i];
+  }
+  for (topstep=1; topstep*2 <= nobjs; topstep*=2);
+
+  for (i=0; i+1 < nobjs; i++) { /* don't bother if just one */
+    cur= data + i*sz;
+    randval= nrand48(xsubi);
+    randval %= (totalweight + 1);
+      /* makes it into 0..totalweight inclusive; with 2^10 objects,
+       * totalweight must be <= 2^26 so probability nonuniformity is
+       * no worse than 1 in 2^(31-26) ie 1 in 2^5, ie
+       *  abs(log(P_intended(obj_i) / P_actual(obj_i)) <= log(2^-5).
+       */
+    if (randval) {
+      for (pos=0, rem=randval, step=topstep; step; step/=2) {
+	if (pos+step <= nobjs && tree[pos+step] < rem) {
+	  pos += step;
+	  rem -= tree[pos];
+	}
+      }
+      assert(pos < nobjs);
+      /* pos is now the 0-based position of the selected object */
+    } else {
+      pos= i;
+    }
+    assert(pos >= i);
+
+    wcur= getweight(cur);
+    sel= data + pos*sz;
+    wsel= getweight(sel);
+    totalweight -= wsel;
+    /* position i now holds nothing unplaced; position pos gets
+     * whatever was at i */
+    for (j=i+1; j<=nobjs; j += j & -j) tree[j] -= wcur;
+    if (pos != i) {
+      for (j=pos+1; j<=nobjs; j += j & -j) tree[j] += wcur - wsel;
+      memcpy(objtmp, cur, sz);
+      memcpy(cur, sel, sz);
+      memcpy(sel, objtmp, sz);
     }
   }
 }
@@ -51,15 +51,21 @@ typedef unsigned char byte;
 # include "hredirect.h"
 #endif
 
+#ifdef HAVE_USDT
+# include <sys/sdt.h>
+#endif
+
 /* Configuration and constants */
 
 #define MAXSERVERS 5
-#define MAXSORTLIST 15
 #define UDPMAXRETRIES 15
 #define UDPRETRYMS 2000
 #define TCPWAITMS 30000
 #define TCPCONNMS 14000
 #define TCPIDLEMS 30000
+#define ADDRGRACEMS 50 /* default for adns_qf_addr_early */
+#define NEGMEMOSZ 32 /* default size of the negative search memo */
+#define TRACEBATCH 4096 /* adns_if_trace output is flushed in this size */
 #define MAXTTLBELIEVE (7*86400) /* any TTL > 7 days is capped */
 
 #define DNS_PORT 53
@@ -110,7 +116,9 @@ typedef enum {
 
 enum {
   adns__qf_addr_answer= 0x01000000,/* addr query received an answer */
-  adns__qf_addr_cname = 0x02000000 /* addr subquery performed on cname */
+  adns__qf_addr_cname = 0x02000000,/* addr subquery performed on cname */
+  adns__qf_addr_grace = 0x04000000 /* addr query has early-completion
+				    * deadline in qu->timeout */
 };
 
 /* Shared data structures */
@@ -120,6 +128,22 @@ typedef struct {
   byte *buf;
 } vbuf;
 
+struct glue_rr {
+  unsigned hash; /* of the owner name, case-folded */
+  int owner, type, rdstart, rdlen;
+  unsigned long ttl;
+};
+
+struct glueindex {
+  int built, n, nns;
+  struct glue_rr *rrs;
+};
+/* Index of the A and AAAA records in the authority and additional
+ * sections of a datagram, built on demand (in ads->gluevb) the first
+ * time a parse hook needs to look up glue.  rrs[0..nns-1] are from the
+ * authority section and rrs[nns..n-1] from the additional section.
+ */
+
 typedef struct {
   adns_state ads;
   adns_query qu;
@@ -127,6 +151,7 @@ typedef struct {
   const byte *dgram;
   int dglen, nsstart, nscount, arcount;
   struct timeval now;
+  struct glueindex *glue;
 } parseinfo;
 
 #define MAXREVLABELS 34		/* keep in sync with addrfam! */
@@ -155,7 +180,12 @@ typedef struct {
 	    * don't know better. */
 
   union {
-    adns_rr_hostaddr *hostaddr;
+    struct {
+      adns_rr_hostaddr *rrp;
+      adns_rr_hostaddr **dups; /* other RRs naming the same host, which */
+      int ndups, adups;        /*  get copies of rrp's result (alloc_mine) */
+    } hostaddr;
+    int searchix;
   } pinfo; /* state for use by parent's callback function */
 } qcontext;
 
@@ -189,9 +219,11 @@ typedef struct typeinfo {
    * nsstart is the offset of the authority section.
    */
 
-  int (*diff_needswap)(adns_state ads,const void *datap_a,const void *datap_b);
-  /* Returns !0 if RR a should be strictly after RR b in the sort order,
-   * 0 otherwise.  Must not fail.
+  int (*sortkey)(adns_state ads, const void *datap);
+  /* Returns the sort key for an RR.  The RRs in an answer are sorted
+   * stably into ascending order of key.  Called once per RR per sort.
+   * May be 0 to mean the RRs are left in the order they arrived.
+   * Must not fail.
    */
 
   adns_status (*checklabel)(adns_state ads, adns_queryflags flags,
@@ -208,10 +240,12 @@ typedef struct typeinfo {
    */
 
   void (*postsort)(adns_state ads, void *array, int nrrs, int rrsz,
-		   const struct typeinfo *typei);
+		   void *tempbuf, const struct typeinfo *typei);
   /* Called immediately after the RRs have been sorted, and may rearrange
    * them.  (This is really for the benefit of SRV's bizarre weighting
-   * stuff.)  May be 0 to mean nothing needs to be done.
+   * stuff.)  tempbuf is at least SORT_TEMPSZ(nrrs,rrsz) bytes long and
+   * may be used as scratch space.  May be 0 to mean nothing needs to be
+   * done.
    */
 
   int (*getrrsz)(const struct typeinfo *typei, adns_rrtype type);
@@ -284,7 +318,7 @@ struct adns__query {
   /* If non-0, has been allocated using . */
 
   vbuf search_vb;
-  int search_origlen, search_pos, search_doneabs;
+  int search_origlen, search_pos, search_doneabs, search_best;
   /* Used by the searching algorithm.  The query domain in textual form
    * is copied into the vbuf, and _origlen set to its length.  Then
    * we walk the searchlist, if we want to.  _pos says where we are
@@ -292,12 +326,21 @@ struct adns__query {
    * absolute query yet (0=not yet, 1=done, -1=must do straight away,
    * but not done yet).  If flags doesn't have adns_qf_search then
    * the vbuf is initialised but empty and everything else is zero.
+   *
+   * With adns_qf_search_parallel, the candidate names are instead all
+   * submitted at once as child queries, numbered (in ctx.pinfo.searchix)
+   * in the order the serial search would try them.  _best is the number
+   * of the best candidate with a final answer so far, which is held in
+   * our own answer, or -1 if there isn't one yet.
    */
 
   int id, flags, retries;
+  unsigned long serial; /* Identifies the query in adns_if_trace output. */
   int udpnextserver;
   unsigned long udpsent; /* bitmap indexed by server */
   struct timeval timeout;
+  struct timeval senttime; /* Last transmission, for adns_getstats. */
+  int sentid; /* id of the last transmission, to spot retries; or -1 */
   time_t expires; /* Earliest expiry time of any record we used. */
 
   qcontext ctx;
@@ -374,8 +417,24 @@ struct adns__state {
   int nextid, tcpsocket;
   struct udpsocket { int af; int fd; } udpsockets[MAXUDP];
   int nudpsockets;
-  vbuf tcpsend, tcprecv;
+  vbuf tcpsend, tcprecv, gluevb, tracevb;
+  unsigned long nextserial;
+  struct timeval tracetime; /* Last time given to adns__trace. */
   int nservers, nsortlist, nsearchlist, searchndots, tcpserver, tcprecv_skip;
+  int addrgracems, nsport;
+  struct negmemo {
+    unsigned hash;
+    time_t expires;
+    int len;
+    byte *name;
+  } *negmemo;
+  int negmemosz;
+  /* Names recently found not to exist, so that searches can skip
+   * them; name is the query domain in wire format, uppercased.  An
+   * entry with no name is free.  The table is allocated (with
+   * negmemosz entries) when first needed; if negmemosz is 0 there is
+   * no memo.
+   */
   enum adns__tcpstate {
     server_disconnected, server_connecting,
     server_ok, server_broken
@@ -392,12 +451,38 @@ struct adns__state {
   adns_rr_addr servers[MAXSERVERS];
   struct sortlist {
     adns_sockaddr base, mask;
-  } sortlist[MAXSORTLIST];
+  } *sortlist;
+  struct sortlist_node {
+    int child[2]; /* 0 means none */
+    int index; /* lowest sortlist index whose prefix ends here, or more */
+  } *sortlist_nodes;
+  int nsortlist_nodes;
+  /* Binary trie of the sortlist prefixes: nodes 0 and 1 are the roots
+   * for IPv4 and IPv6.  Entries whose masks are not prefixes are
+   * listed (in ascending order) in sortlist_irregular instead.  If
+   * sortlist_nodes is 0, the sortlist must be searched linearly.
+   */
+  int *sortlist_irregular, nsortlist_irregular;
   char **searchlist;
   unsigned config_report_unknown:1;
+  unsigned completing:1;
+  /* Set while adns__returning is delivering answers to completionfn,
+   * so that adns calls made by the callback do not recurse into the
+   * delivery loop.
+   */
+  adns_completioncallbackfn *completionfn;
+  void *completionfndata;
   unsigned short rand48xsubi[3];
+  adns_stats stats;
+  /* Counters for adns_getstats; the servers' addresses, and queries
+   * and memory, are only filled in by adns_getstats itself.
+   */
 };
 
+#if MAXSERVERS > ADNS_STATS_MAXSERVERS
+# error MAXSERVERS too big for adns_stats
+#endif
+
 /* From addrfam.c: */
 
 extern int adns__addrs_equal_raw(const struct sockaddr *a,
@@ -513,6 +598,21 @@ void adns__warn(adns_state ads, int serv, adns_query qu,
 void adns__diag(adns_state ads, int serv, adns_query qu,
 		const char *fmt, ...) PRINTFFORMAT(4,5);
 
+void adns__trace(adns_state ads, adns_query qu, const char *event,
+		 const struct timeval *now, const char *name,
+		 const char *fmt, ...) PRINTFFORMAT(6,7);
+/* If adns_if_trace is set, records a trace event for qu (which may
+ * be 0).  The JSON object starts with the time (now, or if now is 0
+ * the last time we were given), the event name and qu's serial
+ * number.  Then comes name, if not 0, as a "name" string, and then
+ * fmt, which should be empty or start with a comma and give further
+ * members.
+ *
+ * Events are buffered in ads->tracevb and passed to the log function
+ * in batches.  Cannot fail; if there is no memory the event is lost.
+ */
+void adns__trace_flush(adns_state ads);
+
 int adns__vbuf_ensure(vbuf *vb, int want);
 int adns__vbuf_appendstr(vbuf *vb, const char *data); /* doesn't include nul */
 int adns__vbuf_append(vbuf *vb, const byte *data, int len);
@@ -540,13 +640,28 @@ int adns__getrrsz_default(const typeinfo *typei, adns_rrtype type);
  * value from the typeinfo entry.
  */
 
-void adns__isort(void *array, int nobjs, int sz, void *tempbuf,
-		 int (*needswap)(void *context, const void *a, const void *b),
-		 void *context);
-/* Does an insertion sort of array which must contain nobjs objects
- * each sz bytes long.  tempbuf must point to a buffer at least
- * sz bytes long.  needswap should return !0 if a>b (strictly, ie
- * wrong order) 0 if a<=b (ie, order is fine).
+#define SORT_TEMPSZ(nobjs,sz) ((size_t)(nobjs)*((sz) + 4*sizeof(int)))
+
+void adns__sort(void *array, int nobjs, int sz, void *tempbuf,
+		int (*sortkey)(void *context, const void *obj),
+		void *context);
+/* Does a stable sort of array, which must contain nobjs objects each
+ * sz bytes long, into ascending order of sortkey.  sortkey is called
+ * exactly once for each object.  tempbuf must point to a buffer at
+ * least SORT_TEMPSZ(nobjs,sz) bytes long, aligned as for malloc.
+ */
+
+void adns__wshuffle(void *array, int nobjs, int sz, void *tempbuf,
+		    int (*getweight)(const void *obj),
+		    unsigned short xsubi[3]);
+/* Reorders array (nobjs objects each sz bytes long) by repeated
+ * weighted random selection without replacement, as required for
+ * RFC2782 SRV weights: each position in turn is filled by choosing
+ * among the remaining objects with probability proportional to their
+ * weight.  Uses one call to nrand48(xsubi) per position and O(log
+ * nobjs) work per selection.  getweight must return a nonnegative
+ * value and the sum of all the weights must fit in an int.  tempbuf
+ * is as for adns__sort.
  */
 
 void adns__sigpipe_protect(adns_state);
@@ -633,6 +748,20 @@ adns_status adns__internal_submit(adns_state ads, adns_query *query_r,
  * back on the childw queue.
  */
 
+void adns__negmemo_add(adns_state ads, const byte *qd_dgram, int qd_dglen,
+		       unsigned long ttl, struct timeval now);
+int adns__negmemo_find(adns_state ads, const byte *qd_dgram, int qd_dglen,
+		       struct timeval now);
+/* The negative memo records names which are known not to exist (an
+ * NXDOMAIN answer was received for a query with adns_qf_search or
+ * for a parallel search candidate), for ttl seconds.  qd_dgram is a
+ * query datagram for the name, as made by adns__mkquery; only the
+ * name matters, not the type or flags.  _find returns nonzero if
+ * there is an unexpired entry for the name.
+ *
+ * _add cannot fail; if there is no memory the name is not recorded.
+ */
+
 void adns__search_next(adns_state ads, adns_query qu, struct timeval now);
 /* Walks down the searchlist for a query with adns_qf_search.
  * The query should have just had a negative response, or not had
@@ -928,6 +1057,41 @@ static inline int ctype_domainunquoted(int c) {
 
 static inline int errno_resources(int e) { return e==ENOMEM || e==ENOBUFS; }
 
+/* Static tracepoints (configure --enable-usdt), for perf, bpftrace,
+ * SystemTap and the like; the provider is `adns'.
+ *
+ * The query probes are submit, child, send_udp, send_tcp, reply and
+ * done.  Their arguments are the query, its id, its type, the server
+ * (-1 if none), the answer status, and a time (seconds and
+ * microseconds): now, except for done where it is the time the query
+ * was last sent.  child has the parent query as an extra argument.
+ *
+ * The tcp_state probe fires when ads->tcpstate changes; its arguments
+ * are the server, the new state, and the time now (or zero, when a
+ * connection breaks, since then we don't know it).
+ *
+ * Without --enable-usdt they compile to nothing, and their arguments
+ * are not evaluated.
+ */
+#ifdef HAVE_USDT
+#define TRACE_QUERY(probe,qu,serv,tv)				\
+  DTRACE_PROBE7(adns,probe,(qu),(qu)->id,(qu)->answer->type,	\
+		(serv),(qu)->answer->status,(tv).tv_sec,(tv).tv_usec)
+#define TRACE_CHILD(qu,id,parent,tv)				\
+  DTRACE_PROBE8(adns,child,(qu),(id),(qu)->answer->type,-1,	\
+		(qu)->answer->status,(tv).tv_sec,(tv).tv_usec,(parent))
+#define TRACE_TCPSTATE(ads,tv)						\
+  DTRACE_PROBE4(adns,tcp_state,(ads)->tcpserver,(int)(ads)->tcpstate, \
+		(tv).tv_sec,(tv).tv_usec)
+#define TRACE_TCPSTATE_NOTIME(ads)					\
+  DTRACE_PROBE4(adns,tcp_state,(ads)->tcpserver,(int)(ads)->tcpstate,0,0)
+#else
+#define TRACE_QUERY(probe,qu,serv,tv) ((void)0)
+#define TRACE_CHILD(qu,id,parent,tv) ((void)0)
+#define TRACE_TCPSTATE(ads,tv) ((void)0)
+#define TRACE_TCPSTATE_NOTIME(ads) ((void)0)
+#endif
+
 /* Useful macros */
 
 #define MEM_ROUND(sz)						\
@@ -66,13 +66,17 @@ static adns_query query_alloc(adns_state ads,
 
   adns__vbuf_init(&qu->search_vb);
   qu->search_origlen= qu->search_pos= qu->search_doneabs= 0;
+  qu->search_best= -1;
 
   qu->id= -2; /* will be overwritten with real id before we leave adns */
+  qu->serial= ads->nextserial++;
   qu->flags= flags;
   qu->retries= 0;
   qu->udpnextserver= 0;
   qu->udpsent= 0;
   timerclear(&qu->timeout);
+  timerclear(&qu->senttime);
+  qu->sentid= -1;
   qu->expires= now.tv_sec + MAXTTLBELIEVE;
 
   memset(&qu->ctx,0,sizeof(qu->ctx));
@@ -84,6 +88,7 @@ static adns_query query_alloc(adns_state ads,
   qu->answer->nrrs= 0;
   qu->answer->rrs.untyped= 0;
   qu->answer->rrsz= typei->getrrsz(typei,type);
+  qu->answer->partial= 0;
 
   return qu;
 }
@@ -104,6 +109,7 @@ static void query_submit(adns_state ads, adns_query qu,
   qu->id= id;
   qu->query_dglen= qu->vb.used;
   memcpy(qu->query_dgram,qu->vb.buf,qu->vb.used);
+  TRACE_QUERY(submit,qu,-1,now);
 
   typei->query_send(qu,now);
 }
@@ -166,6 +172,10 @@ adns_status adns__internal_submit(adns_state ads, adns_query *query_r,
   qu->parent= parent;
   LIST_LINK_TAIL_PART(parent->children,qu,siblings.);
   memcpy(&qu->ctx,ctx,sizeof(qu->ctx));
+  ads->stats.childqueries++;
+  TRACE_CHILD(qu,id,parent,now);
+  adns__trace(ads,qu,"child",&now,0, ",\"parent\":%lu,\"type\":%u",
+	      parent->serial,(unsigned)type);
   query_submit(ads,qu, typei,qumsg_vb,id,flags,now);
   
   return adns_s_ok;
@@ -198,11 +208,108 @@ static void query_simple(adns_state ads, adns_query qu,
   st= check_domain_name(ads, flags,&qu->ctx,typei, qu->vb.buf,qu->vb.used);
   if (st) { adns__query_fail(qu,st); return; }
 
+  if ((flags & adns_qf_search) &&
+      adns__negmemo_find(ads,qu->vb.buf,qu->vb.used,now)) {
+    adns__debug(ads,-1,qu,"skipping search candidate `%.*s',"
+		" recently found not to exist", ol,owner);
+    adns__search_next(ads,qu,now);
+    return;
+  }
+
   vb_new= qu->vb;
   adns__vbuf_init(&qu->vb);
   query_submit(ads,qu, typei,&vb_new,id, flags,now);
 }
 
+static int negmemo_key(const byte *qd_dgram, int qd_dglen,
+		       const byte **name_r, unsigned *hash_r) {
+  /* Finds the query domain in qd_dgram and hashes it (ignoring case).
+   * Returns its length. */
+  const byte *name;
+  unsigned hash;
+  int len, i, ch;
+
+  name= qd_dgram + DNS_HDRSIZE;
+  len= qd_dglen - DNS_HDRSIZE - 4;
+  assert(len > 0);
+  for (i=0, hash=2166136261U; i<len; i++) {
+    ch= ctype_toupper(name[i]);
+    hash= (hash ^ ch) * 16777619U;
+  }
+  *name_r= name;
+  *hash_r= hash;
+  return len;
+}
+
+static int negmemo_nameeq(const byte *a, const byte *b, int len) {
+  int i;
+
+  for (i=0; i<len; i++)
+    if (ctype_toupper(a[i]) != ctype_toupper(b[i])) return 0;
+  return 1;
+}
+
+int adns__negmemo_find(adns_state ads, const byte *qd_dgram, int qd_dglen,
+		       struct timeval now) {
+  struct negmemo *nm;
+  const byte *name;
+  unsigned hash;
+  int len, i;
+
+  if (!ads->negmemo) return 0;
+  len= negmemo_key(qd_dgram,qd_dglen,&name,&hash);
+  for (i=0, nm=ads->negmemo; i<ads->negmemosz; i++, nm++) {
+    if (!nm->name || nm->hash != hash || nm->len != len) continue;
+    if (!negmemo_nameeq(nm->name,name,len)) continue;
+    if (nm->expires > now.tv_sec) return 1;
+    free(nm->name); nm->name= 0;
+    return 0;
+  }
+  return 0;
+}
+
+void adns__negmemo_add(adns_state ads, const byte *qd_dgram, int qd_dglen,
+		       unsigned long ttl, struct timeval now) {
+  struct negmemo *nm, *victim;
+  const byte *name;
+  byte *copy;
+  unsigned hash;
+  int len, i;
+
+  if (!ads->negmemosz || !ttl) return;
+  if (!ads->negmemo) {
+    ads->negmemo= malloc(sizeof(*ads->negmemo)*ads->negmemosz);
+    if (!ads->negmemo) return;
+    for (i=0; i<ads->negmemosz; i++) ads->negmemo[i].name= 0;
+  }
+  len= negmemo_key(qd_dgram,qd_dglen,&name,&hash);
+
+  /* Reuse the entry for this name if there is one, otherwise a free
+   * or expired entry, otherwise the one which would expire first. */
+  victim= 0;
+  for (i=0, nm=ads->negmemo; i<ads->negmemosz; i++, nm++) {
+    if (nm->name && nm->hash == hash && nm->len == len &&
+	negmemo_nameeq(nm->name,name,len)) {
+      victim= nm;
+      break;
+    }
+    if (victim && (!victim->name || victim->expires <= now.tv_sec)) continue;
+    if (!victim || !nm->name || nm->expires < victim->expires) victim= nm;
+  }
+
+  if (victim->name && victim->len == len) {
+    copy= victim->name;
+  } else {
+    copy= malloc(len);  if (!copy) return;
+    free(victim->name);
+  }
+  for (i=0; i<len; i++) copy[i]= ctype_toupper(name[i]);
+  victim->hash= hash;
+  victim->expires= now.tv_sec + ttl;
+  victim->len= len;
+  victim->name= copy;
+}
+
 void adns__search_next(adns_state ads, adns_query qu, struct timeval now) {
   const char *nextentry;
   adns_status st;
@@ -244,6 +351,165 @@ x_fail:
   adns__query_fail(qu,st);
 }
 
+static int search_candidate(adns_state ads, adns_query qu, int ix) {
+  /* Sets search_vb to the name of parallel search candidate ix, which
+   * is the ix'th name adns__search_next would try.  Returns 1 if OK,
+   * otherwise there was no memory. */
+  const char *entry;
+
+  if (qu->search_doneabs < 0) entry= ix ? ads->searchlist[ix-1] : 0;
+  else entry= ix < ads->nsearchlist ? ads->searchlist[ix] : 0;
+
+  qu->search_vb.used= qu->search_origlen;
+  if (entry) {
+    if (!adns__vbuf_append(&qu->search_vb,".",1) ||
+	!adns__vbuf_appendstr(&qu->search_vb,entry))
+      return 0;
+  }
+  return 1;
+}
+
+static void search_unstash(adns_query qu) {
+  /* Discards the answer of the best parallel search candidate so far.
+   * A searching query allocates nothing of its own before it finishes,
+   * so everything on its allocations list belongs to that answer. */
+  allocnode *an, *ann;
+
+  for (an= qu->allocations.head; an; an= ann) { ann= an->next; free(an); }
+  LIST_INIT(qu->allocations);
+  qu->interim_allocd= qu->preserved_allocd= 0;
+  qu->answer->status= adns_s_ok;
+  qu->answer->cname= 0;
+  qu->answer->nrrs= 0;
+  qu->answer->rrs.untyped= 0;
+}
+
+static void search_stash(adns_query qu, adns_query child) {
+  /* Takes over child's answer (and all the memory it refers to) as
+   * the best parallel search answer so far. */
+  adns_answer *ans= qu->answer, *cans= child->answer;
+
+  if (child->allocations.head) {
+    if (qu->allocations.tail) {
+      qu->allocations.tail->next= child->allocations.head;
+      child->allocations.head->back= qu->allocations.tail;
+    } else {
+      qu->allocations.head= child->allocations.head;
+    }
+    qu->allocations.tail= child->allocations.tail;
+    LIST_INIT(child->allocations);
+  }
+  qu->interim_allocd += child->interim_allocd;
+  qu->preserved_allocd += child->preserved_allocd;
+  child->interim_allocd= child->preserved_allocd= 0;
+
+  ans->status= cans->status;
+  ans->cname= cans->cname;
+  ans->nrrs= cans->nrrs;
+  ans->rrs.untyped= cans->rrs.untyped;
+  cans->cname= 0;
+  cans->nrrs= 0;
+  cans->rrs.untyped= 0;
+  qu->expires= child->expires;
+}
+
+static void search_best(adns_query qu, int ix) {
+  /* Candidate ix now has the best final answer; no worse candidate can
+   * matter any more. */
+  adns_query cqu, ncqu;
+
+  qu->search_best= ix;
+  for (cqu= qu->children.head; cqu; cqu= ncqu) {
+    ncqu= cqu->siblings.next;
+    if (cqu->ctx.pinfo.searchix > ix) adns__cancel(cqu);
+  }
+}
+
+static void search_parallel_done(adns_state ads, adns_query qu) {
+  /* Finishes a parallel search if no better candidate is outstanding. */
+  adns_query cqu;
+
+  for (cqu= qu->children.head; cqu; cqu= cqu->siblings.next) {
+    if (qu->search_best < 0 || cqu->ctx.pinfo.searchix < qu->search_best) {
+      LIST_LINK_TAIL(ads->childw,qu);
+      return;
+    }
+  }
+  if (qu->search_best < 0) {
+    qu->search_vb.used= qu->search_origlen;
+    adns__query_fail(qu,adns_s_nxdomain);
+    return;
+  }
+  if (!search_candidate(ads,qu,qu->search_best)) {
+    adns__query_fail(qu,adns_s_nomemory);
+    return;
+  }
+  adns__query_done(qu);
+}
+
+static void icb_searchpar(adns_query parent, adns_query child) {
+  adns_answer *cans= child->answer;
+  int ix= child->ctx.pinfo.searchix;
+
+  if (!(cans->status == adns_s_nxdomain && !cans->cname) &&
+      (parent->search_best < 0 || ix < parent->search_best)) {
+    search_unstash(parent);
+    search_stash(parent,child);
+    search_best(parent,ix);
+  }
+  search_parallel_done(parent->ads,parent);
+}
+
+static void search_parallel(adns_state ads, adns_query qu,
+			    struct timeval now) {
+  /* Submits a child query for each name adns__search_next would try,
+   * in the same order.  The names whose queries can't even be made
+   * are dealt with straight away, as the serial search would. */
+  adns_queryflags cflags;
+  adns_query cqu;
+  adns_status st;
+  qcontext ctx;
+  vbuf vb;
+  int ix, id;
+
+  cflags= qu->flags & ~(adns_qf_search|adns_qf_search_parallel|adns_qf_owner);
+  memset(&ctx,0,sizeof(ctx));
+  ctx.callback= icb_searchpar;
+  adns__vbuf_init(&vb);
+
+  for (ix=0; ix <= ads->nsearchlist; ix++) {
+    if (!search_candidate(ads,qu,ix)) { st= adns_s_nomemory; goto x_fail; }
+    st= adns__mkquery(ads,&vb,&id, qu->search_vb.buf,qu->search_vb.used,
+		      qu->typei,qu->answer->type, cflags);
+    if (st == adns_s_querydomaintoolong) continue;
+    if (!st && adns__negmemo_find(ads,vb.buf,vb.used,now)) {
+      adns__debug(ads,-1,qu,"skipping search candidate `%.*s',"
+		  " recently found not to exist",
+		  qu->search_vb.used,qu->search_vb.buf);
+      continue;
+    }
+    if (!st) {
+      ctx.pinfo.searchix= ix;
+      st= adns__internal_submit(ads,&cqu,qu, qu->typei,qu->answer->type,
+				&vb,id, cflags,now, &ctx);
+    }
+    if (st) {
+      /* This is the answer unless a better candidate succeeds. */
+      qu->answer->status= st;
+      search_best(qu,ix);
+      break;
+    }
+  }
+  adns__vbuf_free(&vb);
+  qu->state= query_childw;
+  search_parallel_done(ads,qu);
+  return;
+
+x_fail:
+  adns__vbuf_free(&vb);
+  adns__query_fail(qu,st);
+}
+
 static int save_owner(adns_query qu, const char *owner, int ol) {
   /* Returns 1 if OK, otherwise there was no memory. */
   adns_answer *ans;
@@ -260,22 +526,24 @@ static int save_owner(adns_query qu, const char *owner, int ol) {
   return 1;
 }
 
-int adns_submit(adns_state ads,
-		const char *owner,
-		adns_rrtype type,
-		adns_queryflags flags,
-		void *context,
-		adns_query *query_r) {
+static int submit_1(adns_state ads,
+		    const char *owner,
+		    adns_rrtype type,
+		    adns_queryflags flags,
+		    void *context,
+		    struct timeval now,
+		    adns_query *query_r) {
+  /* Does the work of adns_submit, but leaves consistency checks,
+   * autosys and adns__returning to the caller.  Returns 0 if the
+   * query was set going, -1 if it was created but has already failed
+   * (so is on the output queue), or an errno value. */
   int r, ol, ndots;
   adns_status st;
   const typeinfo *typei;
-  struct timeval now;
   adns_query qu;
   const char *p;
 
-  adns__consistency(ads,0,cc_entex);
-
-  if (flags & ~(adns_queryflags)0x4009ffff)
+  if (flags & ~(adns_queryflags)0x400fffff)
     /* 0x40080000 are reserved for `harmless' future expansion
      * 0x00000020 used to be adns_qf_quoteok_cname, now the default;
      * see also addrfam.c:textaddr_check_qf */
@@ -284,8 +552,8 @@ int adns_submit(adns_state ads,
   typei= adns__findtype(type);
   if (!typei) return ENOSYS;
 
-  r= gettimeofday(&now,0); if (r) goto x_errno;
   qu= query_alloc(ads,typei,type,flags,now); if (!qu) goto x_errno;
+  ads->stats.submitted++;
   
   qu->ctx.ext= context;
   qu->ctx.callback= 0;
@@ -293,6 +561,8 @@ int adns_submit(adns_state ads,
   memset(&qu->ctx.tinfo,0,sizeof(qu->ctx.tinfo));
 
   *query_r= qu;
+  adns__trace(ads,qu,"submit",&now,owner, ",\"type\":%u,\"flags\":%u",
+	      (unsigned)type,(unsigned)flags);
 
   ol= strlen(owner);
   if (!ol) { st= adns_s_querydomaininvalid; goto x_adnsfail; }
@@ -311,29 +581,89 @@ int adns_submit(adns_state ads,
     for (ndots=0, p=owner; (p= strchr(p,'.')); p++, ndots++);
     qu->search_doneabs= (ndots >= ads->searchndots) ? -1 : 0;
     qu->search_origlen= ol;
-    adns__search_next(ads,qu,now);
+    if (flags & adns_qf_search_parallel) search_parallel(ads,qu,now);
+    else adns__search_next(ads,qu,now);
   } else {
     if (flags & adns_qf_owner) {
       if (!save_owner(qu,owner,ol)) { st= adns_s_nomemory; goto x_adnsfail; }
     }
     query_simple(ads,qu, owner,ol, typei,flags, now);
   }
-  adns__autosys(ads,now);
-  adns__returning(ads,qu);
   return 0;
 
  x_adnsfail:
   adns__query_fail(qu,st);
-  adns__returning(ads,qu);
-  return 0;
+  return -1;
 
  x_errno:
   r= errno;
   assert(r);
+  return r;
+}
+
+int adns_submit(adns_state ads,
+		const char *owner,
+		adns_rrtype type,
+		adns_queryflags flags,
+		void *context,
+		adns_query *query_r) {
+  int r;
+  struct timeval now;
+
+  adns__consistency(ads,0,cc_entex);
+
+  r= gettimeofday(&now,0); if (r) { r= errno; goto x_errno; }
+  r= submit_1(ads,owner,type,flags,context,now,query_r);
+  if (r>0) goto x_errno;
+
+  if (!r) adns__autosys(ads,now);
+  adns__returning(ads,*query_r);
+  return 0;
+
+ x_errno:
   adns__returning(ads,0);
   return r;
 }
 
+int adns_submit_many(adns_state ads,
+		     int n, const adns_submission *subs,
+		     adns_query *queries_r, int *errors_r) {
+  int r, i, rfirst, sent;
+  struct timeval now;
+
+  adns__consistency(ads,0,cc_entex);
+
+  r= gettimeofday(&now,0);
+  if (r) {
+    r= errno;
+    for (i=0; i<n; i++) {
+      queries_r[i]= 0;
+      if (errors_r) errors_r[i]= r;
+    }
+    adns__returning(ads,0);
+    return r;
+  }
+
+  rfirst= 0;
+  sent= 0;
+  for (i=0; i<n; i++) {
+    r= submit_1(ads,subs[i].owner,subs[i].type,subs[i].flags,subs[i].context,
+		now,&queries_r[i]);
+    if (r>0) {
+      queries_r[i]= 0;
+      if (!rfirst) rfirst= r;
+    } else {
+      if (!r) sent= 1;
+      r= 0;
+    }
+    if (errors_r) errors_r[i]= r;
+  }
+
+  if (sent) adns__autosys(ads,now);
+  adns__returning(ads,0);
+  return rfirst;
+}
+
 int adns_submit_reverse_any(adns_state ads,
 			    const struct sockaddr *addr,
 			    const char *zone,
@@ -373,14 +703,21 @@ int adns_synchronous(adns_state ads,
 		     adns_queryflags flags,
 		     adns_answer **answer_r) {
   adns_query qu;
+  adns_completioncallbackfn *completionfn;
   int r;
-  
+
+  /* Our own query must come back to us, not to the callback. */
+  completionfn= ads->completionfn;
+  ads->completionfn= 0;
+
   r= adns_submit(ads,owner,type,flags,0,&qu);
-  if (r) return r;
+  if (r) goto xit;
 
   r= adns_wait(ads,&qu,answer_r,0);
   if (r) adns_cancel(qu);
 
+ xit:
+  ads->completionfn= completionfn;
   return r;
 }
 
@@ -516,6 +853,19 @@ void adns__returning(adns_state ads, adns_query qu_for_caller) {
     free(iq->answer);
     free(iq);
   }
+  if (ads->completionfn && !ads->completing) {
+    ads->completing= 1;
+    while (ads->completionfn && ads->output.head) {
+      adns_query oq= ads->output.head;
+      adns_answer *ans= oq->answer;
+      void *context= oq->ctx.ext;
+      LIST_UNLINK(ads->output,oq);
+      if (oq == qu_for_caller) qu_for_caller= 0;
+      ads->completionfn(ads,ads->completionfndata,oq,ans,context);
+      free(oq);
+    }
+    ads->completing= 0;
+  }
   adns__consistency(ads,qu_for_caller,cc_entex);
 }
 
@@ -610,6 +960,9 @@ void adns__query_done(adns_query qu) {
   adns_state ads=qu->ads;
   adns_answer *ans;
 
+  TRACE_QUERY(done,qu,-1,qu->senttime);
+  adns__trace(ads,qu,"done",0,0, ",\"status\":%d,\"nrrs\":%d",
+	      qu->answer->status,qu->answer->nrrs);
   adns__cancel_children(qu);
 
   qu->id= -1;
@@ -622,20 +975,19 @@ void adns__query_done(adns_query qu) {
     }
   }
 
-  if (ans->nrrs && qu->typei->diff_needswap) {
-    if (!adns__vbuf_ensure(&qu->vb,qu->answer->rrsz)) {
+  if (ans->nrrs > 1 && (qu->typei->sortkey || qu->typei->postsort)) {
+    if (!adns__vbuf_ensure(&qu->vb,SORT_TEMPSZ(ans->nrrs,ans->rrsz))) {
       adns__query_fail(qu,adns_s_nomemory);
       return;
     }
-    adns__isort(ans->rrs.bytes, ans->nrrs, ans->rrsz,
-		qu->vb.buf,
-		(int(*)(void*, const void*, const void*))
-		  qu->typei->diff_needswap,
-		qu->ads);
-  }
-  if (ans->nrrs && qu->typei->postsort) {
-    qu->typei->postsort(qu->ads, ans->rrs.bytes,
-			ans->nrrs,ans->rrsz, qu->typei);
+    if (qu->typei->sortkey)
+      adns__sort(ans->rrs.bytes, ans->nrrs, ans->rrsz,
+		 qu->vb.buf,
+		 (int(*)(void*, const void*))qu->typei->sortkey,
+		 qu->ads);
+    if (qu->typei->postsort)
+      qu->typei->postsort(qu->ads, ans->rrs.bytes,
+			  ans->nrrs,ans->rrsz, qu->vb.buf, qu->typei);
   }
 
   ans->expires= qu->expires;
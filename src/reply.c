@@ -28,6 +28,47 @@
 
 #include "internal.h"
     
+static unsigned long soa_negttl(adns_query qu, int serv,
+				const byte *dgram, int dglen,
+				int rdstart, int rdlength, unsigned long ttl) {
+  /* Returns how long the nonexistence of a name may be remembered
+   * given the SOA in the authority section of the NXDOMAIN answer:
+   * the lesser of the SOA's TTL and its MINIMUM field (RFC2308 s5).
+   * Returns 0 if the SOA is malformed. */
+  findlabel_state fls;
+  int cbyte, max, lablen, labstart, i;
+  unsigned long minimum, tmp;
+
+  cbyte= rdstart;
+  max= rdstart+rdlength;
+  for (i=0; i<2; i++) {
+    /* MNAME and RNAME */
+    adns__findlabel_start(&fls,qu->ads, serv,qu, dgram,dglen,max,
+			  cbyte,&cbyte);
+    do {
+      if (adns__findlabel_next(&fls,&lablen,&labstart)) return 0;
+      if (lablen<0) return 0;
+    } while (lablen);
+  }
+  if (max-cbyte != 20) return 0;
+  cbyte += 16; /* SERIAL, REFRESH, RETRY, EXPIRE */
+  minimum= GET_L(cbyte,tmp);
+  return minimum < ttl ? minimum : ttl;
+}
+
+static void stats_reply(adns_state ads, int serv, adns_query qu,
+			struct timeval now) {
+  /* Adds the reply to qu to serv's latency histogram. */
+  long ms;
+  int bucket;
+
+  ms= (now.tv_sec - qu->senttime.tv_sec)*1000 +
+    (now.tv_usec - qu->senttime.tv_usec)/1000;
+  for (bucket=0; bucket<ADNS_STATS_NBUCKETS-1 && ms>0; bucket++) ms >>= 1;
+  ads->stats.servers[serv].replies++;
+  ads->stats.servers[serv].latency[bucket]++;
+}
+
 void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
 		     int serv, int viatcp, struct timeval now) {
   int cbyte, rrstart, wantedrrs, rri, foundsoa, foundns, cname_here;
@@ -36,7 +77,7 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
   int rrtype, rrclass, rdlength, rdstart;
   int anstart, nsstart;
   int ownermatched, l, nrrs;
-  unsigned long ttl, soattl;
+  unsigned long ttl, soattl, negttl;
   const typeinfo *typei;
   adns_query qu, nqu;
   dns_rcode rcode;
@@ -44,6 +85,7 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
   vbuf tempvb;
   byte *newquery, *rrsdata;
   parseinfo pai;
+  struct glueindex glue;
   
   if (dglen<DNS_HDRSIZE) {
     adns__diag(ads,serv,0,"received datagram"
@@ -78,6 +120,7 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
 	       " %d (wanted 0=QUERY)",opcode);
     return;
   }
+  ads->stats.rcodes[rcode]++;
 
   qu= 0;
   /* See if we can find the relevant query, or leave qu=0 otherwise ... */   
@@ -103,6 +146,11 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
       /* We're definitely going to do something with this query now */
       if (viatcp) LIST_UNLINK(ads->tcpw,qu);
       else LIST_UNLINK(ads->udpw,qu);
+      stats_reply(ads,serv,qu,now);
+      TRACE_QUERY(reply,qu,serv,now);
+      adns__trace(ads,qu,"reply",&now,0,
+		  ",\"id\":%d,\"serv\":%d,\"rcode\":%d,\"len\":%d",
+		  id,serv,(int)rcode,dglen);
     }
   }
   
@@ -220,6 +268,7 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
 	memcpy(qu->cname_dgram,dgram,dglen);
 
 	memcpy(qu->answer->cname,qu->vb.buf,l);
+	adns__trace(ads,qu,"cname",&now,qu->answer->cname,"%s","");
 	cname_here= 1;
 	adns__update_expires(qu,ttl,now);
 	/* If we find the answer section truncated after this point we restart
@@ -249,7 +298,7 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
 
     /* RFC2308: NODATA has _either_ a SOA _or_ _no_ NS records
      * in authority section */
-    foundsoa= 0; soattl= 0; foundns= 0;
+    foundsoa= 0; soattl= 0; negttl= 0; foundns= 0;
     for (rri= 0; rri<nscount; rri++) {
       rrstart= cbyte;
       st= adns__findrr(qu,serv, dgram,dglen,&cbyte,
@@ -262,7 +311,12 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
 		   " (expected IN=%d)", rrclass,DNS_CLASS_IN);
 	continue;
       }
-      if (rrtype == adns_r_soa_raw) { foundsoa= 1; soattl= ttl; break; }
+      if (rrtype == adns_r_soa_raw) {
+	foundsoa= 1; soattl= ttl;
+	if (rcode == rcode_nxdomain)
+	  negttl= soa_negttl(qu,serv, dgram,dglen, rdstart,rdlength, ttl);
+	break;
+      }
       else if (rrtype == adns_r_ns_raw) { foundns= 1; }
     }
     
@@ -270,6 +324,14 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
       /* We still wanted to look for the SOA so we could find the TTL. */
       adns__update_expires(qu,soattl,now);
 
+      /* Remember that the name doesn't exist, so that other searches
+       * needn't ask again.  (If we followed a CNAME, it's the CNAME
+       * target that doesn't exist.) */
+      if (!qu->cname_dgram &&
+	  (qu->flags & adns_qf_search ||
+	   (qu->parent && qu->parent->flags & adns_qf_search_parallel)))
+	adns__negmemo_add(ads,qu->query_dgram,qu->query_dglen,negttl,now);
+
       if (qu->flags & adns_qf_search && !qu->cname_dgram) {
 	adns__search_next(ads,qu,now);
       } else {
@@ -330,6 +392,8 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
   pai.nscount= nscount;
   pai.arcount= arcount;
   pai.now= now;
+  pai.glue= &glue;
+  glue.built= 0;
 
   for (rri=0, nrrs=0; rri<ancount; rri++) {
     st= adns__findrr(qu,serv, dgram,dglen,&cbyte,
@@ -366,6 +430,7 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
     adns__query_fail(qu,adns_s_invalidresponse);
     return;
   }
+  if (!(qu->flags & adns_qf_usevc)) ads->stats.tcpfallbacks++;
   qu->flags |= adns_qf_usevc;
   
  x_restartquery:
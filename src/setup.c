@@ -72,6 +72,25 @@ static void freesearchlist(adns_state ads) {
   free(ads->searchlist);
 }
 
+static void freenegmemo(adns_state ads) {
+  int i;
+
+  if (!ads->negmemo) return;
+  for (i=0; i<ads->negmemosz; i++) free(ads->negmemo[i].name);
+  free(ads->negmemo);
+  ads->negmemo= 0;
+}
+
+static void freesortlist(adns_state ads) {
+  free(ads->sortlist);
+  free(ads->sortlist_nodes);
+  free(ads->sortlist_irregular);
+  ads->sortlist= 0;
+  ads->sortlist_nodes= 0;
+  ads->sortlist_irregular= 0;
+  ads->nsortlist= ads->nsortlist_irregular= 0;
+}
+
 static void saveerr(adns_state ads, int en) {
   if (!ads->configerrno) ads->configerrno= en;
 }
@@ -108,6 +127,14 @@ static int nextword(const char **bufp_io, const char **word_r, int *l_r) {
   return 1;
 }
 
+static void setport(adns_sockaddr *sa, int port) {
+  switch (sa->sa.sa_family) {
+  case AF_INET: sa->inet.sin_port= htons(port); break;
+  case AF_INET6: sa->inet6.sin6_port= htons(port); break;
+  default: abort();
+  }
+}
+
 static void ccf_nameserver(adns_state ads, const char *fn,
 			   int lno, const char *buf) {
   adns_rr_addr a;
@@ -116,7 +143,7 @@ static void ccf_nameserver(adns_state ads, const char *fn,
   socklen_t salen;
 
   salen= sizeof(a.addr);
-  err= adns_text2addr(buf,DNS_PORT, 0, &a.addr.sa,&salen);
+  err= adns_text2addr(buf,ads->nsport, 0, &a.addr.sa,&salen);
   a.len= salen;
   switch (err) {
   case 0:
@@ -179,25 +206,109 @@ static int gen_pton(const char *text, int want_af, adns_sockaddr *a) {
   return 1;
 }
 
+static int mask_prefixlen(const adns_sockaddr *mask) {
+  /* Returns the prefix length of mask, or -1 if it is not a prefix. */
+  const byte *p= adns__sockaddr_addr(&mask->sa);
+  int width= adns__addr_width(mask->sa.sa_family);
+  int len, i;
+
+  for (len=0; len<width && (p[len>>3] & (0x80 >> (len&7))); len++);
+  for (i=len; i<width; i++)
+    if (p[i>>3] & (0x80 >> (i&7))) return -1;
+  return len;
+}
+
+static int sortlist_newnode(adns_state ads, int *avail_io) {
+  struct sortlist_node *newnodes;
+  int newavail, n;
+
+  n= ads->nsortlist_nodes;
+  if (n >= *avail_io) {
+    newavail= *avail_io * 2;
+    newnodes= realloc(ads->sortlist_nodes, sizeof(*newnodes)*newavail);
+    if (!newnodes) return -1;
+    ads->sortlist_nodes= newnodes;
+    *avail_io= newavail;
+  }
+  ads->sortlist_nodes[n].child[0]= ads->sortlist_nodes[n].child[1]= 0;
+  ads->sortlist_nodes[n].index= ads->nsortlist;
+  ads->nsortlist_nodes++;
+  return n;
+}
+
+static void sortlist_compile(adns_state ads) {
+  /* Builds the trie described in internal.h.  If we run out of memory
+   * we just leave sortlist_nodes null, so that lookups are linear. */
+  const struct sortlist *sl;
+  const byte *p;
+  int i, avail, len, bit, node, b, c;
+
+  free(ads->sortlist_nodes);
+  free(ads->sortlist_irregular);
+  ads->sortlist_nodes= 0;
+  ads->sortlist_irregular= 0;
+  ads->nsortlist_nodes= ads->nsortlist_irregular= 0;
+  if (!ads->nsortlist) return;
+
+  ads->sortlist_irregular= malloc(sizeof(int)*ads->nsortlist);
+  if (!ads->sortlist_irregular) return;
+  avail= 64;
+  ads->sortlist_nodes= malloc(sizeof(*ads->sortlist_nodes)*avail);
+  if (!ads->sortlist_nodes) goto x_nomem;
+  sortlist_newnode(ads,&avail); /* AF_INET root */
+  sortlist_newnode(ads,&avail); /* AF_INET6 root */
+
+  for (i=0, sl=ads->sortlist; i<ads->nsortlist; i++, sl++) {
+    len= mask_prefixlen(&sl->mask);
+    if (len < 0) {
+      ads->sortlist_irregular[ads->nsortlist_irregular++]= i;
+      continue;
+    }
+    p= adns__sockaddr_addr(&sl->base.sa);
+    node= sl->base.sa.sa_family == AF_INET6;
+    for (bit=0; bit<len; bit++) {
+      b= (p[bit>>3] >> (7 - (bit&7))) & 1;
+      c= ads->sortlist_nodes[node].child[b];
+      if (!c) {
+	c= sortlist_newnode(ads,&avail);
+	if (c < 0) goto x_nomem;
+	ads->sortlist_nodes[node].child[b]= c;
+      }
+      node= c;
+    }
+    if (i < ads->sortlist_nodes[node].index)
+      ads->sortlist_nodes[node].index= i;
+  }
+  return;
+
+ x_nomem:
+  free(ads->sortlist_nodes);
+  free(ads->sortlist_irregular);
+  ads->sortlist_nodes= 0;
+  ads->sortlist_irregular= 0;
+  ads->nsortlist_nodes= ads->nsortlist_irregular= 0;
+}
+
 static void ccf_sortlist(adns_state ads, const char *fn,
 			 int lno, const char *buf) {
-  const char *word;
+  const char *word, *bufp;
   char tbuf[200], *slash, *ep;
   const char *maskwhat;
-  struct sortlist *sl;
-  int l;
+  struct sortlist *sl, *newlist;
+  int l, count, n;
   int initial= -1;
 
   if (!buf) return;
-  
-  ads->nsortlist= 0;
-  while (nextword(&buf,&word,&l)) {
-    if (ads->nsortlist >= MAXSORTLIST) {
-      adns__diag(ads,-1,0,"too many sortlist entries,"
-		 " ignoring %.*s onwards",l,word);
-      return;
-    }
 
+  bufp= buf;
+  count= 0;
+  while (nextword(&bufp,&word,&l)) count++;
+
+  newlist= malloc(sizeof(*newlist)*(count+1));
+  if (!newlist) { saveerr(ads,errno); return; }
+
+  n= 0;
+  while (nextword(&buf,&word,&l)) {
     if (l >= sizeof(tbuf)) {
       configparseerr(ads,fn,lno,"sortlist entry `%.*s' too long",l,word);
       continue;
@@ -207,7 +318,7 @@ static void ccf_sortlist(adns_state ads, const char *fn,
     slash= strchr(tbuf,'/');
     if (slash) *slash++= 0;
 
-    sl= &ads->sortlist[ads->nsortlist];
+    sl= &newlist[n];
     if (!gen_pton(tbuf, AF_UNSPEC, &sl->base)) {
       configparseerr(ads,fn,lno,"invalid address `%s' in sortlist",tbuf);
       continue;
@@ -256,8 +367,13 @@ static void ccf_sortlist(adns_state ads, const char *fn,
       continue;
     }
 
-    ads->nsortlist++;
+    n++;
   }
+
+  freesortlist(ads);
+  ads->sortlist= newlist;
+  ads->nsortlist= n;
+  sortlist_compile(ads);
 }
 
 static void ccf_options(adns_state ads, const char *fn,
@@ -265,7 +381,7 @@ static void ccf_options(adns_state ads, const char *fn,
   const char *opt, *word, *endword, *endopt;
   char *ep;
   unsigned long v;
-  int l;
+  int l, i;
 
   if (!buf) return;
 
@@ -291,6 +407,38 @@ static void ccf_options(adns_state ads, const char *fn,
       ads->searchndots= v;
       continue;
     }
+    if (WORD_STARTS("adns_addrgrace:")) {
+      v= strtoul(word,&ep,10);
+      if (ep==word || ep != endword || v > INT_MAX) {
+	configparseerr(ads,fn,lno,"option `%.*s' malformed"
+		       " or has bad value",l,opt);
+	continue;
+      }
+      ads->addrgracems= v;
+      continue;
+    }
+    if (WORD_STARTS("adns_nsport:")) {
+      v= strtoul(word,&ep,10);
+      if (ep==word || ep != endword || !v || v > 65535) {
+	configparseerr(ads,fn,lno,"option `%.*s' malformed"
+		       " or has bad value",l,opt);
+	continue;
+      }
+      ads->nsport= v;
+      for (i=0; i<ads->nservers; i++)
+	setport(&ads->servers[i].addr,v);
+      continue;
+    }
+    if (WORD_STARTS("adns_negmemo:")) {
+      v= strtoul(word,&ep,10);
+      if (ep==word || ep != endword || v > INT_MAX) {
+	configparseerr(ads,fn,lno,"option `%.*s' malformed"
+		       " or has bad value",l,opt);
+	continue;
+      }
+      ads->negmemosz= v;
+      continue;
+    }
     if (WORD_STARTS("adns_checkc:")) {
       if (WORD_IS("none")) {
 	ads->iflags &= ~adns_if_checkc_freq;
@@ -606,7 +754,7 @@ static int init_begin(adns_state *ads_r, adns_initflags flags,
   adns_state ads;
   pid_t pid;
   
-  if (flags & ~(adns_initflags)(0x4fff))
+  if (flags & ~(adns_initflags)(0x5fff))
     /* 0x4000 is reserved for `harmless' future expansion */
     return ENOSYS;
 
@@ -627,13 +775,29 @@ static int init_begin(adns_state *ads_r, adns_initflags flags,
   ads->tcpsocket= -1;
   adns__vbuf_init(&ads->tcpsend);
   adns__vbuf_init(&ads->tcprecv);
+  adns__vbuf_init(&ads->gluevb);
+  adns__vbuf_init(&ads->tracevb);
+  ads->nextserial= 1;
+  timerclear(&ads->tracetime);
   ads->tcprecv_skip= 0;
   ads->nservers= ads->nsortlist= ads->nsearchlist= ads->tcpserver= 0;
+  ads->sortlist= 0;
+  ads->sortlist_nodes= 0;
+  ads->sortlist_irregular= 0;
+  ads->nsortlist_nodes= ads->nsortlist_irregular= 0;
   ads->searchndots= 1;
+  ads->addrgracems= ADDRGRACEMS;
+  ads->negmemo= 0;
+  ads->negmemosz= NEGMEMOSZ;
+  ads->nsport= DNS_PORT;
   ads->tcpstate= server_disconnected;
   timerclear(&ads->tcptimeout);
   ads->searchlist= 0;
   ads->config_report_unknown=1;
+  ads->completionfn= 0;
+  ads->completionfndata= 0;
+  ads->completing= 0;
+  memset(&ads->stats,0,sizeof(ads->stats));
 
   pid= getpid();
   ads->rand48xsubi[0]= pid;
@@ -656,7 +820,7 @@ static int init_finish(adns_state ads) {
       adns__lprintf(ads,"adns: no nameservers, using IPv4 localhost\n");
     memset(&sin, 0, sizeof(sin));
     sin.sin_family = AF_INET;
-    sin.sin_port = htons(DNS_PORT);
+    sin.sin_port = htons(ads->nsport);
     sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
     addserver(ads,(struct sockaddr *)&sin, sizeof(sin));
   }
@@ -681,6 +845,7 @@ static int init_finish(adns_state ads) {
  x_closeudp:
   for (i=0; i<ads->nudpsockets; i++) close(ads->udpsockets[i].fd);
  x_free:
+  freesortlist(ads);
   free(ads);
   return r;
 }
@@ -690,6 +855,7 @@ static void init_abort(adns_state ads) {
     free(ads->searchlist[0]);
     free(ads->searchlist);
   }
+  freesortlist(ads);
   free(ads);
 }
 
@@ -785,6 +951,15 @@ int adns_init_logfn(adns_state *newstate_r, adns_initflags flags,
     return init_files(newstate_r, flags, logfn, logfndata);
 }
 
+void adns_set_completionfn(adns_state ads,
+			   adns_completioncallbackfn *completionfn,
+			   void *completionfndata) {
+  adns__consistency(ads,0,cc_entex);
+  ads->completionfn= completionfn;
+  ads->completionfndata= completionfndata;
+  adns__returning(ads,0);
+}
+
 void adns_finish(adns_state ads) {
   int i;
   adns__consistency(ads,0,cc_entex);
@@ -800,7 +975,12 @@ void adns_finish(adns_state ads) {
   if (ads->tcpsocket >= 0) close(ads->tcpsocket);
   adns__vbuf_free(&ads->tcpsend);
   adns__vbuf_free(&ads->tcprecv);
+  adns__vbuf_free(&ads->gluevb);
+  adns__trace_flush(ads);
+  adns__vbuf_free(&ads->tracevb);
+  freenegmemo(ads);
   freesearchlist(ads);
+  freesortlist(ads);
   free(ads);
 }
 
@@ -843,3 +1023,34 @@ adns_query adns_forallqueries_next(adns_state ads, void **context_r) {
   if (context_r) *context_r= qu->ctx.ext;
   return qu;
 }
+
+static void stats_queue(adns_stats *st, struct query_queue *queue) {
+  adns_query qu;
+
+  for (qu= queue->head; qu; qu= qu->next) {
+    st->queries++;
+    st->memory += sizeof(*qu) + sizeof(*qu->answer) +
+      qu->interim_allocd + qu->preserved_allocd +
+      qu->vb.avail + qu->search_vb.avail +
+      qu->query_dglen + qu->cname_dglen;
+  }
+}
+
+void adns_getstats(adns_state ads, adns_stats *stats_r) {
+  int serv;
+
+  adns__consistency(ads,0,cc_entex);
+  *stats_r= ads->stats;
+  stats_r->nservers= ads->nservers;
+  for (serv=0; serv<ads->nservers; serv++)
+    stats_r->servers[serv].addr= ads->servers[serv];
+
+  stats_r->queries= 0;
+  stats_r->memory= sizeof(*ads) + ads->tcpsend.avail + ads->tcprecv.avail +
+    ads->gluevb.avail;
+  stats_queue(stats_r,&ads->udpw);
+  stats_queue(stats_r,&ads->tcpw);
+  stats_queue(stats_r,&ads->childw);
+  stats_queue(stats_r,&ads->output);
+  stats_queue(stats_r,&ads->intdone);
+}
@@ -195,6 +195,11 @@ void adns__querysend_tcp(adns_query qu, struct timeval now) {
     return;
 
   qu->retries++;
+  qu->senttime= now;
+  TRACE_QUERY(send_tcp,qu,ads->tcpserver,now);
+  adns__trace(ads,qu, qu->sentid == qu->id ? "retry" : "send", &now,0,
+	      ",\"id\":%d,\"serv\":%d,\"tcp\":1", qu->id,ads->tcpserver);
+  qu->sentid= qu->id;
 
   /* Reset idle timeout. */
   ads->tcptimeout.tv_sec= ads->tcptimeout.tv_usec= 0;
@@ -260,6 +265,7 @@ void adns__query_send(adns_query qu, struct timeval now) {
   }
 
   if (qu->retries >= UDPMAXRETRIES) {
+    qu->ads->stats.timeouts++;
     adns__query_fail(qu,adns_s_timeout);
     return;
   }
@@ -279,7 +285,14 @@ void adns__query_send(adns_query qu, struct timeval now) {
   }
   if (r<0 && errno != EAGAIN)
     adns__warn(ads,serv,0,"sendto failed: %s",strerror(errno));
-  
+
+  ads->stats.udpsent++;
+  if (qu->sentid == qu->id) ads->stats.udpretries++;
+  qu->senttime= now;
+  TRACE_QUERY(send_udp,qu,serv,now);
+  adns__trace(ads,qu, qu->sentid == qu->id ? "retry" : "send", &now,0,
+	      ",\"id\":%d,\"serv\":%d,\"tcp\":0", qu->id,serv);
+  qu->sentid= qu->id;
   qu->timeout= now;
   timevaladd(&qu->timeout,UDPRETRYMS);
   qu->udpsent |= (1<<serv);
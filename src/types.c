@@ -33,6 +33,7 @@
 #include <arpa/inet.h>
 
 #include "internal.h"
+#include "tvarith.h"
 
 #define R_NOMEM       return adns_s_nomemory
 #define CSP_ADDSTR(s) do {			\
@@ -48,19 +49,21 @@
  * _intstr                    (mf,csp,cs)
  * _manyistr                  (mf,cs)
  * _txt                       (pa)
- * _inaddr                    (pa,di,cs
- *				+search_sortlist, dip_genaddr, csp_genaddr)
- * _in6addr		      (pa,di,cs)
- * _addr                      (pap,pa,di,div,csp,cs,gsz,qs
- *				+search_sortlist_sa, dip_sockaddr,
- *				 addr_rrtypes, addr_submit, icb_addr)
+ * _inaddr                    (pa,sk,cs
+ *				+lookup_sortlist, search_sortlist, csp_genaddr)
+ * _in6addr		      (pa,sk,cs)
+ * _addr                      (pap,pa,sk,skv,csp,cs,gsz,qs
+ *				+search_sortlist_sa, addr_rrtypes,
+ *				 addr_submit, icb_addr)
  * _domain                    (pap,csp,cs)
  * _dom_raw		      (pa)
  * _host_raw                  (pa)
- * _hostaddr                  (pap,pa,dip,di,mfp,mf,csp,cs
- *				+pap_findaddrs, icb_hostaddr)
- * _mx_raw                    (pa,di)
- * _mx                        (pa,di)
+ * _hostaddr                  (pap,pa,skp,sk,mfp,mf,csp,cs
+ *				+glue_namehash, glue_nameeq, glue_build,
+ *				 pap_findaddrs, icb_hostaddr,
+ *				 hostaddr_samehost, hostaddr_coalesce)
+ * _mx_raw                    (pa,sk)
+ * _mx                        (pa,sk)
  * _inthostaddr               (mf,cs)
  * _inthost		      (cs)
  * _ptr                       (ckl,pa +icb_ptr)
@@ -70,7 +73,7 @@
  * _mailbox                   (pap,csp +pap_mailbox822)
  * _rp                        (pa,cs)
  * _soa                       (pa,mf,cs)
- * _srv*                      (ckl,(pap),pa*2,mf*2,di,(csp),cs*2,postsort)
+ * _srv*                      (ckl,(pap),pa*2,mf*2,sk,(csp),cs*2,postsort)
  * _byteblock                 (mf)
  * _opaque                    (pa,cs)
  * _flat                      (mf)
@@ -79,8 +82,9 @@
  *    ckl_*
  *    pap_*
  *    pa_*
- *    dip_*
- *    di_*
+ *    skp_*
+ *    sk_*
+ *    skv_*
  *    mfp_*
  *    mf_*
  *    csp_*
@@ -249,7 +253,7 @@ static adns_status cs_hinfo(vbuf *vb, const void *datap) {
 }
 
 /*
- * _inaddr   (pa,di,cs +search_sortlist, dip_genaddr, csp_genaddr)
+ * _inaddr   (pa,sk,cs +lookup_sortlist, search_sortlist, csp_genaddr)
  */
 
 static adns_status pa_inaddr(const parseinfo *pai, int cbyte,
@@ -261,12 +265,47 @@ static adns_status pa_inaddr(const parseinfo *pai, int cbyte,
   return adns_s_ok;
 }
 
-static int search_sortlist(adns_state ads, int af, const void *ad) {
+static int lookup_sortlist(adns_state ads, int af, const void *ad,
+			   int best) {
+  /* Returns the lowest index of a sortlist entry which matches ad, if
+   * that is less than best; otherwise returns best. */
   const struct sortlist *slp;
+  const struct sortlist_node *node;
+  const byte *p= ad;
+  int i, j, bit, width, c;
+
+  if (!ads->sortlist_nodes) {
+    for (i=0, slp=ads->sortlist;
+	 i<best && !adns__addr_matches(af,ad, &slp->base,&slp->mask);
+	 i++, slp++);
+    return i;
+  }
+
+  width= adns__addr_width(af);
+  node= &ads->sortlist_nodes[af == AF_INET6];
+  for (bit=0; ; bit++) {
+    if (node->index < best) best= node->index;
+    if (bit >= width) break;
+    c= node->child[(p[bit>>3] >> (7 - (bit&7))) & 1];
+    if (!c) break;
+    node= &ads->sortlist_nodes[c];
+  }
+  for (i=0;
+       i<ads->nsortlist_irregular && (j= ads->sortlist_irregular[i]) < best;
+       i++) {
+    slp= &ads->sortlist[j];
+    if (adns__addr_matches(af,ad, &slp->base,&slp->mask)) return j;
+  }
+  return best;
+}
+
+static int search_sortlist(adns_state ads, int af, const void *ad) {
   struct in_addr a4;
   int i;
-  int v6mappedp= 0;
 
+  if (!ads->nsortlist) return 0;
+
+  i= lookup_sortlist(ads, af, ad, ads->nsortlist);
   if (af == AF_INET6) {
     const struct in6_addr *a6= ad;
     if (IN6_IS_ADDR_V4MAPPED(a6)) {
@@ -274,32 +313,14 @@ static int search_sortlist(adns_state ads, int af, const void *ad) {
 		       ((unsigned long)a6->s6_addr[13] << 16) |
 		       ((unsigned long)a6->s6_addr[14] <<  8) |
 		       ((unsigned long)a6->s6_addr[15] <<  0));
-      v6mappedp= 1;
+      i= lookup_sortlist(ads, AF_INET, &a4, i);
     }
   }
-
-  for (i=0, slp=ads->sortlist;
-       i<ads->nsortlist &&
-	 !adns__addr_matches(af,ad, &slp->base,&slp->mask) &&
-	 !(v6mappedp &&
-	   adns__addr_matches(AF_INET,&a4, &slp->base,&slp->mask));
-       i++, slp++);
   return i;
 }
 
-static int dip_genaddr(adns_state ads, int af, const void *a, const void *b) {
-  int ai, bi;
-  
-  if (!ads->nsortlist) return 0;
-
-  ai= search_sortlist(ads,af,a);
-  bi= search_sortlist(ads,af,b);
-  return bi<ai;
-}
-
-static int di_inaddr(adns_state ads,
-		     const void *datap_a, const void *datap_b) {
-  return dip_genaddr(ads,AF_INET,datap_a,datap_b);
+static int sk_inaddr(adns_state ads, const void *datap) {
+  return search_sortlist(ads,AF_INET,datap);
 }
 
 static adns_status csp_genaddr(vbuf *vb, int af, const void *p) {
@@ -321,7 +342,7 @@ static adns_status cs_inaddr(vbuf *vb, const void *datap) {
 }
 
 /*
- * _in6addr   (pa,di,cs)
+ * _in6addr   (pa,sk,cs)
  */
 
 static adns_status pa_in6addr(const parseinfo *pai, int cbyte,
@@ -333,9 +354,8 @@ static adns_status pa_in6addr(const parseinfo *pai, int cbyte,
   return adns_s_ok;
 }
 
-static int di_in6addr(adns_state ads,
-		     const void *datap_a, const void *datap_b) {
-  return dip_genaddr(ads,AF_INET6,datap_a,datap_b);
+static int sk_in6addr(adns_state ads, const void *datap) {
+  return search_sortlist(ads,AF_INET6,datap);
 }
 
 static adns_status cs_in6addr(vbuf *vb, const void *datap) {
@@ -343,8 +363,8 @@ static adns_status cs_in6addr(vbuf *vb, const void *datap) {
 }
 
 /*
- * _addr   (pap,pa,di,div,csp,cs,gsz,qs
- *		+search_sortlist_sa, dip_sockaddr, addr_rrtypes,
+ * _addr   (pap,pa,sk,skv,csp,cs,gsz,qs
+ *		+search_sortlist_sa, addr_rrtypes,
  *		 addr_submit, icb_addr)
  */
 
@@ -457,23 +477,16 @@ static int search_sortlist_sa(adns_state ads, const struct sockaddr *sa) {
   return search_sortlist(ads, sa->sa_family, pa);
 }
 
-static int dip_sockaddr(adns_state ads,
-			const struct sockaddr *sa,
-			const struct sockaddr *sb) {
-  if (!ads->sortlist) return 0;
-  return search_sortlist_sa(ads, sa) > search_sortlist_sa(ads, sb);
-}
-
-static int di_addr(adns_state ads, const void *datap_a, const void *datap_b) {
-  const adns_rr_addr *ap= datap_a, *bp= datap_b;
-  return dip_sockaddr(ads, &ap->addr.sa, &bp->addr.sa);
+static int sk_addr(adns_state ads, const void *datap) {
+  const adns_rr_addr *rrp= datap;
+  return search_sortlist_sa(ads, &rrp->addr.sa);
 }
 
-static int div_addr(void *context, const void *datap_a, const void *datap_b) {
+static int skv_addr(void *context, const void *datap) {
   const adns_state ads= context;
 
-  return di_addr(ads, datap_a, datap_b);
-}		     
+  return sk_addr(ads, datap);
+}
 
 static adns_status csp_addr(vbuf *vb, const adns_rr_addr *rrp) {
   char buf[ADNS_ADDR2TEXT_BUFLEN];
@@ -691,6 +704,7 @@ static void icb_addr(adns_query parent, adns_query child) {
      * settled on.
      */
     adns__cancel_children(parent);
+    parent->flags &= ~adns__qf_addr_grace;
     r= gettimeofday(&now, 0);  if (r) goto x_gtod;
     qf= adns__qf_addr_cname;
     if (!(parent->flags & adns_qf_cname_loose)) qf |= adns_qf_cname_forbid;
@@ -710,6 +724,7 @@ static void icb_addr(adns_query parent, adns_query child) {
      */
 
     adns__cancel_children(parent);
+    parent->flags &= ~adns__qf_addr_grace;
     adns__free_interim(parent, pans->rrs.bytes);
     pans->rrs.bytes= 0; pans->nrrs= 0;
     r= gettimeofday(&now, 0);  if (r) goto x_gtod;
@@ -727,6 +742,17 @@ static void icb_addr(adns_query parent, adns_query child) {
   if (err) goto x_err;
   done_addr_type(parent, cans->type);
 
+  if (parent->children.head &&
+      (parent->flags & adns_qf_addr_early) && pans->nrrs &&
+      !(parent->flags & adns__qf_addr_grace)) {
+    /* We have some addresses; give the other families a little longer
+     * and then settle for what we've got (see adns__timeouts). */
+    r= gettimeofday(&now, 0);  if (r) goto x_gtod;
+    parent->timeout= now;
+    timevaladd(&parent->timeout, ads->addrgracems);
+    parent->flags |= adns__qf_addr_grace;
+  }
+
   if (parent->children.head) LIST_LINK_TAIL(ads->childw, parent);
   else if (!pans->nrrs) adns__query_fail(parent, adns_s_nodata);
   else adns__query_done(parent);
@@ -820,32 +846,115 @@ static adns_status pa_host_raw(const parseinfo *pai, int cbyte,
 }
 
 /*
- * _hostaddr   (pap,pa,dip,di,mfp,mf,csp,cs +pap_findaddrs, icb_hostaddr)
+ * _hostaddr   (pap,pa,skp,sk,mfp,mf,csp,cs
+ *		+glue_namehash, glue_nameeq, glue_build, pap_findaddrs,
+ *		 icb_hostaddr, hostaddr_samehost, hostaddr_coalesce)
  */
 
-static adns_status pap_findaddrs(const parseinfo *pai, adns_rr_hostaddr *ha,
-				 unsigned *want_io, size_t addrsz,
-				 int *cbyte_io, int count, int dmstart) {
-  int rri, naddrs;
-  unsigned typef, want= *want_io, need= want;
-  int type, class, rdlen, rdend, rdstart, ownermatched;
+static adns_status glue_namehash(const parseinfo *pai, int dmstart,
+				 unsigned *hash_r) {
+  findlabel_state fls;
+  int lablen, labstart, i;
+  unsigned hash= 0;
+  adns_status st;
+
+  adns__findlabel_start(&fls, pai->ads, -1,0, pai->dgram, pai->dglen,
+			pai->dglen, dmstart, 0);
+  for (;;) {
+    st= adns__findlabel_next(&fls, &lablen, &labstart);
+    if (st) return st;
+    if (lablen <= 0) break;
+    hash= hash*31 + lablen;
+    for (i=0; i<lablen; i++)
+      hash= hash*31 + ctype_toupper(pai->dgram[labstart+i]);
+  }
+  *hash_r= hash;
+  return adns_s_ok;
+}
+
+static int glue_nameeq(const parseinfo *pai, int adm, int bdm) {
+  findlabel_state afls, bfls;
+  int alablen, alabstart, blablen, blabstart;
+  adns_status st;
+
+  adns__findlabel_start(&afls, pai->ads, -1,0, pai->dgram, pai->dglen,
+			pai->dglen, adm, 0);
+  adns__findlabel_start(&bfls, pai->ads, -1,0, pai->dgram, pai->dglen,
+			pai->dglen, bdm, 0);
+  for (;;) {
+    st= adns__findlabel_next(&afls, &alablen, &alabstart);
+    if (st || alablen < 0) return 0;
+    st= adns__findlabel_next(&bfls, &blablen, &blabstart);
+    if (st || blablen < 0) return 0;
+    if (!adns__labels_equal(pai->dgram+alabstart, alablen,
+			    pai->dgram+blabstart, blablen))
+      return 0;
+    if (!alablen) return 1;
+  }
+}
+
+static adns_status glue_build(const parseinfo *pai) {
+  /* Scans the authority and additional sections once, recording every
+   * A and AAAA record, so that looking up glue for each hostaddr needn't
+   * rescan the whole datagram. */
+  struct glueindex *gi= pai->glue;
+  vbuf *vb= &pai->ads->gluevb;
+  struct glue_rr *g;
+  int rri, cbyte, owner, type, class, rdlen, rdstart;
   unsigned long ttl;
   adns_status st;
-  
-  for (rri=0, naddrs=0; rri<count; rri++) {
+
+  gi->n= 0;
+  gi->nns= -1;
+  cbyte= pai->nsstart;
+  for (rri=0; rri < pai->nscount + pai->arcount; rri++) {
+    if (rri == pai->nscount) gi->nns= gi->n;
+    owner= cbyte;
     st= adns__findrr_anychk(pai->qu, pai->serv, pai->dgram,
-			    pai->dglen, cbyte_io,
+			    pai->dglen, &cbyte,
 			    &type, &class, &ttl, &rdlen, &rdstart,
-			    pai->dgram, pai->dglen, dmstart, &ownermatched);
+			    0,0,0, 0);
     if (st) return st;
-    if (!ownermatched || class != DNS_CLASS_IN) continue;
-    typef= addr_rrtypeflag(type);
+    if (type == -1) break;
+    if (class != DNS_CLASS_IN || !addr_rrtypeflag(type)) continue;
+    if (!adns__vbuf_ensure(vb, (gi->n+1)*sizeof(*g))) R_NOMEM;
+    g= (struct glue_rr*)vb->buf + gi->n;
+    st= glue_namehash(pai, owner, &g->hash);  if (st) return st;
+    g->owner= owner;
+    g->type= type;
+    g->rdstart= rdstart;
+    g->rdlen= rdlen;
+    g->ttl= ttl;
+    gi->n++;
+  }
+  if (gi->nns < 0) gi->nns= gi->n;
+  gi->rrs= (struct glue_rr*)vb->buf;
+  gi->built= 1;
+  return adns_s_ok;
+}
+
+static adns_status pap_findaddrs(const parseinfo *pai, adns_rr_hostaddr *ha,
+				 unsigned *want_io, size_t addrsz,
+				 int from, int to,
+				 unsigned hash, int dmstart) {
+  const struct glue_rr *g;
+  int i, naddrs;
+  unsigned typef, want= *want_io, need= want;
+  int rdend, rdstart;
+  adns_status st;
+  
+  for (i=from, naddrs=0; i<to; i++) {
+    g= &pai->glue->rrs[i];
+    if (g->hash != hash) continue;
+    typef= addr_rrtypeflag(g->type);
     if (!(want & typef)) continue;
+    if (!glue_nameeq(pai, g->owner, dmstart)) continue;
     need &= ~typef;
     if (!adns__vbuf_ensure(&pai->qu->vb, (naddrs+1)*addrsz)) R_NOMEM;
-    adns__update_expires(pai->qu,ttl,pai->now);
-    rdend= rdstart + rdlen;
-    st= pap_addr(pai, type, addrsz, &rdstart, rdend,
+    adns__update_expires(pai->qu,g->ttl,pai->now);
+    rdstart= g->rdstart;
+    rdend= rdstart + g->rdlen;
+    st= pap_addr(pai, g->type, addrsz, &rdstart, rdend,
 		 (adns_rr_addr *)(pai->qu->vb.buf + naddrs*addrsz));
     if (st) return st;
     if (rdstart != rdend) return adns_s_invaliddata;
@@ -858,8 +967,10 @@ static adns_status pap_findaddrs(const parseinfo *pai, adns_rr_hostaddr *ha,
     ha->astatus= adns_s_ok;
 
     if (!need) {
-      adns__isort(ha->addrs, naddrs, addrsz, pai->qu->vb.buf,
-		  div_addr, pai->ads);
+      if (!adns__vbuf_ensure(&pai->qu->vb, SORT_TEMPSZ(naddrs,addrsz)))
+	R_NOMEM;
+      adns__sort(ha->addrs, naddrs, addrsz, pai->qu->vb.buf,
+		 skv_addr, pai->ads);
     }
   }
   *want_io= need;
@@ -868,10 +979,11 @@ static adns_status pap_findaddrs(const parseinfo *pai, adns_rr_hostaddr *ha,
 
 static void icb_hostaddr(adns_query parent, adns_query child) {
   adns_answer *cans= child->answer;
-  adns_rr_hostaddr *rrp= child->ctx.pinfo.hostaddr;
+  adns_rr_hostaddr *rrp= child->ctx.pinfo.hostaddr.rrp, *dup;
   adns_state ads= parent->ads;
   adns_status st;
   size_t addrsz= gsz_addr(0, parent->answer->type);
+  int i;
 
   st= cans->status == adns_s_nodata ? adns_s_ok : cans->status;
   if (st) goto done;
@@ -884,10 +996,10 @@ static void icb_hostaddr(adns_query parent, adns_query child) {
   if (st) goto done;
   if (!rrp->naddrs) { st= adns_s_nodata; goto done; }
 
-  if (!adns__vbuf_ensure(&parent->vb, addrsz))
+  if (!adns__vbuf_ensure(&parent->vb, SORT_TEMPSZ(rrp->naddrs,addrsz)))
     { st= adns_s_nomemory; goto done; }
-  adns__isort(rrp->addrs, rrp->naddrs, addrsz, parent->vb.buf,
-	      div_addr, ads);
+  adns__sort(rrp->addrs, rrp->naddrs, addrsz, parent->vb.buf,
+	     skv_addr, ads);
 
 done:
   if (st) {
@@ -897,6 +1009,26 @@ done:
   }
 
   rrp->astatus= st;
+
+  /* Any other RRs for the same host had exactly the same glue as rrp,
+   * so they end up with exactly the same addresses. */
+  for (i=0; i<child->ctx.pinfo.hostaddr.ndups; i++) {
+    dup= child->ctx.pinfo.hostaddr.dups[i];
+    adns__free_interim(parent, dup->addrs);
+    dup->addrs= 0;
+    dup->naddrs= rrp->naddrs;
+    dup->astatus= rrp->astatus;
+    if (rrp->naddrs > 0) {
+      dup->addrs= adns__alloc_interim(parent, rrp->naddrs*addrsz);
+      if (!dup->addrs) {
+	dup->naddrs= -1;
+	dup->astatus= adns_s_nomemory;
+	continue;
+      }
+      memcpy(dup->addrs, rrp->addrs, rrp->naddrs*addrsz);
+    }
+  }
+
   if (parent->children.head) {
     LIST_LINK_TAIL(ads->childw,parent);
   } else {
@@ -904,6 +1036,42 @@ done:
   }
 }
 
+static int hostaddr_samehost(const char *a, const char *b) {
+  int al= strlen(a), bl= strlen(b);
+  return adns__labels_equal((const byte*)a, al, (const byte*)b, bl);
+}
+
+static adns_status hostaddr_coalesce(adns_query qu, adns_rr_hostaddr *rrp,
+				     unsigned want) {
+  /* If we have already submitted a child query for the same host, and
+   * the same address families, arrange for rrp to get a copy of its
+   * answer instead of making another.  Returns adns_s_ok if so, or
+   * adns_s_nodata if there is no such child. */
+  adns_query cqu;
+  adns_rr_hostaddr **ndups;
+  int nadups;
+
+  for (cqu= qu->children.head; cqu; cqu= cqu->siblings.next) {
+    if (cqu->ctx.callback != icb_hostaddr ||
+	cqu->ctx.tinfo.addr.want != want ||
+	!hostaddr_samehost(cqu->ctx.pinfo.hostaddr.rrp->host, rrp->host))
+      continue;
+    if (cqu->ctx.pinfo.hostaddr.ndups == cqu->ctx.pinfo.hostaddr.adups) {
+      nadups= cqu->ctx.pinfo.hostaddr.adups*2 + 4;
+      ndups= adns__alloc_mine(qu, nadups*sizeof(*ndups));
+      if (!ndups) R_NOMEM;
+      if (cqu->ctx.pinfo.hostaddr.ndups)
+	memcpy(ndups, cqu->ctx.pinfo.hostaddr.dups,
+	       cqu->ctx.pinfo.hostaddr.ndups*sizeof(*ndups));
+      cqu->ctx.pinfo.hostaddr.dups= ndups;
+      cqu->ctx.pinfo.hostaddr.adups= nadups;
+    }
+    cqu->ctx.pinfo.hostaddr.dups[cqu->ctx.pinfo.hostaddr.ndups++]= rrp;
+    return adns_s_ok;
+  }
+  return adns_s_nodata;
+}
+
 static adns_status pap_hostaddr(const parseinfo *pai, int *cbyte_io,
 				int max, adns_rr_hostaddr *rrp) {
   adns_status st;
@@ -912,7 +1080,7 @@ static adns_status pap_hostaddr(const parseinfo *pai, int *cbyte_io,
   int id;
   adns_query nqu;
   adns_queryflags nflags;
-  unsigned want;
+  unsigned want, hash;
   size_t addrsz= gsz_addr(0, pai->qu->answer->type);
 
   dmstart= cbyte= *cbyte_io;
@@ -925,18 +1093,26 @@ static adns_status pap_hostaddr(const parseinfo *pai, int *cbyte_io,
   rrp->naddrs= 0;
   rrp->addrs= 0;
 
-  cbyte= pai->nsstart;
+  if (!pai->glue->built) {
+    st= glue_build(pai);  if (st) return st;
+  }
+  st= glue_namehash(pai, dmstart, &hash);  if (st) return st;
 
   want= addr_rrtypes(pai->ads, pai->qu->answer->type, pai->qu->flags);
 
-  st= pap_findaddrs(pai, rrp, &want, addrsz, &cbyte, pai->nscount, dmstart);
+  st= pap_findaddrs(pai, rrp, &want, addrsz,
+		    0, pai->glue->nns, hash, dmstart);
   if (st) return st;
   if (!want) return adns_s_ok;
 
-  st= pap_findaddrs(pai, rrp, &want, addrsz, &cbyte, pai->arcount, dmstart);
+  st= pap_findaddrs(pai, rrp, &want, addrsz,
+		    pai->glue->nns, pai->glue->n, hash, dmstart);
   if (st) return st;
   if (!want) return adns_s_ok;
 
+  st= hostaddr_coalesce(pai->qu, rrp, want);
+  if (st != adns_s_nodata) return st;
+
   st= adns__mkquery_frdgram(pai->ads, &pai->qu->vb, &id,
 			    pai->dgram, pai->dglen, dmstart,
 			    adns_r_addr, adns_qf_quoteok_query);
@@ -944,7 +1120,8 @@ static adns_status pap_hostaddr(const parseinfo *pai, int *cbyte_io,
 
   ctx.ext= 0;
   ctx.callback= icb_hostaddr;
-  ctx.pinfo.hostaddr= rrp;
+  memset(&ctx.pinfo,0,sizeof(ctx.pinfo));
+  ctx.pinfo.hostaddr.rrp= rrp;
   
   nflags= adns_qf_quoteok_query | (pai->qu->flags & (adns_qf_want_allaf |
 						     adns_qf_ipv6_mapv4));
@@ -969,19 +1146,25 @@ static adns_status pa_hostaddr(const parseinfo *pai, int cbyte,
   return adns_s_ok;
 }
 
-static int dip_hostaddr(adns_state ads,
-			const adns_rr_hostaddr *ap, const adns_rr_hostaddr *bp) {
-  if (ap->astatus != bp->astatus) return ap->astatus;
-  if (ap->astatus) return 0;
+#define SKP_HOSTADDR_FAILED 0x4000
+#define SKP_HOSTADDR_MAX 0x7fff
 
-  return dip_sockaddr(ads, &ap->addrs[0].addr.sa, &bp->addrs[0].addr.sa);
+static int skp_hostaddr(adns_state ads, const adns_rr_hostaddr *rrp) {
+  /* Hosts whose addresses we failed to find go last, in order of
+   * status, so that temporary failures come before permanent ones.
+   * The result is always <= SKP_HOSTADDR_MAX, which is what sk_mx
+   * relies on. */
+  int sk;
+
+  if (rrp->astatus) return SKP_HOSTADDR_FAILED + rrp->astatus;
+  sk= search_sortlist_sa(ads, &rrp->addrs[0].addr.sa);
+  return sk < SKP_HOSTADDR_FAILED ? sk : SKP_HOSTADDR_FAILED-1;
 }
 
-static int di_hostaddr(adns_state ads,
-		       const void *datap_a, const void *datap_b) {
-  const adns_rr_hostaddr *ap= datap_a, *bp= datap_b;
+static int sk_hostaddr(adns_state ads, const void *datap) {
+  const adns_rr_hostaddr *rrp= datap;
 
-  return dip_hostaddr(ads, ap,bp);
+  return skp_hostaddr(ads, rrp);
 }
 
 static void mfp_hostaddr(adns_query qu, adns_rr_hostaddr *rrp) {
@@ -1040,7 +1223,7 @@ static adns_status cs_hostaddr(vbuf *vb, const void *datap) {
 }
 
 /*
- * _mx_raw   (pa,di)
+ * _mx_raw   (pa,sk)
  */
 
 static adns_status pa_mx_raw(const parseinfo *pai, int cbyte,
@@ -1061,16 +1244,14 @@ static adns_status pa_mx_raw(const parseinfo *pai, int cbyte,
   return adns_s_ok;
 }
 
-static int di_mx_raw(adns_state ads, const void *datap_a, const void *datap_b) {
-  const adns_rr_intstr *ap= datap_a, *bp= datap_b;
+static int sk_mx_raw(adns_state ads, const void *datap) {
+  const adns_rr_intstr *rrp= datap;
 
-  if (ap->i < bp->i) return 0;
-  if (ap->i > bp->i) return 1;
-  return 0;
+  return rrp->i;
 }
 
 /*
- * _mx   (pa,di)
+ * _mx   (pa,sk)
  */
 
 static adns_status pa_mx(const parseinfo *pai, int cbyte,
@@ -1090,12 +1271,11 @@ static adns_status pa_mx(const parseinfo *pai, int cbyte,
   return adns_s_ok;
 }
 
-static int di_mx(adns_state ads, const void *datap_a, const void *datap_b) {
-  const adns_rr_inthostaddr *ap= datap_a, *bp= datap_b;
+static int sk_mx(adns_state ads, const void *datap) {
+  const adns_rr_inthostaddr *rrp= datap;
 
-  if (ap->i < bp->i) return 0;
-  if (ap->i > bp->i) return 1;
-  return dip_hostaddr(ads, &ap->ha, &bp->ha);
+  /* preference is 16 bits, so this fits in an int */
+  return (rrp->i << 15) | skp_hostaddr(ads, &rrp->ha);
 }
 
 /*
@@ -1416,7 +1596,7 @@ static adns_status cs_soa(vbuf *vb, const void *datap) {
 }
 
 /*
- * _srv*  (ckl,(pap),pa*2,mf*2,di,(csp),cs*2,postsort)
+ * _srv*  (ckl,(pap),pa*2,mf*2,sk,(csp),cs*2,postsort)
  */
 
 static adns_status ckl_srv(adns_state ads, adns_queryflags flags,
@@ -1484,13 +1664,11 @@ static void mf_srvha(adns_query qu, void *datap) {
   mfp_hostaddr(qu,&rrp->ha);
 }
 
-static int di_srv(adns_state ads, const void *datap_a, const void *datap_b) {
-  const adns_rr_srvraw *ap= datap_a, *bp= datap_b;
+static int sk_srv(adns_state ads, const void *datap) {
+  const adns_rr_srvraw *rrp= datap;
     /* might be const adns_rr_svhostaddr* */
 
-  if (ap->priority < bp->priority) return 0;
-  if (ap->priority > bp->priority) return 1;
-  return 0;
+  return rrp->priority;
 }
 
 static adns_status csp_srv_begin(vbuf *vb, const adns_rr_srvha *rrp
@@ -1517,60 +1695,37 @@ static adns_status cs_srvha(vbuf *vb, const void *datap) {
   return csp_hostaddr(vb,&rrp->ha);
 }
 
+static int weight_srv(const void *datap) {
+  const adns_rr_srvha *rr= datap;
+  return rr->weight;
+}
+
 static void postsort_srv(adns_state ads, void *array, int nrrs,int rrsz,
-			 const struct typeinfo *typei) {
+			 void *tempbuf, const struct typeinfo *typei) {
   /* we treat everything in the array as if it were an adns_rr_srvha
    * even though the array might be of adns_rr_srvraw.  That's OK
    * because they have the same prefix, which is all we access.
    * We use rrsz, too, rather than naive array indexing, of course.
    */
-  char *workbegin, *workend, *search, *arrayend;
+  char *workbegin, *workend, *arrayend;
   const adns_rr_srvha *rr;
-  union { adns_rr_srvha ha; adns_rr_srvraw raw; } rrtmp;
-  int cpriority, totalweight, runtotal;
-  long randval;
+  int cpriority;
 
-  assert(rrsz <= sizeof(rrtmp));
   for (workbegin= array, arrayend= workbegin + rrsz * nrrs;
        workbegin < arrayend;
        workbegin= workend) {
     cpriority= (rr=(void*)workbegin)->priority;
     
-    for (workend= workbegin, totalweight= 0;
+    for (workend= workbegin;
 	 workend < arrayend && (rr=(void*)workend)->priority == cpriority;
-	 workend += rrsz) {
-      totalweight += rr->weight;
-    }
+	 workend += rrsz);
 
     /* Now workbegin..(workend-1) incl. are exactly all of the RRs of
-     * cpriority.  From now on, workbegin points to the `remaining'
-     * records: we select one record at a time (RFC2782 `Usage rules'
-     * and `Format of the SRV RR' subsection `Weight') to place at
-     * workbegin (swapping with the one that was there, and then
-     * advance workbegin. */
-    for (;
-	 workbegin + rrsz < workend; /* don't bother if just one */
-	 workbegin += rrsz) {
-      
-      randval= nrand48(ads->rand48xsubi);
-      randval %= (totalweight + 1);
-        /* makes it into 0..totalweight inclusive; with 2^10 RRs,
-	 * totalweight must be <= 2^26 so probability nonuniformity is
-	 * no worse than 1 in 2^(31-26) ie 1 in 2^5, ie
-	 *  abs(log(P_intended(RR_i) / P_actual(RR_i)) <= log(2^-5).
-	 */
-
-      for (search=workbegin, runtotal=0;
-	   (runtotal += (rr=(void*)search)->weight) < randval;
-	   search += rrsz);
-      assert(search < arrayend);
-      totalweight -= rr->weight;
-      if (search != workbegin) {
-	memcpy(&rrtmp, workbegin, rrsz);
-	memcpy(workbegin, search, rrsz);
-	memcpy(search, &rrtmp, rrsz);
-      }
-    }
+     * cpriority.  We select one record at a time (RFC2782 `Usage
+     * rules' and `Format of the SRV RR' subsection `Weight') to place
+     * at the front of the remaining records. */
+    adns__wshuffle(workbegin, (workend - workbegin) / rrsz, rrsz, tempbuf,
+		   weight_srv, ads->rand48xsubi);
   }
   /* tests:
    *  dig -t srv _srv._tcp.test.iwj.relativity.greenend.org.uk.
@@ -1641,22 +1796,22 @@ static void mf_flat(adns_query qu, void *data) { }
 
 #define TYPESZ_M(member)           (sizeof(*((adns_answer*)0)->rrs.member))
 
-#define DEEP_TYPE(code,rrt,fmt,memb,parser,comparer,/*printer*/...)	\
+#define DEEP_TYPE(code,rrt,fmt,memb,parser,sortkey,/*printer*/...)	\
  { adns_r_##code&adns_rrt_reprmask, rrt,fmt,TYPESZ_M(memb), mf_##memb,	\
-     GLUE(cs_, CAR(__VA_ARGS__)),pa_##parser,di_##comparer,		\
+     GLUE(cs_, CAR(__VA_ARGS__)),pa_##parser,sk_##sortkey,		\
      adns__ckl_hostname, 0, adns__getrrsz_default, adns__query_send,	\
      CDR(__VA_ARGS__) }
-#define FLAT_TYPE(code,rrt,fmt,memb,parser,comparer,/*printer*/...)	\
+#define FLAT_TYPE(code,rrt,fmt,memb,parser,sortkey,/*printer*/...)	\
  { adns_r_##code&adns_rrt_reprmask, rrt,fmt,TYPESZ_M(memb), mf_flat,	\
-     GLUE(cs_, CAR(__VA_ARGS__)),pa_##parser,di_##comparer,		\
+     GLUE(cs_, CAR(__VA_ARGS__)),pa_##parser,sk_##sortkey,		\
      adns__ckl_hostname, 0, adns__getrrsz_default, adns__query_send,	\
      CDR(__VA_ARGS__) }
 
-#define di_0 0
+#define sk_0 0
 
 static const typeinfo typeinfos[] = {
 /* Must be in ascending order of rrtype ! */
-/* mem-mgmt code  rrt     fmt   member   parser      comparer  printer */
+/* mem-mgmt code  rrt     fmt   member   parser      sortkey   printer */
 
 FLAT_TYPE(a,      "A",     0,   inaddr,    inaddr,  inaddr,inaddr          ),
 DEEP_TYPE(ns_raw, "NS",   "raw",str,       host_raw,0,     domain          ),